@@ -14,6 +14,7 @@
 #include "object-name.h"
 #include "object-file.h"
 #include "commit.h"
+#include "tag.h"
 #include "commit-reach.h"
 #include "diff.h"
 #include "revision.h"
@@ -25,11 +26,25 @@
 #include "cache-tree.h"
 #include "wt-status.h"
 #include "dir.h"
+#include "fsmonitor.h"
+#include "fsmonitor-settings.h"
 #include "oidset.h"
-#include "oidmap.h"
 #include "remote.h"
 #include "hex.h"
+#include "commit-graph.h"
+#include "commit-slab.h"
+#include "prio-queue.h"
+#include "sigchain.h"
+#include "symlinks.h"
+#include "thread-utils.h"
+#include "strvec.h"
+#include "unix-socket.h"
+#include "submodule.h"
+#include "json-writer.h"
+#include <poll.h>
 #include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 
@@ -59,6 +74,15 @@
 #define MAX_TRAVERSAL_DEFAULT                                                                      \
 	1000		    /* Default traversal limit per phase (balances accuracy vs speed) */
 #define BFS_QUEUE_SIZE 2048 /* Power of 2 for fast modulo via bitwise AND */
+#define BFS_MAX_TARGETS 4   /* Comparison targets per divergence search */
+#define BFS_MAX_SIDES (BFS_MAX_TARGETS + 1) /* Start side plus one per target */
+#define BFS_DEADLINE_INTERVAL 64 /* Commits (or BFS rounds) between --deadline-ms checks */
+
+/* Daemon mode */
+#define DAEMON_SOCKET_NAME "prompt-daemon.sock" /* Created inside the git dir */
+#define DAEMON_IDLE_TIMEOUT_MS (30 * 60 * 1000)  /* Exit after 30 minutes without clients */
+#define DAEMON_CLIENT_TIMEOUT_MS 2000		 /* Daemon side: request read and reply write */
+#define DAEMON_REPLY_WAIT_MS 250		 /* Client: then render in-process instead */
 
 /*
  * PERFORMANCE ANALYSIS: Function Complexity and Large Repo Mode Safety
@@ -70,37 +94,51 @@
  *
  * SAFE FOR LARGE REPO MODE (can call without performance penalty):
  * ----------------------------------------------------------------
- * - is_large_repo()              O(1)      - Single stat() syscall
+ * - is_large_repo()              O(1)*     - Single stat() syscall (*O(n) header scan for
+ *                                            sparse checkouts over the threshold)
  * - get_git_state()              O(1)*     - File existence checks (*O(n) if checking conflicts)
  * - check_git_state_file()       O(1)*     - File access() syscall (*O(n) if checking conflicts)
+ * - has_unmerged_files_mapped()  O(n)      - Entry header scan of the mapped index, threaded
+ *                                            over IEOT blocks, stops at the first conflict
  * - get_misc_indicators()        O(1)      - Flag checks and ref existence
+ * - tag_index_lookup()           O(log t)  - Binary search in the mapped tag reverse index
  * - get_tracking_indicators()    O(commits)- Graph traversal (limited by max_traversal)
- * - bfs_find_divergence()        O(commits)- BFS limited by max_traversal parameter
- * - read_divergence_cache()      O(1)      - Single file read
- * - write_divergence_cache()     O(1)      - Single file write
+ * - bfs_find_divergence()        O(commits)- One walk for all targets, limited by max_traversal
+ * - interleaved_bfs_walk()       O(commits)- Round-robin BFS, one queue per side
+ * - generation_walk()            O(commits)- Commit-graph walk, same limit (pooled)
+ * - count_divergence_exact()     O(commits)- Paints the symmetric difference, same limit
+ * - read_divergence_cache()      O(1)      - mmap() and probe of at most 64 records
+ * - write_divergence_cache()     O(1)      - Bounded file rewrite
  *
  * UNSAFE FOR LARGE REPO MODE (expensive, currently skipped):
  * ----------------------------------------------------------
- * - has_unmerged_files()         O(n)      - Scans all index entries
+ * - has_unmerged_files()         O(n)      - Scans all index entries (large repos use
+ *                                            has_unmerged_files_mapped())
  * - has_staged_changes()         O(n)      - Scans index, rebuilds cache-tree
- * - has_worktree_changes()       O(n+m)    - Stats all tracked files in worktree
+ * - has_worktree_changes()       O(n)      - Stats tracked files until the first change
+ * - has_submodule_changes()      O(s)*     - HEAD per submodule, then parallel status runs
+ *                                            (*opt-in with --submodules, time-budgeted)
  * - get_branch_name_and_color()  O(n+m)*   - Calls has_worktree_changes() and has_staged_changes()
  *                                           (*O(1) for branch name, expensive for color)
  *
  * CURRENT LARGE REPO MODE BEHAVIOR:
  * - Branch color: GRAY (skip status checks) UNLESS conflicts detected (then RED)
+ *   - With core.fsmonitor: real colors, only paths reported changed are stat()ed;
+ *     untracked files are checked only when the untracked cache is enabled
+ *     (without it a clean tree stays GRAY)
  * - Branch name: Still computed (cheap ref operations)
  * - Tracking indicators: Still computed (graph operations, bounded by max_traversal)
  * - Misc indicators: Still computed (cheap file checks)
- * - Git state detection: FULLY computed - index loaded conditionally when git operations detected
+ * - Git state detection: FULLY computed - mapped index scanned when git operations detected
  *   - State file check is O(1) (fast)
- *   - Index loaded ONLY when merge/rebase/cherry-pick/revert detected
+ *   - Index scanned ONLY when merge/rebase/cherry-pick/revert detected
  *   - Conflict detection is O(n) but critical, so worth the cost during active operations
  *
  * RATIONALE FOR CONFLICT DETECTION IN LARGE REPOS:
  * - Conflicts are CRITICAL information that must always be accurate
  * - Checking for state files is O(1) (5 fast access() calls)
- * - Loading index is O(n) but only happens during active git operations
+ * - Scanning entry headers is O(n), without the cost of a full index load, and only
+ *   happens during active git operations
  * - During merge/rebase, users NEED to see conflict status immediately
  * - Normal large repo usage (no active operations) remains fast
  */
@@ -111,24 +149,41 @@ static int debug_mode = 0;
 static long large_repo_size = LARGE_REPO_INDEX_SIZE;
 static int local_mode = 0;
 static int max_traversal = MAX_TRAVERSAL_DEFAULT;
-
-/* Debug timing macros */
-#define DEBUG_TIMER_START(name)                                                                    \
-	struct timeval tv_start_##name, tv_end_##name;                                             \
-	if (debug_mode)                                                                            \
-		gettimeofday(&tv_start_##name, NULL);
+static int daemon_mode = 0;
+static int resume_search = 0;
+static int exact_counts = 0;
+static int deadline_ms = 0; /* --deadline-ms, 0 for no deadline */
+static int stale_while_revalidate = 0;
+static int prompt_cache_ttl = 0; /* --prompt-cache, 0 when disabled */
+static int write_index = 0; /* --write-index */
+static int config_snapshot = 0; /* --config-snapshot */
+static int warm_mode = 0; /* --warm, run as a git hook */
+static int single_flight = 0; /* --single-flight */
+static int latency_target_ms = 0; /* --latency-target, 0 to use --large-repo-size */
+static int check_submodules = 0; /* --submodules */
+static const char *stats_format; /* --stats=<format> */
+static int decorations_loaded = 0; /* Set once get_name_decoration() has loaded all refs */
+
+/* Debug timing macros (monotonic clock); STATS_TIMER_END() adds the time to --stats */
+#define DEBUG_TIMER_START(name) uint64_t timer_start_##name = getnanotime()
 
 #define DEBUG_TIMER_END(name, label)                                                               \
 	if (debug_mode) {                                                                          \
-		gettimeofday(&tv_end_##name, NULL);                                                \
-		long usec = (tv_end_##name.tv_sec - tv_start_##name.tv_sec) * 1000000 +            \
-			    (tv_end_##name.tv_usec - tv_start_##name.tv_usec);                     \
-		fprintf(stderr, "[DEBUG] %s: %.3fms\n", label, usec / 1000.0);                     \
+		fprintf(stderr, "[DEBUG] %s: %.3fms\n", label,                                     \
+			(getnanotime() - timer_start_##name) / 1e6);                               \
 	}
 
+#define STATS_TIMER_END(name, phase) stats_phase_end(phase, timer_start_##name)
+
 static const char *const prompt_usage[] = {
 	"git prompt [--help] [--no-color] [--debug] [--large-repo-size=<bytes>] "
-	"[--max-traversal=<commits>] [--local]",
+	"[--max-traversal=<commits>] [--local] [--daemon] [--resume-search] [--exact-counts] "
+	"[--deadline-ms=<ms>] [--stale-while-revalidate] [--prompt-cache=<seconds>] "
+	"[--write-index] [--config-snapshot] [--single-flight] [--latency-target=<ms>] "
+	"[--submodules] [--stats=json]",
+	"git prompt (--scan=<dir> | --repos-from=<file>) [--json] [--scan-budget-ms=<ms>] "
+	"[<options>]",
+	"git prompt --warm [<options>] [<hook-arguments>...]",
 	NULL};
 
 static const char prompt_help[] =
@@ -142,7 +197,7 @@ static const char prompt_help[] =
 	"  Yellow  - Staged changes (ready to commit)\n"
 	"  Red     - Unstaged changes or conflicts (need attention)\n"
 	"  Cyan    - Untracked files only (informational)\n"
-	"  Gray    - Large repository (status check skipped for performance)\n"
+	"  Gray    - Large repository (status check skipped for performance, no fsmonitor)\n"
 	"\n"
 	"INDICATORS:\n"
 	"  ⚡        - Detached HEAD\n"
@@ -178,10 +233,51 @@ static const char prompt_help[] =
 	"  [feature] 💾          - On feature, has stashed changes\n"
 	"\n"
 	"PERFORMANCE:\n"
-	"  For large repositories (>5MB index), status checks are skipped for speed.\n"
+	"  For large repositories (>5MB index), status checks are skipped for speed,\n"
+	"  unless core.fsmonitor is enabled (then only changed paths are checked).\n"
 	"  Divergence calculation is limited to 1000 commits by default (configurable with "
 	"--max-traversal).\n"
-	"  Results are cached in .git/prompt-cache when BFS visits >=10 commits.\n"
+	"  Results are cached in .git/prompt-cache (up to 64 entries, LRU) when BFS visits\n"
+	"  >=10 commits.\n"
+	"  With --resume-search, a search that hits the limit is saved and continued by\n"
+	"  the next prompts (one max-traversal slice each) until the merge-base is found.\n"
+	"  By default ahead/behind are distances to the merge-base; --exact-counts counts\n"
+	"  commits like 'git rev-list --left-right --count' (exact on merge-heavy history).\n"
+	"  With --deadline-ms=<ms>, sections still running at the deadline give up: the\n"
+	"  branch turns gray (status unknown) and divergence shows ↕ (not cached).\n"
+	"  With --stale-while-revalidate, the prompt from the previous call is printed at\n"
+	"  once and a background process computes the fresh one for the next call.\n"
+	"  With --prompt-cache=<seconds>, the rendered prompt is reused without loading the\n"
+	"  index while HEAD, the index, refs, config and the worktree root are unchanged.\n"
+	"  With --write-index, refreshed stat data and the cache-tree are written back to\n"
+	"  the index (skipped if index.lock is held), so later prompts start warm.\n"
+	"  With --config-snapshot, the config keys the prompt uses are kept in\n"
+	"  .git/prompt-config and all config files are parsed only when one changed.\n"
+	"  With --stats=json, per-phase timings and counters are printed to stderr as one\n"
+	"  JSON object, for aggregation (see README).\n"
+	"  With --submodules, a clean worktree is followed by a check of each submodule\n"
+	"  (HEAD against the gitlink, then its tracked files), in parallel within 500ms.\n"
+	"  With --latency-target=<ms>, large repo mode is chosen from the status time\n"
+	"  measured in this repository (.git/prompt-status-cost) instead of the index size.\n"
+	"  With --single-flight, prompts started at the same time share one rendering:\n"
+	"  the first computes it, the others wait for its result in .git/prompt-flight.\n"
+	"\n"
+	"DAEMON MODE:\n"
+	"  git prompt --daemon & keeps the repository, config and index loaded and serves\n"
+	"  prompts over .git/prompt-daemon.sock. Plain 'git prompt' uses the socket when it\n"
+	"  exists and falls back to computing the prompt in-process otherwise.\n"
+	"\n"
+	"SCAN MODE:\n"
+	"  git prompt --scan=<dir> prints '<path>\\t<prompt>' for every repository below\n"
+	"  <dir> (or listed in --repos-from=<file>) as each one finishes, rendered by a\n"
+	"  pool of worker processes; --json prints {\"path\", \"status\", \"prompt\", \"ms\"}\n"
+	"  objects instead. Each repository gets --scan-budget-ms (default 1000) before\n"
+	"  it is reported as a timeout.\n"
+	"\n"
+	"CACHE WARM-UP:\n"
+	"  git prompt --warm, run from the reference-transaction or post-checkout hook,\n"
+	"  computes the divergence of the new ref state in the background so the next\n"
+	"  prompt is a cache hit.\n"
 	"\n"
 	"SHELL INTEGRATION:\n"
 	"  Bash:  PS1='$(git prompt)\\$ '\n"
@@ -193,21 +289,6 @@ static void show_help(void)
 	puts(prompt_help);
 }
 
-__attribute__((format(printf, 2, 3))) static void color_printf(const char *color, const char *fmt,
-							       ...)
-{
-	va_list ap;
-	if (use_color) {
-		printf("\001\033[01;%sm\002", color);
-	}
-	va_start(ap, fmt);
-	vprintf(fmt, ap);
-	va_end(ap);
-	if (use_color) {
-		printf("\001\033[00m\002");
-	}
-}
-
 __attribute__((format(printf, 3, 4))) static void
 strbuf_color_addf(struct strbuf *sb, const char *color, const char *fmt, ...)
 {
@@ -224,1256 +305,6873 @@ strbuf_color_addf(struct strbuf *sb, const char *color, const char *fmt, ...)
 }
 
 /*
- * Check if repository is large based on index file size.
- * Performance: O(1) - single stat() syscall
- * Safe for large repo mode: Yes (this determines large repo mode)
+ * Wall-clock budget (--deadline-ms) shared by all sections of one prompt.
+ * Sections poll deadline_expired() at natural checkpoints and degrade instead of
+ * blocking: GRAY when the status is unknown, ↕ when the divergence walk was cut
+ * short. Sections that gave up are reported with --debug.
  */
-static int is_large_repo(void)
+enum deadline_section {
+	DEADLINE_INDEX = 1 << 0,
+	DEADLINE_STATUS = 1 << 1,
+	DEADLINE_UNTRACKED = 1 << 2,
+	DEADLINE_DIVERGENCE = 1 << 3,
+	DEADLINE_SUBMODULES = 1 << 4, /* Also when the submodule budget ran out */
+};
+
+static uint64_t deadline_end; /* getnanotime() at the deadline, 0 if none */
+static uint64_t status_deadline_end; /* The same for all but the divergence walk */
+static unsigned deadline_hits; /* Sections that hit the deadline */
+static pthread_mutex_t deadline_mutex = PTHREAD_MUTEX_INITIALIZER; /* Sections run concurrently */
+
+static void deadline_start(void)
 {
-	struct stat st;
-	struct strbuf index_file = STRBUF_INIT;
+	deadline_end = deadline_ms > 0 ? getnanotime() + (uint64_t)deadline_ms * 1000000 : 0;
+	status_deadline_end = deadline_end;
+	deadline_hits = 0;
+}
 
-	strbuf_addf(&index_file, "%s/index", repo_get_git_dir(the_repository));
+/*
+ * Bring the deadline of the status sections forward to ms from now (for a status
+ * cost probe, see status_cost_large()); the divergence walk keeps its deadline.
+ */
+static void deadline_cap_status(int ms)
+{
+	uint64_t end = getnanotime() + (uint64_t)ms * 1000000;
 
-	if (!stat(index_file.buf, &st) && st.st_size > large_repo_size) {
-		strbuf_release(&index_file);
-		return 1;
+	if (!status_deadline_end || end < status_deadline_end) {
+		status_deadline_end = end;
 	}
-
-	strbuf_release(&index_file);
-	return 0;
 }
 
-
 /*
- * Git state information (merge, rebase, cherry-pick, etc.)
- * This is computed once and used both for branch color determination
- * and for displaying the state indicator in the prompt.
+ * Thread-safe check without bookkeeping, for the status section's worker threads.
  */
-struct git_state {
-	int has_state;		 /* 1 if any git operation is in progress */
-	int has_conflicts;	 /* 1 if unmerged files exist */
-	const char *state_name;	 /* e.g., "merge:conflict", "rebase:continue" */
-	const char *state_color; /* Color for the state indicator */
-};
+static int deadline_reached(void)
+{
+	return status_deadline_end && getnanotime() >= status_deadline_end;
+}
 
 /*
- * Check if the index (already loaded) has unmerged files.
- * Caller must ensure repo_read_index() was called successfully.
- * Performance: O(n) where n = number of index entries (worst case: full scan)
- *              In practice, returns early on first unmerged entry
- * Safe for large repo mode: No (requires loaded index, scans all entries)
+ * Return 1 (and remember the section) if the deadline has passed.
+ * Performance: O(1) - one clock read
  */
-static int has_unmerged_files(void)
+static int deadline_expired(enum deadline_section section)
 {
-	int i;
+	uint64_t end = section == DEADLINE_DIVERGENCE ? deadline_end : status_deadline_end;
 
-	for (i = 0; i < the_repository->index->cache_nr; i++) {
-		const struct cache_entry *ce = the_repository->index->cache[i];
-		if (ce_stage(ce)) {
-			return 1;
-		}
+	if (!end || getnanotime() < end) {
+		return 0;
 	}
+	pthread_mutex_lock(&deadline_mutex);
+	deadline_hits |= section;
+	pthread_mutex_unlock(&deadline_mutex);
+	return 1;
+}
 
-	return 0;
+static void deadline_report(void)
+{
+	if (!debug_mode || !deadline_hits) {
+		return;
+	}
+	fprintf(stderr, "[DEBUG] Deadline: %dms exceeded in:%s%s%s%s%s\n", deadline_ms,
+		deadline_hits & DEADLINE_INDEX ? " index" : "",
+		deadline_hits & DEADLINE_STATUS ? " status" : "",
+		deadline_hits & DEADLINE_UNTRACKED ? " untracked" : "",
+		deadline_hits & DEADLINE_DIVERGENCE ? " divergence" : "",
+		deadline_hits & DEADLINE_SUBMODULES ? " submodules" : "");
 }
 
 /*
- * Check if there are staged changes (index differs from HEAD).
- *
- * Uses cache-tree to efficiently detect if the index matches HEAD's tree.
- * If cache-tree is invalid, we rebuild it to get an accurate comparison.
- *
- * Special case: During conflicts (merge/rebase/cherry-pick), unmerged entries
- * count as staged changes even if cache-tree matches HEAD.
- *
- * Performance: O(n) where n = number of index entries
- *              cache_tree_update() rebuilds cache-tree by scanning index
- * Safe for large repo mode: No (requires loaded index, potentially expensive)
- *
- * Returns 1 if there are staged changes, 0 otherwise.
+ * Metrics (--stats=json): wall time per phase from getnanotime() (a monotonic
+ * clock) and work counters, printed to stderr as one JSON object per prompt for
+ * aggregation across machines. Counters are bumped from the status section, its
+ * worker threads and the tracking thread, hence atomically; phase times are
+ * written by the one thread that runs the phase.
  */
-static int has_staged_changes(struct repository *r, const struct object_id *head_oid,
-			      const struct git_state *state)
-{
-	struct index_state *istate;
+enum stats_phase {
+	STATS_CONFIG,
+	STATS_INDEX,
+	STATS_REFRESH,
+	STATS_STAGED,
+	STATS_UNTRACKED,
+	STATS_SUBMODULES,
+	STATS_DIVERGENCE,
+	STATS_PHASES
+};
 
-	/* Ensure index is loaded */
-	if (repo_read_index(r) < 0) {
-		return 0;
-	}
+static const char *const stats_phase_names[STATS_PHASES] = {
+	"config", "index_load", "refresh", "staged", "untracked", "submodules", "divergence",
+};
 
-	istate = r->index;
+#define STATS_MAX_WALKS 4
 
-	/*
-	 * During conflicts, unmerged entries are considered staged changes.
-	 * Check this FIRST before doing cache-tree comparison, because
-	 * cache_tree_update() can succeed and match HEAD even when unmerged entries exist.
-	 */
-	if (state->has_conflicts) {
-		if (debug_mode) {
-			fprintf(stderr, "[DEBUG] has_staged_changes = 1 (conflicts present)\n");
-		}
-		return 1;
-	}
+struct stats_walk {
+	const char *algorithm; /* "generation", "bfs" or "exact" */
+	uint64_t ns;
+	int commits_visited;
+};
 
-	/* Get HEAD's tree for comparison */
-	struct commit *head_commit = lookup_commit(r, head_oid);
-	if (!head_commit || repo_parse_commit(r, head_commit)) {
-		/* Can't parse HEAD, conservatively report no changes */
-		if (debug_mode) {
-			fprintf(stderr, "[DEBUG] has_staged_changes = 0 (can't parse HEAD)\n");
-		}
-		return 0;
-	}
+static struct {
+	uint64_t phase_ns[STATS_PHASES];
+	struct stats_walk walks[STATS_MAX_WALKS];
+	int nr_walks;
+	uint64_t commits_from_graph; /* Parsed from the commit-graph */
+	uint64_t commits_inflated;   /* Parsed from the object database */
+	uint64_t cache_hits;	     /* Divergence cache, including adjusted entries */
+	uint64_t cache_misses;
+	uint64_t cache_writes;
+	uint64_t lstat_calls; /* Worktree and untracked checks */
+	uint64_t queue_max;   /* Largest walk frontier */
+	int large_repo;
+} prompt_stats;
+
+static int stats_json; /* --stats=json */
+
+#define STATS_ADD(field, n)                                                                        \
+	do {                                                                                       \
+		if (stats_json)                                                                    \
+			__atomic_add_fetch(&prompt_stats.field, (n), __ATOMIC_RELAXED);            \
+	} while (0)
+
+static void stats_phase_end(enum stats_phase phase, uint64_t start_ns)
+{
+	prompt_stats.phase_ns[phase] += getnanotime() - start_ns;
+}
 
-	struct tree *head_tree = repo_get_commit_tree(r, head_commit);
-	if (!head_tree) {
-		if (debug_mode) {
-			fprintf(stderr, "[DEBUG] has_staged_changes = 0 (can't get HEAD tree)\n");
-		}
-		return 0;
+static void stats_walk_end(const char *algorithm, uint64_t start_ns, int commits_visited)
+{
+	struct stats_walk *walk;
+
+	if (!stats_json || prompt_stats.nr_walks >= STATS_MAX_WALKS) {
+		return;
 	}
+	walk = &prompt_stats.walks[prompt_stats.nr_walks++];
+	walk->algorithm = algorithm;
+	walk->ns = getnanotime() - start_ns;
+	walk->commits_visited = commits_visited;
+}
 
-	/*
-	 * Ensure cache-tree is valid by updating it if needed.
-	 * cache_tree_update() rebuilds the cache-tree from the index.
-	 * If it succeeds, cache_tree->oid represents the tree the index would create.
-	 */
-	if (!istate->cache_tree) {
-		istate->cache_tree = cache_tree();
+/*
+ * Record the size of a walk frontier (walks run on the tracking thread only).
+ */
+static inline void stats_queue_size(size_t nr)
+{
+	if (nr > prompt_stats.queue_max) {
+		prompt_stats.queue_max = nr;
 	}
+}
 
-	if (cache_tree_update(istate, 0) < 0) {
-		/* Cache-tree update failed, fall back to conservative answer */
-		if (debug_mode) {
-			fprintf(stderr,
-				"[DEBUG] has_staged_changes = 0 (cache-tree update failed)\n");
+/*
+ * repo_parse_commit() that counts, for --stats, where newly parsed commits
+ * came from.
+ */
+static int parse_commit_counted(struct commit *commit)
+{
+	int was_parsed = commit->object.parsed;
+	int ret = repo_parse_commit(the_repository, commit);
+
+	if (stats_json && !was_parsed && !ret) {
+		if (commit_graph_position(commit) != COMMIT_NOT_FROM_GRAPH) {
+			STATS_ADD(commits_from_graph, 1);
+		} else {
+			STATS_ADD(commits_inflated, 1);
 		}
-		return 0;
 	}
+	return ret;
+}
 
-	/* Compare cache-tree OID with HEAD tree OID */
-	int has_changes = !oideq(&istate->cache_tree->oid, &head_tree->object.oid);
+static void stats_add_ms(struct json_writer *jw, const char *key, uint64_t ns)
+{
+	jw_object_double(jw, key, 3, ns / 1e6);
+}
 
-	if (debug_mode) {
-		fprintf(stderr, "[DEBUG] has_staged_changes = %d (cache-tree OID %s HEAD tree)\n",
-			has_changes, has_changes ? "!=" : "==");
+/*
+ * Print the metrics of this prompt. source says where the prompt came from:
+ * "rendered", "prompt-cache", "single-flight" or "last-prompt".
+ */
+static void stats_report(const char *source, uint64_t start_ns)
+{
+	struct json_writer jw = JSON_WRITER_INIT;
+	int commits_visited = 0;
+
+	if (!stats_json) {
+		return;
 	}
 
-	return has_changes;
+	jw_object_begin(&jw, 0);
+	jw_object_intmax(&jw, "version", 1);
+	jw_object_string(&jw, "source", source);
+	stats_add_ms(&jw, "total_ms", getnanotime() - start_ns);
+	jw_object_bool(&jw, "large_repo", prompt_stats.large_repo);
+	jw_object_inline_begin_object(&jw, "phases_ms");
+	for (int i = 0; i < STATS_PHASES; i++) {
+		stats_add_ms(&jw, stats_phase_names[i], prompt_stats.phase_ns[i]);
+	}
+	jw_end(&jw);
+
+	jw_object_inline_begin_array(&jw, "walks");
+	for (int i = 0; i < prompt_stats.nr_walks; i++) {
+		const struct stats_walk *walk = &prompt_stats.walks[i];
+
+		jw_array_inline_begin_object(&jw);
+		jw_object_string(&jw, "algorithm", walk->algorithm);
+		stats_add_ms(&jw, "ms", walk->ns);
+		jw_object_intmax(&jw, "commits_visited", walk->commits_visited);
+		jw_end(&jw);
+		commits_visited += walk->commits_visited;
+	}
+	jw_end(&jw);
+
+	jw_object_inline_begin_object(&jw, "counters");
+	jw_object_intmax(&jw, "commits_visited", commits_visited);
+	jw_object_intmax(&jw, "commits_from_graph", prompt_stats.commits_from_graph);
+	jw_object_intmax(&jw, "commits_inflated", prompt_stats.commits_inflated);
+	jw_object_intmax(&jw, "cache_hits", prompt_stats.cache_hits);
+	jw_object_intmax(&jw, "cache_misses", prompt_stats.cache_misses);
+	jw_object_intmax(&jw, "cache_writes", prompt_stats.cache_writes);
+	jw_object_intmax(&jw, "index_entries",
+			 the_repository->index ? the_repository->index->cache_nr : 0);
+	jw_object_intmax(&jw, "lstat_calls", prompt_stats.lstat_calls);
+	jw_object_intmax(&jw, "queue_max", prompt_stats.queue_max);
+	jw_end(&jw);
+	jw_end(&jw);
+
+	fprintf(stderr, "%s\n", jw.json.buf);
+	jw_release(&jw);
 }
 
 /*
- * Check if there are unstaged changes in the working tree.
- *
- * Uses refresh_index() to update stat info and check if any tracked files
- * have been modified but not staged.
- *
- * Performance: O(n + m) where n = index entries, m = worktree files
- *              refresh_index() stats all tracked files in the working tree
- * Safe for large repo mode: No (requires loaded index, expensive filesystem operations)
+ * fsmonitor support for large repo mode: with core.fsmonitor set (the built-in
+ * daemon or a hook such as Watchman's), the index records which entries were
+ * unchanged as of the last fsmonitor token, and refresh_fsmonitor() asks the
+ * monitor for the paths changed since. Status checks then only stat those.
+ */
+#define FSMONITOR_MAX_CHANGED 4096 /* More unvouched entries than this: fall back to GRAY */
+
+/*
+ * Load the index for status checks in large repo mode, if an fsmonitor vouches for
+ * all but FSMONITOR_MAX_CHANGED of its entries.
+ * Performance: O(n) index read and flag scan (no per-file syscalls) plus one
+ *              fsmonitor query
+ * Safe for large repo mode: Yes (this is what makes status checks affordable there)
  *
- * Returns 1 if any tracked files have unstaged changes, 0 otherwise.
+ * Returns 1 if status checks can run, 0 to keep the GRAY fallback.
  */
-static int has_worktree_changes(struct repository *r)
+static int load_index_with_fsmonitor(struct repository *r)
 {
 	struct index_state *istate;
-	int changed = 0;
+	unsigned int changed = 0;
 
+	if (fsm_settings__get_mode(r) <= FSMONITOR_MODE_DISABLED) {
+		return 0;
+	}
 	if (repo_read_index(r) < 0) {
-		return 0; /* treat unreadable index as clean */
+		return 0;
 	}
 
 	istate = r->index;
-
-	/* Refresh index to update stat info (REFRESH_UNMERGED suppresses "needs merge" warnings) */
-	refresh_index(istate, REFRESH_QUIET | REFRESH_UNMERGED, NULL, NULL, NULL);
-
-	/* Check if any files have changes by looking at cache entries */
-	for (int i = 0; i < istate->cache_nr; i++) {
-		const struct cache_entry *ce = istate->cache[i];
-		if (ce_stage(ce)) {
-			continue; /* Skip unmerged entries */
+	if (!istate->fsmonitor_last_update) {
+		/* No token yet: the next index write by 'git status' adds one */
+		if (debug_mode) {
+			fprintf(stderr, "[DEBUG] fsmonitor: index has no token\n");
 		}
+		return 0;
+	}
 
-		/* Skip submodule entries - they're handled specially by git status */
-		if (S_ISGITLINK(ce->ce_mode)) {
-			continue;
-		}
+	refresh_fsmonitor(istate);
 
-		if (!ce_uptodate(ce)) {
-			changed = 1;
-			if (debug_mode) {
-				fprintf(stderr,
-					"[DEBUG] File not up-to-date: %s (flags=0x%x, "
-					"stat_valid=%d)\n",
-					ce->name, ce->ce_flags, (ce->ce_flags & CE_VALID) != 0);
-			}
+	for (unsigned int i = 0; i < istate->cache_nr; i++) {
+		if (!(istate->cache[i]->ce_flags & CE_FSMONITOR_VALID) &&
+		    ++changed > FSMONITOR_MAX_CHANGED) {
 			break;
 		}
 	}
 
-	return changed;
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] fsmonitor: %s%u entries to check\n",
+			changed > FSMONITOR_MAX_CHANGED ? ">" : "",
+			changed > FSMONITOR_MAX_CHANGED ? FSMONITOR_MAX_CHANGED : changed);
+	}
+	return changed <= FSMONITOR_MAX_CHANGED;
 }
 
 /*
- * Helper to check for a git state file and populate git_state if found.
- * Performance: O(1) - single access() syscall to check file existence
- *              If file exists and index loaded, calls has_unmerged_files() which is O(n)
- * Safe for large repo mode: Partially (file check is O(1), but conflict detection requires index)
+ * Raw view of <gitdir>/index for large repo mode, where parsing the whole index
+ * is too expensive: only the header, entry headers and extension headers are
+ * read from a read-only mapping. No cache_entry is created and the trailing
+ * checksum is not verified, so every offset is bounds-checked instead.
  *
- * Returns 1 if the state file exists, 0 otherwise.
+ * On-disk entry: 40 bytes of stat data, the object hash, 16-bit flags, 16 more
+ * flag bits if CE_EXTENDED is set (version 3+), then the path: NUL-padded to a
+ * multiple of 8 bytes in versions 2 and 3, prefix-compressed (a varint of bytes
+ * to strip from the previous path, then a NUL-terminated suffix) in version 4.
  */
-static int check_git_state_file(const char *gitdir, const char *filename, struct git_state *state,
-				int index_loaded, const char *state_conflict,
-				const char *state_normal)
+#define INDEX_HEADER_SIZE 12
+#define INDEX_ENTRY_STAT_SIZE 40
+#define INDEX_EXTENSION_HEADER 8 /* 4-byte signature, 32-bit size */
+
+struct index_map {
+	const unsigned char *data;
+	size_t size;
+	size_t rawsz;	     /* Object hash size */
+	size_t end;	     /* Offset of the trailing checksum */
+	unsigned version;    /* 2, 3 or 4 */
+	unsigned nr;	     /* Number of entries */
+	size_t extensions;   /* Offset of the first extension, 0 while unknown */
+};
+
+/*
+ * Map the index read-only and validate its header.
+ * Returns 0 on success, -1 if it is missing, truncated or in an unknown format.
+ */
+static int index_map_open(struct index_map *map, struct repository *r)
 {
 	struct strbuf path = STRBUF_INIT;
-	int found = 0;
+	struct stat st;
+	void *data = MAP_FAILED;
+	int fd;
 
-	strbuf_addf(&path, "%s/%s", gitdir, filename);
+	memset(map, 0, sizeof(*map));
+	map->rawsz = r->hash_algo->rawsz;
 
-	if (!access(path.buf, F_OK)) {
-		int has_conflicts = 0;
-		if (index_loaded) {
-			has_conflicts = has_unmerged_files();
-		}
+	strbuf_addf(&path, "%s/index", repo_get_git_dir(r));
+	fd = open(path.buf, O_RDONLY);
+	strbuf_release(&path);
+	if (fd < 0) {
+		return -1;
+	}
+	if (!fstat(fd, &st) && st.st_size >= (off_t)(INDEX_HEADER_SIZE + map->rawsz)) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (data == MAP_FAILED) {
+		return -1;
+	}
 
-		state->has_state = 1;
-		state->has_conflicts = has_conflicts;
-		state->state_name = has_conflicts ? state_conflict : state_normal;
-		state->state_color = has_conflicts ? COLOR_CONFLICT : COLOR_MERGE;
-		found = 1;
+	map->data = data;
+	map->size = st.st_size;
+	map->end = map->size - map->rawsz;
+	map->version = get_be32(map->data + 4);
+	map->nr = get_be32(map->data + 8);
+	if (memcmp(map->data, "DIRC", 4) || map->version < 2 || map->version > 4) {
+		munmap(data, map->size);
+		map->data = NULL;
+		return -1;
 	}
+	return 0;
+}
 
-	strbuf_release(&path);
-	return found;
+static void index_map_close(struct index_map *map)
+{
+	if (map->data) {
+		munmap((void *)map->data, map->size);
+		map->data = NULL;
+	}
 }
 
 /*
- * Quick check if any git state files exist (merge, rebase, cherry-pick, revert).
- * This is O(1) - just checks for file existence without loading index.
- * Used to decide if we need to load index in large repo mode for conflict detection.
- *
- * Performance: O(1) - checks 5 files via access() syscalls
- * Safe for large repo mode: Yes (no index operations)
- *
- * Returns 1 if any state file exists, 0 otherwise.
+ * Decode the entry at *pos: set *flags to its flags in the in-memory ce_flags
+ * layout (extended flags in the upper 16 bits, so CE_STAGEMASK and
+ * CE_SKIP_WORKTREE apply) and advance *pos to the next entry.
+ * Returns 0, or -1 if the entry runs past the entry area.
  */
-static int has_git_state_files(void)
+static int index_map_next_entry(const struct index_map *map, size_t *pos, unsigned *flags)
 {
-	const char *gitdir = repo_get_git_dir(the_repository);
-	struct strbuf path = STRBUF_INIT;
-	int found = 0;
-	const char *state_files[] = {"rebase-merge",	 "rebase-apply", "MERGE_HEAD",
-				     "CHERRY_PICK_HEAD", "REVERT_HEAD",	 NULL};
+	const unsigned char *p = map->data + *pos;
+	const unsigned char *end = map->data + map->end;
+	size_t fixed = INDEX_ENTRY_STAT_SIZE + map->rawsz + 2;
+	const unsigned char *name, *nul;
 
-	for (int i = 0; state_files[i]; i++) {
-		strbuf_reset(&path);
-		strbuf_addf(&path, "%s/%s", gitdir, state_files[i]);
-		if (!access(path.buf, F_OK)) {
-			found = 1;
-			if (debug_mode) {
-				fprintf(stderr, "[DEBUG] Found git state file: %s\n",
-					state_files[i]);
-			}
-			break;
+	if (end - p < (ptrdiff_t)fixed) {
+		return -1;
+	}
+	*flags = get_be16(p + fixed - 2);
+	if (*flags & CE_EXTENDED) {
+		if (map->version < 3 || end - p < (ptrdiff_t)fixed + 2) {
+			return -1;
 		}
+		*flags |= (unsigned)get_be16(p + fixed) << 16;
+		fixed += 2;
 	}
+	name = p + fixed;
 
-	strbuf_release(&path);
-	return found;
+	if (map->version == 4) {
+		while (name < end && (*name & 0x80)) {
+			name++; /* Skip the strip-length varint */
+		}
+		if (++name >= end || !(nul = memchr(name, '\0', end - name))) {
+			return -1;
+		}
+		*pos = nul + 1 - map->data;
+		return 0;
+	}
+
+	if ((*flags & CE_NAMEMASK) < CE_NAMEMASK) {
+		*pos += (fixed + (*flags & CE_NAMEMASK) + 8) & ~7;
+	} else if ((nul = memchr(name, '\0', end - name))) {
+		*pos += (fixed + (nul - name) + 8) & ~7; /* Long path, length not recorded */
+	} else {
+		return -1;
+	}
+	return *pos <= map->end ? 0 : -1;
 }
 
 /*
- * Detect special git states (merge, rebase, etc.) and populate git_state struct.
- * Requires index_loaded to be 1 for conflict detection.
+ * Locate the extensions from the EOIE (end of index entries) extension, which
+ * git writes with index.threads or index.recordEndOfIndexEntries.
+ * Performance: O(1)
  *
- * Performance: O(1) for state file checks, O(n) if conflicts need detection
- *              Checks 5 state files via access() syscalls (fast)
- *              If state exists and index loaded, calls has_unmerged_files() O(n)
- * Safe for large repo mode: Partially (state detection is O(1), conflict detection requires index)
- *
- * Returns a git_state struct with all relevant information.
+ * Returns 1 if the index has one (and sets map->extensions), 0 otherwise.
  */
-static struct git_state get_git_state(int index_loaded)
+static int index_map_read_eoie(struct index_map *map)
 {
-	struct git_state state = {0, 0, NULL, NULL};
-	const char *gitdir = repo_get_git_dir(the_repository);
+	size_t eoie_size = INDEX_EXTENSION_HEADER + 4 + map->rawsz;
+	const unsigned char *eoie;
 
-	/* Check for rebase (interactive or apply mode) */
-	if (check_git_state_file(gitdir, "rebase-merge", &state, index_loaded, "rebase:conflict",
-				 "rebase:continue")) {
-		return state;
+	if (map->end < INDEX_HEADER_SIZE + eoie_size) {
+		return 0;
 	}
 
-	if (check_git_state_file(gitdir, "rebase-apply", &state, index_loaded, "rebase:conflict",
-				 "rebase:continue")) {
-		return state;
+	eoie = map->data + map->end - eoie_size;
+	if (memcmp(eoie, "EOIE", 4) || get_be32(eoie + 4) != 4 + map->rawsz ||
+	    get_be32(eoie + 8) < INDEX_HEADER_SIZE || get_be32(eoie + 8) > map->end - eoie_size) {
+		return 0;
 	}
+	map->extensions = get_be32(eoie + 8);
+	return 1;
+}
 
-	/* Check for merge */
-	if (check_git_state_file(gitdir, "MERGE_HEAD", &state, index_loaded, "merge:conflict",
-				 "merge:commit")) {
-		return state;
-	}
+/*
+ * Find where the extensions start: from the EOIE extension when the index has
+ * one, otherwise by skipping over all entries.
+ * Performance: O(1) with EOIE, else O(n) over entry headers only
+ *
+ * Returns 0 on success, -1 if the index is corrupt.
+ */
+static int index_map_find_extensions(struct index_map *map)
+{
+	size_t pos = INDEX_HEADER_SIZE;
+	unsigned flags;
 
-	/* Check for cherry-pick */
-	if (check_git_state_file(gitdir, "CHERRY_PICK_HEAD", &state, index_loaded,
-				 "cherrypick:conflict", "cherrypick:commit")) {
-		return state;
+	if (map->extensions || index_map_read_eoie(map)) {
+		return 0;
 	}
 
-	/* Check for revert */
-	check_git_state_file(gitdir, "REVERT_HEAD", &state, index_loaded, "revert:conflict",
-			     "revert:commit");
+	for (unsigned i = 0; i < map->nr; i++) {
+		if (index_map_next_entry(map, &pos, &flags) < 0) {
+			return -1;
+		}
+	}
+	map->extensions = pos;
+	return 0;
+}
 
-	return state;
+/*
+ * Look up an extension by signature.
+ * Returns its payload and sets *len, or NULL if the index has no such extension.
+ */
+static const unsigned char *index_map_extension(struct index_map *map, const char *sig,
+						 size_t *len)
+{
+	size_t pos;
+
+	if (index_map_find_extensions(map) < 0) {
+		return NULL;
+	}
+
+	for (pos = map->extensions; map->end - pos >= INDEX_EXTENSION_HEADER;) {
+		const unsigned char *ext = map->data + pos;
+		uint32_t ext_size = get_be32(ext + 4);
+
+		if (ext_size > map->end - pos - INDEX_EXTENSION_HEADER) {
+			return NULL;
+		}
+		if (!memcmp(ext, sig, 4)) {
+			*len = ext_size;
+			return ext + INDEX_EXTENSION_HEADER;
+		}
+		pos += INDEX_EXTENSION_HEADER + ext_size;
+	}
+	return NULL;
 }
 
 /*
- * Shared context for prompt generation.
- * Filled once at startup and passed to all helper functions.
+ * Return the tree hash of the cache-tree root if it is valid, else NULL.
+ * The TREE extension starts with the root node: an empty path, NUL, then
+ * "<entry count> <subtree count>\n" and, unless the count is -1 (invalidated),
+ * the tree's hash.
  */
-struct prompt_context {
-	struct object_id oid;	/* HEAD commit */
-	struct ref_store *refs; /* Ref store */
-	int large_repo;		/* Large repo flag */
-	int index_loaded;	/* Index loaded flag */
-};
+static const unsigned char *index_map_cache_tree_root(struct index_map *map)
+{
+	const unsigned char *tree, *p, *end;
+	size_t len;
+
+	tree = index_map_extension(map, "TREE", &len);
+	if (!tree || !len || tree[0] != '\0') {
+		return NULL;
+	}
+
+	end = tree + len;
+	p = memchr(tree + 1, '\n', len - 1);
+	if (!p || tree[1] == '-' || (size_t)(end - ++p) < map->rawsz) {
+		return NULL;
+	}
+	return p;
+}
 
 /*
- * BFS node tracking during graph traversal (ring buffer entry).
+ * Size of the entries inside the sparse-checkout cone, i.e. of those without
+ * the skip-worktree bit: the part of the index that status checks touch.
+ * Performance: O(n) over entry headers of the mapped index (no parsing)
+ * Safe for large repo mode: Yes (only called for sparse checkouts over the threshold)
+ *
+ * Returns the size in bytes, or -1 if the index cannot be read.
  */
-struct bfs_node {
-	struct object_id oid;
-	int distance; /* Steps from the origin (start or target) */
-};
+static long sparse_cone_index_size(struct repository *r)
+{
+	struct index_map map;
+	size_t pos = INDEX_HEADER_SIZE, cone = INDEX_HEADER_SIZE;
+	unsigned flags;
+
+	if (index_map_open(&map, r) < 0) {
+		return -1;
+	}
+	for (unsigned i = 0; i < map.nr; i++) {
+		size_t start = pos;
+
+		if (index_map_next_entry(&map, &pos, &flags) < 0) {
+			index_map_close(&map);
+			return -1;
+		}
+		if (!(flags & CE_SKIP_WORKTREE)) {
+			cone += pos - start;
+		}
+	}
+	index_map_close(&map);
+	return cone;
+}
 
 /*
- * BFS state for one side of bidirectional search (stack-allocated).
+ * Adaptive large repo mode (--latency-target=<ms>): instead of the index size,
+ * large repo mode is entered when the status checks are expected to take longer
+ * than the target on this machine and checkout.
+ *
+ * Prompts that run the full status record how long the index load, the refresh
+ * (worktree and cache-tree checks) and the untracked scan took in
+ * <gitdir>/prompt-status-cost, as an EWMA per phase together with the index size
+ * they were measured at. The estimate for the current index scales them by its
+ * size. Only complete passes count: a check that stopped at the first change
+ * (or at the deadline) did not do the full work. Until the first measurement,
+ * --large-repo-size decides, and in large repo mode a status run is repeated
+ * every STATUS_COST_PROBE_SECS so that a faster machine or a warm disk cache
+ * gives real colors back. The probing prompt first stamps the file with the
+ * current time, so the other shells redrawing meanwhile stay in large repo mode,
+ * and its status sections give up once the target is spent.
+ *
+ * To keep the file write off the hot path (it hurts most on NFS, where this is
+ * meant to help), the file is only rewritten when the estimate moved by more
+ * than 1/8, crossed the target, or was last written STATUS_COST_REWRITE_SECS ago.
  */
-struct bfs_state {
-	struct bfs_node queue[BFS_QUEUE_SIZE]; /* Ring buffer for this side */
-	int head;			       /* Queue head index */
-	int tail;			       /* Queue tail index */
-	int size;			       /* Current queue size */
-	int steps_remaining;		       /* Budget remaining for this side */
+#define STATUS_COST_FILE_VERSION 1
+#define STATUS_COST_EWMA_SHIFT 2	   /* Weight 1/4 for the newest sample */
+#define STATUS_COST_PROBE_SECS 3600 /* Re-measure large repos once an hour */
+#define STATUS_COST_CHANGE_SHIFT 3  /* Rewrite when the estimate moved by 1/8 */
+#define STATUS_COST_REWRITE_SECS 600 /* Else rewrite at most every 10 minutes */
+
+enum status_cost_phase {
+	STATUS_COST_INDEX,
+	STATUS_COST_REFRESH,
+	STATUS_COST_UNTRACKED,
+	STATUS_COST_PHASES
 };
 
+struct status_cost {
+	long index_size; /* Index size the costs were measured at */
+	uint64_t ns[STATUS_COST_PHASES];
+	time_t measured; /* time() of the last sample, 0 if none */
+};
+
+/* Samples of the current prompt, from the status section only */
+static long status_sample_index_size;
+static uint64_t status_sample_ns[STATUS_COST_PHASES];
+static unsigned status_sample_phases; /* Bit per measured phase */
+static struct lock_file status_cost_lock = LOCK_INIT;
+
+static void status_cost_path(struct strbuf *path)
+{
+	strbuf_addf(path, "%s/prompt-status-cost", repo_get_git_dir(the_repository));
+}
+
 /*
- * Entry for storing distances in oidmap during interleaved bidirectional BFS.
+ * Read the recorded costs. Returns 0 on success, -1 if none are recorded.
  */
-struct bfs_distance_entry {
-	struct oidmap_entry entry; /* Must be first member */
-	int dist_from_start;	   /* Distance from start (-1 if not reached) */
-	int dist_from_target;	   /* Distance from target (-1 if not reached) */
-};
+static int status_cost_read(struct status_cost *cost)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct strbuf buf = STRBUF_INIT;
+	uintmax_t index_ns, refresh_ns, untracked_ns, measured;
+	int version, ret = -1;
+
+	memset(cost, 0, sizeof(*cost));
+	status_cost_path(&path);
+	if (strbuf_read_file(&buf, path.buf, 0) > 0 &&
+	    sscanf(buf.buf, "%d %ld %" SCNuMAX " %" SCNuMAX " %" SCNuMAX " %" SCNuMAX, &version,
+		   &cost->index_size, &index_ns, &refresh_ns, &untracked_ns, &measured) == 6 &&
+	    version == STATUS_COST_FILE_VERSION && cost->index_size > 0) {
+		cost->ns[STATUS_COST_INDEX] = index_ns;
+		cost->ns[STATUS_COST_REFRESH] = refresh_ns;
+		cost->ns[STATUS_COST_UNTRACKED] = untracked_ns;
+		cost->measured = measured;
+		ret = 0;
+	}
+
+	strbuf_release(&path);
+	strbuf_release(&buf);
+	return ret;
+}
 
 /*
- * Result of bidirectional BFS divergence calculation.
+ * Write costs (measured at cost->index_size) stamped with the current time to
+ * the locked file, committing it. Returns 0 on success, -1 on failure.
  */
-struct bfs_divergence_result {
-	int ahead;	     /* Commits in start but not in target (-1 if not found) */
-	int behind;	     /* Commits in target but not in start (-1 if not found) */
-	int commits_visited; /* Number of commits traversed (traversal cost) */
-};
+static int status_cost_write(int fd, const struct status_cost *cost)
+{
+	struct strbuf buf = STRBUF_INIT;
+	int ret = -1;
+
+	strbuf_addf(&buf, "%d %ld %" PRIuMAX " %" PRIuMAX " %" PRIuMAX " %" PRIuMAX "\n",
+		    STATUS_COST_FILE_VERSION, cost->index_size,
+		    (uintmax_t)cost->ns[STATUS_COST_INDEX],
+		    (uintmax_t)cost->ns[STATUS_COST_REFRESH],
+		    (uintmax_t)cost->ns[STATUS_COST_UNTRACKED], (uintmax_t)time(NULL));
+	if (write_in_full(fd, buf.buf, buf.len) < 0) {
+		rollback_lock_file(&status_cost_lock);
+	} else if (!commit_lock_file(&status_cost_lock)) {
+		ret = 0;
+	}
+	strbuf_release(&buf);
+	return ret;
+}
 
 /*
- * Helper to get or create a distance entry in the map.
- * Returns NULL if entry exists, or the newly created entry if it didn't exist.
+ * Claim the probe of a large repo whose costs were last measured at measured:
+ * restamp them, so no other prompt probes too.
+ * Performance: O(1) - one lock and two small file accesses, once an hour
+ *
+ * Returns 0 if this prompt probes, -1 if another one claimed it first.
  */
-static struct bfs_distance_entry *get_or_create_entry(struct oidmap *distances,
-						      const struct object_id *oid)
+static int status_cost_claim_probe(time_t measured)
 {
-	struct bfs_distance_entry *entry = oidmap_get(distances, oid);
-	if (entry) {
-		return NULL; /* Already exists */
+	struct strbuf path = STRBUF_INIT;
+	struct status_cost cost;
+	int fd, ret = -1;
+
+	status_cost_path(&path);
+	fd = hold_lock_file_for_update(&status_cost_lock, path.buf, 0);
+	if (fd >= 0) {
+		/* Read again under the lock: a claim by another prompt restamped it */
+		if (status_cost_read(&cost) < 0 || cost.measured != measured) {
+			rollback_lock_file(&status_cost_lock);
+		} else {
+			ret = status_cost_write(fd, &cost);
+		}
 	}
+	strbuf_release(&path);
+	return ret;
+}
 
-	entry = xmalloc(sizeof(*entry));
-	oidcpy(&entry->entry.oid, oid);
-	entry->dist_from_start = -1;
-	entry->dist_from_target = -1;
-	oidmap_put(distances, entry);
-	return entry;
+/*
+ * Record the duration of one complete status phase of this prompt.
+ */
+static void status_cost_sample(enum status_cost_phase phase, uint64_t start_ns)
+{
+	status_sample_ns[phase] = getnanotime() - start_ns;
+	status_sample_phases |= 1u << phase;
 }
 
 /*
- * Interleaved bidirectional BFS to find divergence between two commits.
- *
- * Strategy:
- * 1. Maintain two queues (indexed 0=start, 1=target) for perfect interleaving
- * 2. Track distances from both sides in a single hashmap
- * 3. Alternate: process one from each queue in round-robin fashion
- * 4. When we visit a node that has already been reached from the other side, we found the merge-base
- * 5. Result: ahead = dist_from_start, behind = dist_from_target at intersection
- *
- * Performance: O(commits) where commits ≤ 2 * max_steps
- *              Limited by max_traversal parameter (default 1000)
- *              Early termination when merge-base found
- * Safe for large repo mode: Yes (graph traversal independent of worktree/index size)
- *
- * Returns:
- *   - {ahead, behind} if relationship found within max_steps (both >= 0)
- *   - {-1, -1} if too far apart (no common ancestor within max_steps)
+ * Whether updated costs are worth a file write (see STATUS_COST_CHANGE_SHIFT).
+ * old_ns and new_ns are the estimates for the current index before and after.
  */
-static struct bfs_divergence_result
-bfs_find_divergence(const struct object_id *start,  /* Usually HEAD */
-		    const struct object_id *target, /* Usually origin/master or upstream */
-		    int max_steps)
+static int status_cost_changed(const struct status_cost *recorded, uint64_t old_ns,
+			       uint64_t new_ns)
 {
-	struct bfs_divergence_result result = {-1, -1, 0};
-	struct oidmap distances;
+	uint64_t target_ns = (uint64_t)latency_target_ms * 1000000;
+	uint64_t delta = old_ns > new_ns ? old_ns - new_ns : new_ns - old_ns;
 
-	/* Two BFS states: [0]=start side, [1]=target side (stack-allocated) */
-	struct bfs_state states[2] = {
-		{.head = 0, .tail = 0, .size = 0, .steps_remaining = max_steps},
-		{.head = 0, .tail = 0, .size = 0, .steps_remaining = max_steps}};
+	return delta > old_ns >> STATUS_COST_CHANGE_SHIFT ||
+	       (old_ns > target_ns) != (new_ns > target_ns) ||
+	       time(NULL) - recorded->measured >= STATUS_COST_REWRITE_SECS;
+}
 
-	const struct object_id *initial_oids[2];
-	int commits_visited = 0;
-	int side;
+/*
+ * Fold this prompt's samples into the recorded costs (scaled to the current
+ * index size first) and save them. Phases without a sample keep their value.
+ * Skipped if another process holds the lock, or if the estimate barely moved.
+ */
+static void status_cost_update(void)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct status_cost cost;
+	int have = !status_cost_read(&cost);
+	uint64_t old_total = 0, new_total = 0;
+	int fd;
 
-	/* Quick check: start == target */
-	if (oideq(start, target)) {
-		result.ahead = 0;
-		result.behind = 0;
-		result.commits_visited = 0;
-		return result;
+	if (!status_sample_phases || status_sample_index_size <= 0) {
+		goto cleanup;
 	}
 
-	/* Initialize distance map */
-	oidmap_init(&distances, 0);
+	for (int i = 0; i < STATUS_COST_PHASES; i++) {
+		uint64_t old = have ? cost.ns[i] * status_sample_index_size / cost.index_size : 0;
 
-	if (debug_mode) {
-		fprintf(stderr, "[DEBUG] BFS: two-queue interleaved search...\n");
+		if (!(status_sample_phases & (1u << i))) {
+			cost.ns[i] = old;
+		} else if (!have || !old) {
+			cost.ns[i] = status_sample_ns[i];
+		} else {
+			cost.ns[i] = old - (old >> STATUS_COST_EWMA_SHIFT) +
+				     (status_sample_ns[i] >> STATUS_COST_EWMA_SHIFT);
+		}
+		old_total += old;
+		new_total += cost.ns[i];
 	}
 
-	/* Setup initial state for both sides */
-	initial_oids[0] = start;
-	initial_oids[1] = target;
+	if (have && !status_cost_changed(&cost, old_total, new_total)) {
+		if (debug_mode) {
+			fprintf(stderr, "[DEBUG] Status cost: %.1fms, about as recorded\n",
+				new_total / 1e6);
+		}
+		goto cleanup;
+	}
 
-	/* Enqueue initial nodes */
-	for (side = 0; side < 2; side++) {
-		struct bfs_state *state = &states[side];
-		struct bfs_distance_entry *entry =
-			get_or_create_entry(&distances, initial_oids[side]);
-		if (entry) {
-			if (side == 0) {
-				entry->dist_from_start = 0;
-			} else {
-				entry->dist_from_target = 0;
-			}
+	status_cost_path(&path);
+	fd = hold_lock_file_for_update(&status_cost_lock, path.buf, 0);
+	if (fd < 0) {
+		goto cleanup;
+	}
+	cost.index_size = status_sample_index_size;
+	status_cost_write(fd, &cost);
 
-			oidcpy(&state->queue[state->tail].oid, initial_oids[side]);
-			state->queue[state->tail].distance = 0;
-			state->tail = (state->tail + 1) & (BFS_QUEUE_SIZE - 1);
-			state->size++;
-		}
+	if (debug_mode) {
+		fprintf(stderr,
+			"[DEBUG] Status cost: index %.1fms, refresh %.1fms, untracked %.1fms\n",
+			cost.ns[STATUS_COST_INDEX] / 1e6, cost.ns[STATUS_COST_REFRESH] / 1e6,
+			cost.ns[STATUS_COST_UNTRACKED] / 1e6);
 	}
 
-	/* Interleaved BFS - alternate between queues */
-	int made_progress = 1;
-	while (made_progress) {
-		made_progress = 0;
+cleanup:
+	status_sample_phases = 0; /* The daemon renders many prompts */
+	strbuf_release(&path);
+}
 
-		for (side = 0; side < 2; side++) {
-			struct bfs_state *state = &states[side];
+/*
+ * Decide large repo mode from the recorded costs.
+ * Performance: O(1) - one small file read
+ * Safe for large repo mode: Yes (this determines large repo mode)
+ *
+ * Returns 1 if large, 0 if not, -1 if nothing is recorded yet.
+ */
+static int status_cost_large(long index_size)
+{
+	struct status_cost cost;
+	uint64_t estimate = 0;
+	int large;
 
-			if (state->size <= 0 || state->steps_remaining <= 0) {
-				continue;
-			}
+	if (status_cost_read(&cost) < 0) {
+		return -1;
+	}
 
-			made_progress = 1;
+	for (int i = 0; i < STATUS_COST_PHASES; i++) {
+		estimate += cost.ns[i];
+	}
+	estimate = estimate * index_size / cost.index_size;
+	large = estimate > (uint64_t)latency_target_ms * 1000000;
+
+	/* Large repos never measure themselves; one prompt probes now and then */
+	if (large && time(NULL) - cost.measured >= STATUS_COST_PROBE_SECS &&
+	    !status_cost_claim_probe(cost.measured)) {
+		large = 0;
+		deadline_cap_status(latency_target_ms);
+		if (debug_mode) {
+			fprintf(stderr, "[DEBUG] Status cost: probing (last sample %" PRIuMAX
+					"s ago)\n",
+				(uintmax_t)(time(NULL) - cost.measured));
+		}
+	}
 
-			/* Dequeue from this side */
-			struct bfs_node current = state->queue[state->head];
-			state->head = (state->head + 1) & (BFS_QUEUE_SIZE - 1);
-			state->size--;
-			commits_visited++;
-
-			/* Check if we've found the intersection */
-			const struct bfs_distance_entry *current_entry =
-				oidmap_get(&distances, &current.oid);
-			if (current_entry && current_entry->dist_from_start >= 0 &&
-			    current_entry->dist_from_target >= 0) {
-				/* Found merge-base! */
-				result.ahead = current_entry->dist_from_start;
-				result.behind = current_entry->dist_from_target;
-				result.commits_visited = commits_visited;
-				if (debug_mode) {
-					fprintf(stderr,
-						"[DEBUG] BFS: found intersection after %d commits, "
-						"ahead=%d, behind=%d\n",
-						commits_visited, result.ahead, result.behind);
-				}
-				goto cleanup;
-			}
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] Status cost: estimated %.1fms, target %dms%s\n",
+			estimate / 1e6, latency_target_ms, large ? " (large repo mode)" : "");
+	}
+	return large;
+}
 
-			/* Parse commit and traverse parents */
-			struct commit *commit = lookup_commit(the_repository, &current.oid);
-			if (commit && !repo_parse_commit(the_repository, commit)) {
-				struct commit_list *parent = commit->parents;
-				while (parent) {
-					const struct object_id *parent_oid =
-						&parent->item->object.oid;
-					struct bfs_distance_entry *parent_entry =
-						oidmap_get(&distances, parent_oid);
-					int parent_dist = current.distance + 1;
-
-					if (!parent_entry) {
-						parent_entry =
-							get_or_create_entry(&distances, parent_oid);
-						if (!parent_entry) {
-							parent = parent->next;
-							continue;
-						}
-					}
+/*
+ * Check if repository is large based on index file size, or on the measured
+ * status cost with --latency-target (see status_cost_large()).
+ * In a sparse checkout only the entries inside the cone count, as status never
+ * looks at the others (with index.sparse they are collapsed on disk already).
+ * Performance: O(1) - single stat() syscall (and one small file read with
+ *              --latency-target); O(n) header scan for sparse checkouts whose
+ *              index is over the threshold
+ * Safe for large repo mode: Yes (this determines large repo mode)
+ */
+static int is_large_repo(void)
+{
+	struct stat st;
+	struct strbuf index_file = STRBUF_INIT;
+	int large = 0;
 
-					/* Update distance for this side */
-					int *dist_field = (side == 0)
-								  ? &parent_entry->dist_from_start
-								  : &parent_entry->dist_from_target;
-					const int *other_dist_field =
-						(side == 0) ? &parent_entry->dist_from_target
-							    : &parent_entry->dist_from_start;
-
-					if (*dist_field < 0) {
-						*dist_field = parent_dist;
-
-						/* Check if we've found intersection */
-						if (*other_dist_field >= 0) {
-							result.ahead =
-								parent_entry->dist_from_start;
-							result.behind =
-								parent_entry->dist_from_target;
-							result.commits_visited = commits_visited;
-							if (debug_mode) {
-								fprintf(stderr,
-									"[DEBUG] BFS: found "
-									"intersection (fast) after "
-									"%d commits, ahead=%d, "
-									"behind=%d\n",
-									commits_visited,
-									result.ahead,
-									result.behind);
-							}
-							goto cleanup;
-						}
+	strbuf_addf(&index_file, "%s/index", repo_get_git_dir(the_repository));
 
-						/* Enqueue for further exploration if budget allows */
-						if (state->steps_remaining > 0) {
-							if (state->size >= BFS_QUEUE_SIZE - 1) {
-								goto cleanup;
-							}
-							oidcpy(&state->queue[state->tail].oid,
-							       parent_oid);
-							state->queue[state->tail].distance =
-								parent_dist;
-							state->tail = (state->tail + 1) &
-								      (BFS_QUEUE_SIZE - 1);
-							state->size++;
-							state->steps_remaining--;
-						}
-					}
+	if (latency_target_ms > 0 && !stat(index_file.buf, &st)) {
+		/* The measurements already reflect sparse checkouts, no cone scan needed */
+		status_sample_index_size = st.st_size;
+		large = status_cost_large(st.st_size);
+		if (large >= 0) {
+			goto cleanup;
+		}
+		large = 0;
+	}
 
-					parent = parent->next;
-				}
+	if (!stat(index_file.buf, &st) && st.st_size > large_repo_size) {
+		large = 1;
+		if (core_apply_sparse_checkout) {
+			long cone = sparse_cone_index_size(the_repository);
+
+			if (debug_mode) {
+				fprintf(stderr,
+					"[DEBUG] Sparse checkout: %ld of %ld index bytes in cone\n",
+					cone, (long)st.st_size);
 			}
+			large = cone < 0 || cone > large_repo_size;
 		}
 	}
 
 cleanup:
-	/* Set commits_visited even when we don't find merge-base (for caching decision) */
-	if (result.commits_visited == 0) {
-		result.commits_visited = commits_visited;
-	}
+	strbuf_release(&index_file);
+	return large;
+}
 
-	if (debug_mode && result.ahead < 0) {
-		fprintf(stderr,
-			"[DEBUG] BFS: exhausted after %d commits (start steps left: %d, target "
-			"steps left: %d)\n",
-			commits_visited, states[0].steps_remaining, states[1].steps_remaining);
+/*
+ * Staged-change check for large repo mode from the on-disk cache-tree alone:
+ * when its root is valid, it is the tree the index would commit.
+ * Performance: O(1) with EOIE, else one pass over the entry headers; never
+ *              parses the index, runs cache_tree_update() or touches the worktree
+ * Safe for large repo mode: Yes (this is its purpose)
+ *
+ * Returns 1 if the index differs from HEAD, 0 if it matches, -1 if unknown
+ * (no valid cache-tree root; e.g. right after 'git add').
+ */
+static int has_staged_changes_from_cache_tree(struct repository *r,
+					      const struct object_id *head_tree)
+{
+	struct index_map map;
+	const unsigned char *root;
+	int result = -1;
+
+	if (!head_tree || index_map_open(&map, r) < 0) {
+		return -1;
 	}
 
-	/* Free hashmap entries */
-	struct oidmap_iter iter;
-	struct bfs_distance_entry *entry;
-	oidmap_iter_init(&distances, &iter);
-	while ((entry = oidmap_iter_next(&iter))) {
-		free(entry);
+	DEBUG_TIMER_START(cache_tree_root);
+	root = index_map_cache_tree_root(&map);
+	if (root) {
+		result = !!memcmp(root, head_tree->hash, map.rawsz);
 	}
-	oidmap_clear(&distances, 0);
+	DEBUG_TIMER_END(cache_tree_root, "Cache-tree root lookup");
 
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] Cache-tree root: %s\n",
+			result < 0 ? "invalid" : result ? "!= HEAD tree" : "== HEAD tree");
+	}
+	index_map_close(&map);
 	return result;
 }
 
+
 /*
- * Section 1: Determine branch name and color based on working tree state.
- * This is pure filesystem operations - no network refs needed.
- *
- * Takes git_state to check for conflicts when determining staged changes.
- *
- * Performance: Large repo mode: O(1) - only ref resolution and tag lookup
- *              Small repo mode: O(n + m) - calls has_worktree_changes() and has_staged_changes()
- *                n = index entries, m = worktree files
- *              Untracked check uses fill_directory() which is expensive
- * Safe for large repo mode: Partially (branch name is fast, color determination skipped)
+ * Git state information (merge, rebase, cherry-pick, etc.)
+ * This is computed once and used both for branch color determination
+ * and for displaying the state indicator in the prompt.
+ */
+struct git_state {
+	int has_state;		 /* 1 if any git operation is in progress */
+	int has_conflicts;	 /* 1 if unmerged files exist */
+	const char *state_name;	 /* e.g., "merge:conflict", "rebase:continue" */
+	const char *state_color; /* Color for the state indicator */
+};
+
+/*
+ * Check if the index (already loaded) has unmerged files.
+ * Caller must ensure repo_read_index() was called successfully.
+ * Performance: O(n) where n = number of index entries (worst case: full scan)
+ *              In practice, returns early on first unmerged entry
+ * Safe for large repo mode: No (requires loaded index, scans all entries)
+ */
+static int has_unmerged_files(void)
+{
+	int i;
+
+	for (i = 0; i < the_repository->index->cache_nr; i++) {
+		const struct cache_entry *ce = the_repository->index->cache[i];
+		if (ce_stage(ce)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Write refreshed stat data and a rebuilt cache-tree back to the index
+ * (--write-index), as git status does, so the next prompt finds it warm.
+ * Performance: O(n) index write, only when something changed in memory
+ * Safe for large repo mode: Yes (only called with a loaded index)
  *
- * Returns:
- *   detached - 1 if in detached HEAD state, 0 if on a branch
+ * Never waits: if another git process holds index.lock the write is skipped.
+ * repo_update_index_if_able() also skips it when nothing changed or the index
+ * on disk is no longer the one that was read.
  */
-static int get_branch_name_and_color(struct strbuf *branch, const char **color,
-				     const struct prompt_context *ctx,
-				     const struct git_state *state)
+static void write_index_if_able(struct repository *r)
 {
-	const char *branch_name;
-	int detached = 0;
+	struct lock_file lock = LOCK_INIT;
+	unsigned changed = r->index->cache_changed;
 
-	DEBUG_TIMER_START(branch_name);
+	if (repo_hold_locked_index(r, &lock, 0) < 0) {
+		if (debug_mode) {
+			fprintf(stderr, "[DEBUG] Index write-back skipped (index.lock held)\n");
+		}
+		return;
+	}
 
-	/* Get current branch or detached HEAD */
-	branch_name = refs_resolve_ref_unsafe(ctx->refs, "HEAD", 0, NULL, NULL);
-	if (branch_name && skip_prefix(branch_name, "refs/heads/", &branch_name)) {
-		strbuf_addstr(branch, branch_name);
-	} else {
-		/* Detached HEAD */
-		detached = 1;
+	DEBUG_TIMER_START(write);
+	repo_update_index_if_able(r, &lock);
+	DEBUG_TIMER_END(write, changed ? "Index write-back" : "Index write-back (unchanged)");
+}
 
-		/* Try to get a tag name (skip for large repos) */
-		if (!ctx->large_repo) {
-			struct commit *commit = lookup_commit_reference(the_repository, &ctx->oid);
-			if (commit) {
-				const struct name_decoration *decoration =
-					get_name_decoration(&commit->object);
-				/* Iterate through decorations to find a tag */
-				while (decoration) {
-					if (decoration->type == DECORATION_REF_TAG) {
-						const char *tag_name = decoration->name;
-						/* Strip refs/tags/ prefix if present */
-						skip_prefix(tag_name, "refs/tags/", &tag_name);
-						strbuf_addstr(branch, tag_name);
-						break;
-					}
-					decoration = decoration->next;
-				}
-			}
-		}
+/*
+ * Check if there are staged changes (index differs from HEAD).
+ *
+ * Uses cache-tree to efficiently detect if the index matches HEAD's tree.
+ * If cache-tree is invalid, we rebuild it to get an accurate comparison.
+ *
+ * Special case: During conflicts (merge/rebase/cherry-pick), unmerged entries
+ * count as staged changes even if cache-tree matches HEAD.
+ *
+ * Performance: O(n) where n = number of index entries
+ *              cache_tree_update() rebuilds cache-tree by scanning index
+ * Safe for large repo mode: No (requires loaded index, potentially expensive)
+ *
+ * Returns 1 if there are staged changes, 0 otherwise.
+ */
+static int has_staged_changes(struct repository *r, const struct object_id *head_tree,
+			      const struct git_state *state)
+{
+	struct index_state *istate;
 
-		/* Fallback to short commit hash */
-		if (!branch->len) {
-			strbuf_add_unique_abbrev(branch, &ctx->oid, 7);
-		}
+	/* Ensure index is loaded */
+	if (repo_read_index(r) < 0) {
+		return 0;
 	}
 
-	DEBUG_TIMER_END(branch_name, "Branch name");
+	istate = r->index;
 
-	/* Determine color based on working tree and staging area state */
-	/* Check conflicts FIRST - they always take priority regardless of repo size */
-	if (ctx->index_loaded && state->has_conflicts) {
-		/* Conflicts always show RED - need immediate attention */
-		*color = COLOR_MODIFIED;
+	/*
+	 * During conflicts, unmerged entries are considered staged changes.
+	 * Check this FIRST before doing cache-tree comparison, because
+	 * cache_tree_update() can succeed and match HEAD even when unmerged entries exist.
+	 */
+	if (state->has_conflicts) {
 		if (debug_mode) {
-			fprintf(stderr, "[DEBUG] Color: RED (conflicts)\n");
+			fprintf(stderr, "[DEBUG] has_staged_changes = 1 (conflicts present)\n");
 		}
-	} else if (state->has_state) {
-		/* Git operation in progress (merge/rebase/cherry-pick) - staged changes exist */
-		*color = COLOR_STAGED;
+		return 1;
+	}
+
+	if (!head_tree) {
+		/* Can't parse HEAD, conservatively report no changes */
 		if (debug_mode) {
-			fprintf(stderr, "[DEBUG] Color: YELLOW (git operation in progress: %s)\n",
-				state->state_name);
+			fprintf(stderr, "[DEBUG] has_staged_changes = 0 (can't get HEAD tree)\n");
 		}
-	} else if (ctx->large_repo) {
-		/* Large repo mode - skip expensive status checks, show GRAY as fallback */
-		*color = COLOR_LARGE_REPO;
+		return 0;
+	}
+
+	/*
+	 * Ensure cache-tree is valid by updating it if needed.
+	 * cache_tree_update() rebuilds the cache-tree from the index.
+	 * If it succeeds, cache_tree->oid represents the tree the index would create.
+	 */
+	if (!istate->cache_tree) {
+		istate->cache_tree = cache_tree();
+	}
+	if (!cache_tree_fully_valid(istate->cache_tree)) {
+		/* The rebuilt cache-tree is worth keeping for --write-index */
+		istate->cache_changed |= CACHE_TREE_CHANGED;
+	}
+
+	/*
+	 * Writing the rebuilt trees goes through object-database code that is only
+	 * safe next to a concurrent divergence walk under the object read lock
+	 * (recursive, and a no-op unless enabled, see render_prompt()).
+	 */
+	obj_read_lock();
+	int update_failed = cache_tree_update(istate, 0) < 0;
+	obj_read_unlock();
+
+	if (update_failed) {
+		/* Cache-tree update failed, fall back to conservative answer */
 		if (debug_mode) {
-			fprintf(stderr, "[DEBUG] Color: GRAY (large repo mode)\n");
+			fprintf(stderr,
+				"[DEBUG] has_staged_changes = 0 (cache-tree update failed)\n");
 		}
-	} else if (!ctx->index_loaded) {
-		/* Can't read index, treat as clean */
-		*color = COLOR_CLEAN;
-	} else {
-		DEBUG_TIMER_START(status_check);
+		return 0;
+	}
 
-		/* Check for unstaged changes (working tree differs from index) */
-		int unstaged = has_worktree_changes(the_repository);
+	/* Compare cache-tree OID with HEAD tree OID */
+	int has_changes = !oideq(&istate->cache_tree->oid, head_tree);
 
-		/* Check for staged changes (index differs from HEAD) */
-		int staged = has_staged_changes(the_repository, &ctx->oid, state);
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] has_staged_changes = %d (cache-tree OID %s HEAD tree)\n",
+			has_changes, has_changes ? "!=" : "==");
+	}
 
-		DEBUG_TIMER_END(status_check, "Status: change check");
+	return has_changes;
+}
+
+/*
+ * Hot entries for the early-exit worktree check: the most recently staged files
+ * (newest index mtime) and their neighbours in the same directory are the ones a
+ * user is most likely editing right now, so they are checked first.
+ */
+#define WORKTREE_HOT_ENTRIES 16 /* Newest index entries checked first */
+#define WORKTREE_HOT_SIBLINGS 8 /* Index neighbours checked around each hot entry */
+
+/*
+ * Parallel stat phase for large checkouts: threads claim WORKTREE_CHUNK entries
+ * at a time from a shared cursor (so a thread that hits cold directories does
+ * not hold up the others) and all stop once any of them finds a changed file.
+ */
+#define WORKTREE_PARALLEL_MIN 8192 /* Index entries before lstat()s are spread over threads */
+#define WORKTREE_MAX_THREADS 16
+#define WORKTREE_CHUNK 64 /* Entries claimed at a time, also the cancellation latency */
+
+static int ce_mtime_newer(const struct cache_entry *a, const struct cache_entry *b)
+{
+	const struct stat_data *sa = &a->ce_stat_data, *sb = &b->ce_stat_data;
+	if (sa->sd_mtime.sec != sb->sd_mtime.sec) {
+		return sa->sd_mtime.sec > sb->sd_mtime.sec;
+	}
+	return sa->sd_mtime.nsec > sb->sd_mtime.nsec;
+}
+
+/*
+ * Return 1 if two index entries are files directly in the same directory.
+ */
+static int ce_same_directory(const struct cache_entry *a, const struct cache_entry *b)
+{
+	const char *slash = strrchr(a->name, '/');
+	size_t len = slash ? slash - a->name + 1 : 0;
+
+	return ce_namelen(b) > len && !strncmp(a->name, b->name, len) &&
+	       !strchr(b->name + len, '/');
+}
+
+/*
+ * Collect the positions of the WORKTREE_HOT_ENTRIES newest entries, newest first.
+ * Performance: O(n) - one pass, most entries rejected by a single compare
+ */
+static int find_hot_entries(const struct index_state *istate, int *hot)
+{
+	int nr = 0;
+
+	for (int i = 0; i < istate->cache_nr; i++) {
+		const struct cache_entry *ce = istate->cache[i];
+		int pos;
+
+		if (nr == WORKTREE_HOT_ENTRIES && !ce_mtime_newer(ce, istate->cache[hot[nr - 1]])) {
+			continue;
+		}
+		if (nr < WORKTREE_HOT_ENTRIES) {
+			nr++;
+		}
+		/* Insertion into the short sorted list */
+		pos = nr - 1;
+		while (pos > 0 && ce_mtime_newer(ce, istate->cache[hot[pos - 1]])) {
+			hot[pos] = hot[pos - 1];
+			pos--;
+		}
+		hot[pos] = i;
+	}
+	return nr;
+}
 
+/* Return 1 if an entry needs no worktree check (see worktree_entry_changed()) */
+static int worktree_entry_skipped(const struct cache_entry *ce)
+{
+	if (ce_stage(ce) || S_ISGITLINK(ce->ce_mode) || ce_uptodate(ce)) {
+		return 1;
+	}
+	return (ce->ce_flags & (CE_VALID | CE_FSMONITOR_VALID)) || ce_skip_worktree(ce);
+}
+
+/*
+ * Check one tracked file against the worktree, like refresh_index() would.
+ * Clean entries are marked up-to-date so later passes skip them.
+ *
+ * Entries that git does not expect in the worktree (assume-unchanged, skip-worktree,
+ * fsmonitor-valid) are clean; unmerged entries and submodules are not checked
+ * (see has_submodule_changes() for the latter).
+ *
+ * Returns 1 if the file was modified, deleted or replaced, 0 otherwise.
+ */
+static int worktree_entry_changed(struct index_state *istate, struct cache_entry *ce)
+{
+	struct stat st;
+
+	if (worktree_entry_skipped(ce)) {
+		return 0;
+	}
+
+	/* A leading directory replaced by a symlink means the file is gone */
+	STATS_ADD(lstat_calls, 1);
+	if (has_symlink_leading_path(ce->name, ce_namelen(ce)) || lstat(ce->name, &st) < 0 ||
+	    ie_modified(istate, ce, &st, 0)) {
 		if (debug_mode) {
-			fprintf(stderr, "[DEBUG] has_worktree_changes = %d\n", unstaged);
-			fprintf(stderr, "[DEBUG] has_staged_changes = %d\n", staged);
+			fprintf(stderr, "[DEBUG] File not up-to-date: %s (flags=0x%x)\n", ce->name,
+				ce->ce_flags);
 		}
+		return 1;
+	}
 
-		if (unstaged) {
-			/* Unstaged changes take priority - RED (action needed before staging) */
-			*color = COLOR_MODIFIED;
-			if (debug_mode) {
-				fprintf(stderr, "[DEBUG] Color: RED (unstaged changes)\n");
+	/*
+	 * Content unchanged but the stat data is stale (touched, checked out or
+	 * copied): record the new stat data so a write-back spares the next prompt
+	 * from hashing the file again.
+	 */
+	if (write_index && match_stat_data(&ce->ce_stat_data, &st)) {
+		fill_stat_cache_info(istate, ce, &st);
+		istate->cache_changed |= CE_ENTRY_CHANGED;
+	}
+
+	ce_mark_uptodate(ce);
+	return 0;
+}
+
+struct worktree_scan {
+	struct index_state *istate;
+	pthread_mutex_t mutex;
+	int next;      /* First entry not yet claimed */
+	int changed;   /* Position of a changed entry, or -1 */
+	int timed_out; /* Stopped by --deadline-ms */
+};
+
+/*
+ * Claim the next chunk of entries. Returns its start (and sets *end), or -1 when
+ * all entries are claimed, a change was already found or the deadline passed.
+ */
+static int worktree_scan_claim(struct worktree_scan *scan, int *end)
+{
+	int start = -1;
+
+	pthread_mutex_lock(&scan->mutex);
+	if (!scan->timed_out && deadline_reached()) {
+		scan->timed_out = 1;
+	}
+	if (!scan->timed_out && scan->changed < 0 && scan->next < scan->istate->cache_nr) {
+		start = scan->next;
+		scan->next = start + WORKTREE_CHUNK;
+		*end = scan->next < scan->istate->cache_nr ? scan->next : scan->istate->cache_nr;
+	}
+	pthread_mutex_unlock(&scan->mutex);
+	return start;
+}
+
+static void worktree_scan_report(struct worktree_scan *scan, int pos)
+{
+	pthread_mutex_lock(&scan->mutex);
+	if (scan->changed < 0) {
+		scan->changed = pos;
+	}
+	pthread_mutex_unlock(&scan->mutex);
+}
+
+/*
+ * Worker: the thread-safe part of worktree_entry_changed(), as in preload-index.
+ * Stat-clean entries are marked up-to-date; a definite change (gone, type or
+ * mode changed, different size) stops the scan. Entries whose timestamps moved
+ * or that are racily clean need a content check, which is left to the caller.
+ */
+static void *worktree_scan_thread(void *data)
+{
+	struct worktree_scan *scan = data;
+	struct cache_def cache = CACHE_DEF_INIT;
+	uint64_t lstat_calls = 0;
+	int start, end;
+
+	while ((start = worktree_scan_claim(scan, &end)) >= 0) {
+		for (int i = start; i < end; i++) {
+			struct cache_entry *ce = scan->istate->cache[i];
+			struct stat st;
+			unsigned changed;
+
+			if (worktree_entry_skipped(ce)) {
+				continue;
 			}
-		} else if (staged) {
-			/* Staged changes - YELLOW (ready to commit) */
-			*color = COLOR_STAGED;
-			if (debug_mode) {
-				fprintf(stderr, "[DEBUG] Color: YELLOW (staged changes)\n");
+			lstat_calls++;
+			if (threaded_has_symlink_leading_path(&cache, ce->name, ce_namelen(ce)) ||
+			    lstat(ce->name, &st) < 0) {
+				worktree_scan_report(scan, i);
+				break;
 			}
-		} else {
-			/* No tracked changes - check for untracked files */
-			DEBUG_TIMER_START(status_untracked);
-			struct dir_struct dir = DIR_INIT;
-			struct pathspec pathspec;
 
-			memset(&pathspec, 0, sizeof(pathspec));
-			dir.flags = DIR_SHOW_OTHER_DIRECTORIES | DIR_HIDE_EMPTY_DIRECTORIES;
-			setup_standard_excludes(&dir);
+			changed = ie_match_stat(scan->istate, ce, &st,
+						CE_MATCH_RACY_IS_DIRTY | CE_MATCH_IGNORE_FSMONITOR);
+			if (!changed) {
+				ce_mark_uptodate(ce);
+			} else if ((changed & (MODE_CHANGED | TYPE_CHANGED)) ||
+				   (ce->ce_stat_data.sd_size &&
+				    ce->ce_stat_data.sd_size != (unsigned int)st.st_size)) {
+				worktree_scan_report(scan, i);
+				break;
+			}
+		}
+	}
+
+	STATS_ADD(lstat_calls, lstat_calls);
+	cache_def_clear(&cache);
+	return NULL;
+}
+
+/*
+ * Stat all entries on up to WORKTREE_MAX_THREADS threads.
+ * Performance: O(n / threads) lstat()s, stops early on a definite change
+ * Safe for large repo mode: No (still O(n) filesystem operations in total)
+ *
+ * Returns the position of a changed entry, -1 if none was found (or the index
+ * is too small to be worth threads; remaining suspects are not up-to-date),
+ * or -2 if the deadline passed first.
+ */
+static int parallel_worktree_scan(struct index_state *istate)
+{
+	struct worktree_scan scan = {istate, PTHREAD_MUTEX_INITIALIZER, 0, -1, 0};
+	pthread_t threads[WORKTREE_MAX_THREADS];
+	int nr_threads = online_cpus();
+	int started = 0;
+
+	if (!HAVE_THREADS || istate->cache_nr < WORKTREE_PARALLEL_MIN || nr_threads < 2) {
+		return -1;
+	}
+	if (nr_threads > WORKTREE_MAX_THREADS) {
+		nr_threads = WORKTREE_MAX_THREADS;
+	}
+
+	for (int t = 0; t < nr_threads; t++) {
+		if (pthread_create(&threads[started], NULL, worktree_scan_thread, &scan)) {
+			break; /* Run with the threads we have; the serial pass covers the rest */
+		}
+		started++;
+	}
+	for (int t = 0; t < started; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	pthread_mutex_destroy(&scan.mutex);
+
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] Parallel stat: %d threads, %s\n", started,
+			scan.changed >= 0 ? "change found"
+			: scan.timed_out  ? "deadline passed"
+					  : "no definite change");
+	}
+	return scan.changed < 0 && scan.timed_out ? -2 : scan.changed;
+}
+
+/*
+ * Conflict scan over the mapped index for large repo mode, where loading the
+ * index just to look for a stage bit would cost a full parse. Only the entry
+ * headers are walked. With an IEOT (index entry offset table) extension the
+ * entries are split into blocks that threads claim one at a time, stopping as
+ * soon as any of them finds an unmerged entry.
+ */
+#define CONFLICT_PARALLEL_MIN 65536 /* Index entries before the scan is spread over threads */
+
+struct conflict_scan {
+	const struct index_map *map;
+	const unsigned char *blocks; /* IEOT records: 32-bit offset, 32-bit entry count */
+	unsigned nr_blocks;
+	pthread_mutex_t mutex;
+	unsigned next; /* First block not yet claimed */
+	int result;    /* 1 if an unmerged entry was found, -1 if the index is corrupt */
+};
+
+/*
+ * Walk nr entries starting at pos.
+ * Returns 1 on the first entry with a non-zero stage, 0 if there is none,
+ * -1 if the entries run past the entry area.
+ */
+static int index_map_scan_stages(const struct index_map *map, size_t pos, unsigned nr)
+{
+	unsigned flags;
+
+	for (unsigned i = 0; i < nr; i++) {
+		if (index_map_next_entry(map, &pos, &flags) < 0) {
+			return -1;
+		}
+		if (flags & CE_STAGEMASK) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void *conflict_scan_thread(void *data)
+{
+	struct conflict_scan *scan = data;
+
+	for (;;) {
+		const unsigned char *block;
+		int result;
+
+		pthread_mutex_lock(&scan->mutex);
+		if (scan->result || scan->next >= scan->nr_blocks) {
+			pthread_mutex_unlock(&scan->mutex);
+			break;
+		}
+		block = scan->blocks + 8 * scan->next++;
+		pthread_mutex_unlock(&scan->mutex);
+
+		result = index_map_scan_stages(scan->map, get_be32(block), get_be32(block + 4));
+		if (result) {
+			pthread_mutex_lock(&scan->mutex);
+			if (!scan->result || result < 0) {
+				scan->result = result;
+			}
+			pthread_mutex_unlock(&scan->mutex);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find the IEOT blocks of a large index, if it has a usable table: one whose
+ * block offsets lie in the entry area and whose counts add up to all entries.
+ * Only the EOIE extension is used to find it, as walking all entries to reach
+ * the extensions would be the very scan the table is meant to split.
+ *
+ * Returns the number of blocks and sets *blocks, or 0 to scan serially.
+ */
+static unsigned index_map_entry_blocks(struct index_map *map, const unsigned char **blocks)
+{
+	const unsigned char *ieot;
+	size_t len;
+	unsigned nr_blocks, total = 0;
+
+	if (!HAVE_THREADS || map->nr < CONFLICT_PARALLEL_MIN || online_cpus() < 2 ||
+	    !index_map_read_eoie(map) || !(ieot = index_map_extension(map, "IEOT", &len)) ||
+	    len < 4 || get_be32(ieot) != 1 || (len - 4) % 8) {
+		return 0;
+	}
+
+	nr_blocks = (len - 4) / 8;
+	*blocks = ieot + 4;
+	for (unsigned i = 0; i < nr_blocks; i++) {
+		uint32_t offset = get_be32(*blocks + 8 * i);
+
+		if (offset < INDEX_HEADER_SIZE || offset >= map->extensions) {
+			return 0;
+		}
+		total += get_be32(*blocks + 8 * i + 4);
+	}
+	return total == map->nr ? nr_blocks : 0;
+}
+
+/*
+ * Check the on-disk index for unmerged files without loading it.
+ * Performance: O(n) over entry headers (no cache_entry allocation), split over
+ *              up to WORKTREE_MAX_THREADS threads when the index has an IEOT;
+ *              returns on the first unmerged entry
+ * Safe for large repo mode: Yes (streaming scan, only run during git operations)
+ *
+ * Returns 1 if unmerged files exist, 0 if not, -1 if the index cannot be read.
+ */
+static int has_unmerged_files_mapped(struct repository *r)
+{
+	struct conflict_scan scan = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, 0, 0};
+	pthread_t threads[WORKTREE_MAX_THREADS];
+	struct index_map map;
+	int nr_threads = online_cpus(), started = 0;
+
+	if (index_map_open(&map, r) < 0) {
+		return -1;
+	}
+
+	DEBUG_TIMER_START(conflict_scan);
+	scan.map = &map;
+	scan.nr_blocks = index_map_entry_blocks(&map, &scan.blocks);
+	if (nr_threads > WORKTREE_MAX_THREADS) {
+		nr_threads = WORKTREE_MAX_THREADS;
+	}
+	if (nr_threads > (int)scan.nr_blocks) {
+		nr_threads = scan.nr_blocks;
+	}
+
+	for (int t = 0; nr_threads > 1 && t < nr_threads; t++) {
+		if (pthread_create(&threads[started], NULL, conflict_scan_thread, &scan)) {
+			break;
+		}
+		started++;
+	}
+	if (started) {
+		/* The main thread helps, and picks up all blocks if no thread started */
+		conflict_scan_thread(&scan);
+		for (int t = 0; t < started; t++) {
+			pthread_join(threads[t], NULL);
+		}
+	} else {
+		scan.result = index_map_scan_stages(&map, INDEX_HEADER_SIZE, map.nr);
+	}
+	pthread_mutex_destroy(&scan.mutex);
+	DEBUG_TIMER_END(conflict_scan, "Conflict scan (mapped index)");
+
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] Conflict scan: %u entries, %u blocks, %d threads: %s\n",
+			map.nr, scan.nr_blocks, started,
+			scan.result < 0 ? "corrupt"
+			: scan.result	? "conflicts"
+					: "no conflicts");
+	}
+	index_map_close(&map);
+	return scan.result;
+}
+
+/*
+ * Conflict check for git state detection: uses the index if it is loaded,
+ * otherwise scans the mapped index, and only loads it if that scan fails.
+ * Performance: O(n), see has_unmerged_files() and has_unmerged_files_mapped()
+ * Safe for large repo mode: Yes (only called while a git operation is in progress)
+ */
+static int has_conflicts_in_index(void)
+{
+	int conflicts;
+
+	if (the_repository->index && the_repository->index->initialized) {
+		return has_unmerged_files();
+	}
+
+	conflicts = has_unmerged_files_mapped(the_repository);
+	if (conflicts >= 0) {
+		return conflicts;
+	}
+	if (repo_read_index(the_repository) < 0) {
+		return 0;
+	}
+	return has_unmerged_files();
+}
+
+/*
+ * Check if there are unstaged changes in the working tree.
+ *
+ * Instead of refreshing the whole index, stats tracked files until the first
+ * changed one: first the recently staged hot entries and their directory
+ * siblings, then the rest in index order (on WORKTREE_PARALLEL_MIN or more
+ * entries, spread over threads first). A clean tree still stats every file,
+ * but the usual "just edited a file" case returns after a handful of lstat()s.
+ *
+ * Performance: O(n) lstat()s for a clean tree (O(n / threads) wall time on large
+ *              indexes), typically O(1) when dirty
+ * Safe for large repo mode: No (requires loaded index, expensive filesystem operations)
+ *
+ * Returns 1 if any tracked files have unstaged changes, 0 otherwise,
+ * -1 if the deadline passed before the answer was known.
+ */
+static int has_worktree_changes(struct repository *r)
+{
+	struct index_state *istate;
+	int hot[WORKTREE_HOT_ENTRIES];
+	int nr_hot;
+	int changed;
+
+	if (repo_read_index(r) < 0) {
+		return 0; /* treat unreadable index as clean */
+	}
+
+	istate = r->index;
+
+	/* Phase 1: hot entries and their siblings */
+	nr_hot = find_hot_entries(istate, hot);
+	for (int h = 0; h < nr_hot; h++) {
+		const struct cache_entry *hot_ce = istate->cache[hot[h]];
+		int first = hot[h] > WORKTREE_HOT_SIBLINGS ? hot[h] - WORKTREE_HOT_SIBLINGS : 0;
+		int last = hot[h] + WORKTREE_HOT_SIBLINGS;
+
+		for (int i = first; i <= last && i < istate->cache_nr; i++) {
+			struct cache_entry *ce = istate->cache[i];
+			if (i != hot[h] && !ce_same_directory(hot_ce, ce)) {
+				continue;
+			}
+			if (worktree_entry_changed(istate, ce)) {
+				return 1;
+			}
+		}
+	}
+
+	/* Phase 2: stat large indexes in parallel */
+	changed = parallel_worktree_scan(istate);
+	if (changed == -2) {
+		deadline_expired(DEADLINE_STATUS);
+		return -1;
+	}
+	if (changed >= 0) {
+		if (debug_mode) {
+			fprintf(stderr, "[DEBUG] File not up-to-date: %s\n",
+				istate->cache[changed]->name);
+		}
+		return 1;
+	}
+
+	/* Phase 3: everything not yet up-to-date, serially with content checks */
+	for (int i = 0; i < istate->cache_nr; i++) {
+		if (!(i % WORKTREE_CHUNK) && deadline_expired(DEADLINE_STATUS)) {
+			return -1;
+		}
+		if (worktree_entry_changed(istate, istate->cache[i])) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Append the stat signature of path: mtime, size and inode, or "-" if missing.
+ * The inode catches index and ref updates that land within one mtime tick, as
+ * git always writes them to a lock file that is renamed into place.
+ */
+static void add_stat_signature(struct strbuf *sb, const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st)) {
+		strbuf_addch(sb, '-');
+		return;
+	}
+	strbuf_addf(sb, "%" PRIuMAX ".%09u:%" PRIuMAX ":%" PRIuMAX, (uintmax_t)st.st_mtime,
+		    ST_MTIME_NSEC(st), (uintmax_t)st.st_size, (uintmax_t)st.st_ino);
+}
+
+/*
+ * Dependency lines, the way cache files record what they were built from:
+ * "<prefix><stat signature> <path>\n". Append one for path.
+ */
+static void add_dependency_line(struct strbuf *sb, const char *prefix, const char *path)
+{
+	strbuf_addstr(sb, prefix);
+	add_stat_signature(sb, path);
+	strbuf_addf(sb, " %s\n", path);
+}
+
+/*
+ * Check the dependency lines from p up to end: they run until an empty line
+ * or a line without prefix, where *next is left pointing. what names the
+ * cache in debug output.
+ * Performance: O(d) - one stat() per line
+ *
+ * Returns 0 if no dependency changed, 1 if one did, -1 if a line is corrupt.
+ */
+static int check_dependency_lines(const char *p, const char *end, const char *prefix,
+				  const char **next, const char *what)
+{
+	struct strbuf sig = STRBUF_INIT;
+	struct strbuf path = STRBUF_INIT;
+	size_t prefix_len = strlen(prefix);
+	int ret = 0;
+
+	while (p < end && *p != '\n' && (size_t)(end - p) >= prefix_len &&
+	       !memcmp(p, prefix, prefix_len)) {
+		const char *eol = memchr(p, '\n', end - p), *space;
+
+		p += prefix_len;
+		space = eol ? memchr(p, ' ', eol - p) : NULL;
+		if (!space) {
+			ret = -1;
+			break;
+		}
+		strbuf_reset(&path);
+		strbuf_add(&path, space + 1, eol - space - 1);
+		strbuf_reset(&sig);
+		add_stat_signature(&sig, path.buf);
+		if (sig.len != space - p || memcmp(sig.buf, p, sig.len)) {
+			if (debug_mode) {
+				fprintf(stderr, "[DEBUG] %s: %s changed\n", what, path.buf);
+			}
+			ret = 1;
+			break;
+		}
+		p = eol + 1;
+	}
+
+	*next = p;
+	strbuf_release(&sig);
+	strbuf_release(&path);
+	return ret;
+}
+
+/*
+ * Submodule pass (--submodules): gitlinks are skipped by the worktree check, so
+ * a dirty submodule would leave the superproject green. With --submodules, a
+ * clean worktree is followed by a check of every checked-out submodule, as
+ * 'git status' reports them ("new commits" or "modified content"): first its
+ * HEAD against the gitlink (a ref read each), then its own tracked files, by up
+ * to SUBMODULE_MAX_JOBS parallel 'git status' runs. The first dirty submodule
+ * ends the pass, all share one time budget (SUBMODULE_BUDGET_MS, at most the
+ * rest of --deadline-ms), and untracked files inside submodules are ignored.
+ *
+ * Results are cached in <gitdir>/prompt-submodules, one "<time> <dirty> <HEAD>
+ * <index stat signature> <path>" line per submodule, and reused while the
+ * submodule's HEAD and index are unchanged, for SUBMODULE_CACHE_SECS (edits
+ * inside a submodule do not touch its index).
+ */
+#define SUBMODULE_MAX_JOBS 8
+#define SUBMODULE_BUDGET_MS 500
+#define SUBMODULE_CACHE_SECS 30
+
+struct submodule_check {
+	const char *path; /* Name of the gitlink entry */
+	struct object_id head;
+	struct strbuf index_sig;
+	int dirty; /* 1 dirty, 0 clean, -1 not checked */
+	struct child_process cp;
+	struct strbuf out;
+	int running;
+};
+
+static void submodule_cache_path(struct strbuf *path)
+{
+	strbuf_addf(path, "%s/prompt-submodules", repo_get_git_dir(the_repository));
+}
+
+/*
+ * Look up a fresh cached result for check. Returns 1 (dirty), 0 (clean) or -1.
+ */
+static int submodule_cache_lookup(const struct strbuf *cache, const struct submodule_check *check)
+{
+	struct strbuf key = STRBUF_INIT;
+	const char *p, *eol;
+	int result = -1;
+
+	/* Match " <HEAD> <signature> <path>\n" after "<time> <dirty>" */
+	strbuf_addf(&key, " %s %s %s\n", oid_to_hex(&check->head), check->index_sig.buf,
+		    check->path);
+	for (p = cache->buf; (eol = strchr(p, '\n')); p = eol + 1) {
+		char *end;
+		time_t written = strtoumax(p, &end, 10);
+
+		if (end[0] != ' ' || (end[1] != '0' && end[1] != '1') ||
+		    eol + 1 - (end + 2) != key.len || memcmp(end + 2, key.buf, key.len)) {
+			continue;
+		}
+		if (time(NULL) - written < SUBMODULE_CACHE_SECS) {
+			result = end[1] - '0';
+		}
+		break;
+	}
+
+	strbuf_release(&key);
+	return result;
+}
+
+/*
+ * Save the results of this pass, keeping fresh entries of submodules it did not
+ * get to (it stops at the first dirty one).
+ */
+static void submodule_cache_store(const struct strbuf *old, struct submodule_check *checks, int nr)
+{
+	static struct lock_file lock = LOCK_INIT;
+	struct strbuf path = STRBUF_INIT;
+	struct strbuf buf = STRBUF_INIT;
+	const char *p, *eol;
+	int fd;
+
+	submodule_cache_path(&path);
+	fd = hold_lock_file_for_update(&lock, path.buf, 0);
+	if (fd < 0) {
+		goto cleanup;
+	}
+	for (p = old->buf; (eol = strchr(p, '\n')); p = eol + 1) {
+		const char *name = p;
+		int fresh = time(NULL) - (time_t)strtoumax(p, NULL, 10) < SUBMODULE_CACHE_SECS;
+
+		for (int field = 0; field < 4 && name; field++) {
+			name = memchr(name, ' ', eol - name);
+			name = name ? name + 1 : NULL;
+		}
+		for (int i = 0; fresh && name && i < nr; i++) {
+			if (checks[i].dirty >= 0 && !strncmp(checks[i].path, name, eol - name) &&
+			    !checks[i].path[eol - name]) {
+				fresh = 0; /* Replaced below */
+			}
+		}
+		if (fresh && name) {
+			strbuf_add(&buf, p, eol + 1 - p);
+		}
+	}
+	for (int i = 0; i < nr; i++) {
+		if (checks[i].dirty >= 0) {
+			strbuf_addf(&buf, "%" PRIuMAX " %d %s %s %s\n", (uintmax_t)time(NULL),
+				    checks[i].dirty, oid_to_hex(&checks[i].head),
+				    checks[i].index_sig.buf, checks[i].path);
+		}
+	}
+	if (write_in_full(fd, buf.buf, buf.len) < 0) {
+		rollback_lock_file(&lock);
+	} else {
+		commit_lock_file(&lock);
+	}
+
+cleanup:
+	strbuf_release(&path);
+	strbuf_release(&buf);
+}
+
+/*
+ * Start 'git status' for the tracked files of one submodule.
+ */
+static int submodule_status_start(struct submodule_check *check)
+{
+	child_process_init(&check->cp);
+	prepare_submodule_repo_env(&check->cp.env);
+	strvec_pushl(&check->cp.args, "--no-optional-locks", "status", "--porcelain",
+		     "--untracked-files=no", "--ignore-submodules=all", NULL);
+	check->cp.git_cmd = 1;
+	check->cp.dir = check->path;
+	check->cp.no_stdin = 1;
+	check->cp.no_stderr = 1;
+	check->cp.out = -1;
+	if (start_command(&check->cp)) {
+		return -1;
+	}
+	check->running = 1;
+	return 0;
+}
+
+/*
+ * Reap a status run, killing it first if its result is no longer needed.
+ * Returns the exit code of finish_command().
+ */
+static int submodule_status_finish(struct submodule_check *check, int kill_it)
+{
+	if (kill_it) {
+		kill(check->cp.pid, SIGTERM);
+	}
+	close(check->cp.out);
+	check->running = 0;
+	return finish_command(&check->cp);
+}
+
+/*
+ * Run the queued status checks in parallel until the first dirty submodule.
+ * Returns 1 if one is dirty, 0 if all are clean, -1 if the budget ran out.
+ */
+static int submodule_status_run(struct submodule_check **queue, int nr, uint64_t budget_end)
+{
+	struct submodule_check *running[SUBMODULE_MAX_JOBS];
+	int jobs = online_cpus() < SUBMODULE_MAX_JOBS ? online_cpus() : SUBMODULE_MAX_JOBS;
+	int next = 0, nr_running = 0, result = 0;
+
+	while (!result && (next < nr || nr_running)) {
+		struct pollfd pfd[SUBMODULE_MAX_JOBS];
+		uint64_t now = getnanotime();
+
+		while (next < nr && nr_running < jobs) {
+			if (!submodule_status_start(queue[next])) {
+				running[nr_running++] = queue[next];
+			}
+			next++;
+		}
+		if (!nr_running) {
+			break;
+		}
+		if (now >= budget_end) {
+			result = -1;
+			break;
+		}
+
+		for (int i = 0; i < nr_running; i++) {
+			pfd[i].fd = running[i]->cp.out;
+			pfd[i].events = POLLIN;
+		}
+		if (poll(pfd, nr_running, (budget_end - now) / 1000000 + 1) < 0 &&
+		    errno != EINTR) {
+			result = -1;
+			break;
+		}
+
+		for (int i = 0; i < nr_running; i++) {
+			struct submodule_check *check = running[i];
+			ssize_t n;
+
+			if (!(pfd[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+				continue;
+			}
+			n = strbuf_read_once(&check->out, check->cp.out, 0);
+			if (n > 0) {
+				/* Any porcelain line is a change */
+				check->dirty = 1;
+				result = 1;
+				if (debug_mode) {
+					fprintf(stderr, "[DEBUG] Submodule %s: modified content\n",
+						check->path);
+				}
+			} else {
+				/* EOF without output is clean; a failed run stays unknown */
+				int failed = submodule_status_finish(check, 0);
+
+				check->dirty = !n && !failed ? 0 : -1;
+				running[i--] = running[--nr_running];
+			}
+		}
+	}
+
+	for (int i = 0; i < nr_running; i++) {
+		submodule_status_finish(running[i], 1);
+	}
+	return result;
+}
+
+/*
+ * Check the checked-out submodules of the index for new commits or changes.
+ * Performance: O(s) ref reads and stat() calls for s submodules, plus one
+ *              'git status' per submodule without a cached result, in parallel
+ *              and bounded by the budget
+ * Safe for large repo mode: No (per-submodule status, opt-in)
+ *
+ * Returns 1 if a submodule is dirty, 0 if all are clean, -1 if the budget or
+ * deadline ran out first.
+ */
+static int has_submodule_changes(struct index_state *istate)
+{
+	struct strbuf cache = STRBUF_INIT;
+	struct strbuf gitdir = STRBUF_INIT;
+	struct submodule_check *checks;
+	struct submodule_check **queue;
+	uint64_t budget_end = getnanotime() + (uint64_t)SUBMODULE_BUDGET_MS * 1000000;
+	int nr = 0, nr_queued = 0, nr_gitlinks = 0, result = 0;
+
+	if (status_deadline_end && status_deadline_end < budget_end) {
+		budget_end = status_deadline_end;
+	}
+
+	for (int i = 0; i < istate->cache_nr; i++) {
+		nr_gitlinks += S_ISGITLINK(istate->cache[i]->ce_mode);
+	}
+	if (!nr_gitlinks) {
+		return 0;
+	}
+
+	DEBUG_TIMER_START(submodules);
+	CALLOC_ARRAY(checks, nr_gitlinks);
+	ALLOC_ARRAY(queue, nr_gitlinks);
+	submodule_cache_path(&gitdir);
+	strbuf_read_file(&cache, gitdir.buf, 0);
+
+	for (int i = 0; i < istate->cache_nr && !result; i++) {
+		const struct cache_entry *ce = istate->cache[i];
+		struct submodule_check *check = &checks[nr];
+		struct ref_store *refs;
+		const char *dotgit;
+
+		if (!S_ISGITLINK(ce->ce_mode) || ce_stage(ce) || ce_skip_worktree(ce)) {
+			continue;
+		}
+
+		/* Only checked-out submodules: <path>/.git is a directory or a gitfile */
+		strbuf_reset(&gitdir);
+		strbuf_addf(&gitdir, "%s/.git", ce->name);
+		if (!is_directory(gitdir.buf)) {
+			if (!(dotgit = read_gitfile_gently(gitdir.buf, NULL))) {
+				continue;
+			}
+			strbuf_reset(&gitdir);
+			strbuf_addstr(&gitdir, dotgit);
+		}
+		refs = repo_get_submodule_ref_store(the_repository, ce->name);
+		if (!refs || !refs_resolve_ref_unsafe(refs, "HEAD", RESOLVE_REF_READING,
+						      &check->head, NULL)) {
+			continue;
+		}
+
+		check->path = ce->name;
+		check->dirty = -1;
+		strbuf_init(&check->index_sig, 0);
+		strbuf_init(&check->out, 0);
+		nr++;
+
+		if (!oideq(&check->head, &ce->oid)) {
+			if (debug_mode) {
+				fprintf(stderr, "[DEBUG] Submodule %s: new commits\n", ce->name);
+			}
+			result = 1;
+			break;
+		}
+
+		strbuf_addstr(&gitdir, "/index");
+		add_stat_signature(&check->index_sig, gitdir.buf);
+		check->dirty = submodule_cache_lookup(&cache, check);
+		if (check->dirty > 0) {
+			if (debug_mode) {
+				fprintf(stderr, "[DEBUG] Submodule %s: modified content (cached)\n",
+					ce->name);
+			}
+			result = 1;
+		} else if (check->dirty < 0) {
+			queue[nr_queued++] = check;
+		}
+	}
+
+	if (!result && nr_queued) {
+		result = submodule_status_run(queue, nr_queued, budget_end);
+	}
+	if (result < 0) {
+		pthread_mutex_lock(&deadline_mutex);
+		deadline_hits |= DEADLINE_SUBMODULES;
+		pthread_mutex_unlock(&deadline_mutex);
+	}
+	if (nr) {
+		submodule_cache_store(&cache, checks, nr);
+	}
+
+	DEBUG_TIMER_END(submodules, "Status: submodules");
+	STATS_TIMER_END(submodules, STATS_SUBMODULES);
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] Submodules: %d checked out, %d run, result %d\n", nr,
+			nr_queued, result);
+	}
+
+	for (int i = 0; i < nr; i++) {
+		strbuf_release(&checks[i].index_sig);
+		strbuf_release(&checks[i].out);
+	}
+	free(checks);
+	free(queue);
+	strbuf_release(&cache);
+	strbuf_release(&gitdir);
+	return result;
+}
+
+/*
+ * Walk one directory of the worktree (path is empty or ends in '/') looking for an
+ * untracked, non-ignored file, depth first. Ignored directories are skipped
+ * whole, as are submodules; a nested repository counts as untracked, as in
+ * 'git status'.
+ *
+ * Returns 1 and stops at the first untracked file, 0 if there is none below path,
+ * -1 if the deadline passed (checked once per directory).
+ */
+static int probe_untracked_dir(struct dir_struct *dir, struct index_state *istate,
+			       struct strbuf *path)
+{
+	size_t baselen = path->len;
+	struct dirent *de;
+	DIR *fdir;
+	int found = 0;
+
+	if (deadline_expired(DEADLINE_UNTRACKED)) {
+		return -1;
+	}
+
+	fdir = opendir(baselen ? path->buf : ".");
+	if (!fdir) {
+		return 0;
+	}
+
+	while (!found && (de = readdir(fdir))) {
+		int dtype = DTYPE(de);
+		struct stat st;
+
+		if (is_dot_or_dotdot(de->d_name) || !strcmp(de->d_name, ".git")) {
+			continue;
+		}
+
+		strbuf_setlen(path, baselen);
+		strbuf_addstr(path, de->d_name);
+
+		if (dtype != DT_REG && dtype != DT_DIR && dtype != DT_LNK) {
+			STATS_ADD(lstat_calls, 1);
+			if (lstat(path->buf, &st)) {
+				continue;
+			}
+			dtype = S_ISDIR(st.st_mode)   ? DT_DIR
+				: S_ISREG(st.st_mode) ? DT_REG
+						      : DT_LNK;
+		}
+
+		/* Tracked files and submodules */
+		if (index_file_exists(istate, path->buf, path->len, ignore_case)) {
+			continue;
+		}
+		if (is_excluded(dir, istate, path->buf, &dtype)) {
+			continue;
+		}
+
+		if (dtype != DT_DIR) {
+			found = 1;
+		} else {
+			strbuf_addstr(path, "/.git");
+			if (file_exists(path->buf)) {
+				found = 1; /* Nested repository */
+			} else {
+				strbuf_setlen(path, path->len - strlen(".git"));
+				found = probe_untracked_dir(dir, istate, path);
+			}
+		}
+
+		if (found > 0 && debug_mode) {
+			fprintf(stderr, "[DEBUG] Found untracked entry: %.*s\n", (int)path->len,
+				path->buf);
+		}
+	}
+
+	closedir(fdir);
+	strbuf_setlen(path, baselen);
+	return found;
+}
+
+/*
+ * Whether the index's untracked cache can answer for this worktree: the checks of
+ * validate_untracked_cache() in dir.c (same worktree and system, same flags and
+ * per-directory file, unchanged info/exclude and core.excludesFile), without its
+ * side effect of resetting the cache on a mismatch.
+ */
+static int untracked_cache_usable(const struct dir_struct *dir)
+{
+	const struct untracked_cache *uc = dir->untracked;
+	struct strbuf ident = STRBUF_INIT;
+	struct utsname uts;
+	int usable;
+
+	if (!uc->root || uc->dir_flags != dir->flags || !uc->exclude_per_dir ||
+	    strcmp(uc->exclude_per_dir, dir->exclude_per_dir) || uname(&uts) < 0) {
+		return 0;
+	}
+	strbuf_addf(&ident, "Location %s, system %s", repo_get_work_tree(the_repository),
+		    uts.sysname);
+	usable = !strcmp(uc->ident.buf, ident.buf) &&
+		 oideq(&dir->internal.ss_info_exclude.oid, &uc->ss_info_exclude.oid) &&
+		 oideq(&dir->internal.ss_excludes_file.oid, &uc->ss_excludes_file.oid);
+	strbuf_release(&ident);
+	return usable;
+}
+
+/*
+ * Walk the untracked cache below one directory (path is empty or ends in '/'),
+ * stopping at the first untracked entry. A directory is trusted when the cache
+ * marks it valid and its stat data (or fsmonitor) and .gitignore are unchanged,
+ * as in valid_cached_dir(); then its recorded entries are the answer and only
+ * its subdirectories are visited. Any other directory is read again with
+ * probe_untracked_dir(), as are untracked directories (recorded as "name/"),
+ * whose contents the parent's stat data does not cover.
+ *
+ * Returns 1 at the first untracked entry, 0 if there is none below path,
+ * -1 if the deadline passed (checked once per directory).
+ */
+static int probe_untracked_cache(struct dir_struct *dir, struct index_state *istate,
+				 struct untracked_cache_dir *ucd, struct strbuf *path)
+{
+	size_t baselen = path->len;
+	int dtype = DT_REG;
+	int found = 0;
+
+	if (deadline_expired(DEADLINE_UNTRACKED)) {
+		return -1;
+	}
+
+	if (!(dir->untracked->use_fsmonitor && istate->fsmonitor_has_run_once && ucd->valid)) {
+		struct stat st;
+
+		STATS_ADD(lstat_calls, 1);
+		if (lstat(baselen ? path->buf : ".", &st)) {
+			return 0;
+		}
+		if (!ucd->valid || match_stat_data_racy(istate, &ucd->stat_data, &st)) {
+			return probe_untracked_dir(dir, istate, path);
+		}
+	}
+	if (ucd->check_only) {
+		return probe_untracked_dir(dir, istate, path);
+	}
+
+	/* Matching a name in this directory loads its .gitignore; a changed one invalidates ucd */
+	strbuf_addch(path, '.');
+	is_excluded(dir, istate, path->buf, &dtype);
+	strbuf_setlen(path, baselen);
+	if (!ucd->valid) {
+		return probe_untracked_dir(dir, istate, path);
+	}
+
+	for (unsigned int i = 0; !found && i < ucd->untracked_nr; i++) {
+		const char *name = ucd->untracked[i];
+
+		strbuf_addstr(path, name);
+		if (!ends_with(name, "/")) {
+			found = 1;
+		} else {
+			found = probe_untracked_dir(dir, istate, path);
+		}
+		if (found > 0 && debug_mode) {
+			fprintf(stderr, "[DEBUG] Found untracked entry (untracked cache): %s\n",
+				path->buf);
+		}
+		strbuf_setlen(path, baselen);
+	}
+
+	for (unsigned int i = 0; !found && i < ucd->dirs_nr; i++) {
+		strbuf_addf(path, "%s/", ucd->dirs[i]->name);
+		found = probe_untracked_cache(dir, istate, ucd->dirs[i], path);
+		strbuf_setlen(path, baselen);
+	}
+	return found;
+}
+
+/*
+ * Check if there are untracked (and not ignored) files in the working tree.
+ *
+ * Both ways stop at the first untracked file and never enter ignored directories.
+ * With the index's untracked cache (core.untrackedCache) its tree is walked, and
+ * only directories whose stat data changed since the cache was written are read
+ * from disk (see probe_untracked_cache()); without it, or when the cache does not
+ * match this worktree, the whole worktree is walked with probe_untracked_dir().
+ *
+ * Performance: O(cached directories) plus O(changed directories) with the
+ *              untracked cache, O(m) worst case (clean tree) without, m = worktree files
+ * Safe for large repo mode: Only with the untracked cache
+ *
+ * Returns 1 if at least one untracked file exists, 0 otherwise,
+ * -1 if the deadline passed first.
+ */
+static int has_untracked_files(struct index_state *istate)
+{
+	struct dir_struct dir = DIR_INIT;
+	struct strbuf path = STRBUF_INIT;
+	int found;
+
+	dir.flags = DIR_SHOW_OTHER_DIRECTORIES | DIR_HIDE_EMPTY_DIRECTORIES;
+	/* With dir.untracked set, the exclude files' object ids are recorded for the check */
+	dir.untracked = istate->untracked;
+	setup_standard_excludes(&dir);
+	if (dir.untracked && !untracked_cache_usable(&dir)) {
+		if (debug_mode) {
+			fprintf(stderr, "[DEBUG] Untracked cache does not match, walking the "
+					"worktree\n");
+		}
+		dir.untracked = NULL;
+	}
+
+	if (deadline_expired(DEADLINE_UNTRACKED)) {
+		found = -1;
+	} else if (dir.untracked) {
+		found = probe_untracked_cache(&dir, istate, dir.untracked->root, &path);
+	} else {
+		found = probe_untracked_dir(&dir, istate, &path);
+	}
+
+	strbuf_release(&path);
+	dir_clear(&dir);
+	return found;
+}
+
+/*
+ * Helper to check for a git state file and populate git_state if found.
+ * Performance: O(1) - single access() syscall to check file existence
+ *              If file exists, calls has_conflicts_in_index() which is O(n)
+ * Safe for large repo mode: Yes (conflicts come from the mapped index when it is not loaded)
+ *
+ * Returns 1 if the state file exists, 0 otherwise.
+ */
+static int check_git_state_file(const char *gitdir, const char *filename, struct git_state *state,
+				const char *state_conflict, const char *state_normal)
+{
+	struct strbuf path = STRBUF_INIT;
+	int found = 0;
+
+	strbuf_addf(&path, "%s/%s", gitdir, filename);
+
+	if (!access(path.buf, F_OK)) {
+		int has_conflicts = has_conflicts_in_index();
+
+		state->has_state = 1;
+		state->has_conflicts = has_conflicts;
+		state->state_name = has_conflicts ? state_conflict : state_normal;
+		state->state_color = has_conflicts ? COLOR_CONFLICT : COLOR_MERGE;
+		found = 1;
+	}
+
+	strbuf_release(&path);
+	return found;
+}
+
+/*
+ * Detect special git states (merge, rebase, etc.) and populate git_state struct.
+ * Conflicts come from the loaded index, or the mapped index if it is not loaded.
+ *
+ * Performance: O(1) for state file checks, O(n) if conflicts need detection
+ *              Checks 5 state files via access() syscalls (fast)
+ *              If state exists, calls has_conflicts_in_index() O(n)
+ * Safe for large repo mode: Yes (conflict detection never parses the index there)
+ *
+ * Returns a git_state struct with all relevant information.
+ */
+static struct git_state get_git_state(void)
+{
+	struct git_state state = {0, 0, NULL, NULL};
+	const char *gitdir = repo_get_git_dir(the_repository);
+
+	/* Check for rebase (interactive or apply mode) */
+	if (check_git_state_file(gitdir, "rebase-merge", &state, "rebase:conflict",
+				 "rebase:continue")) {
+		return state;
+	}
+
+	if (check_git_state_file(gitdir, "rebase-apply", &state, "rebase:conflict",
+				 "rebase:continue")) {
+		return state;
+	}
+
+	/* Check for merge */
+	if (check_git_state_file(gitdir, "MERGE_HEAD", &state, "merge:conflict", "merge:commit")) {
+		return state;
+	}
+
+	/* Check for cherry-pick */
+	if (check_git_state_file(gitdir, "CHERRY_PICK_HEAD", &state, "cherrypick:conflict",
+				 "cherrypick:commit")) {
+		return state;
+	}
+
+	/* Check for revert */
+	check_git_state_file(gitdir, "REVERT_HEAD", &state, "revert:conflict", "revert:commit");
+
+	return state;
+}
+
+/*
+ * Ref snapshot: every ref one prompt looks at, resolved once up front by its
+ * full name. Later lookups are served from memory, so short names such as
+ * "origin/main" never go through the DWIM rules (up to six candidate refs,
+ * all tried for the ambiguity check) and no ref is read twice. Loose refs are
+ * one read each; the packed-refs snapshot is mapped once by the refs backend
+ * and shared by all of them.
+ */
+struct ref_snapshot_entry {
+	char *refname;		/* Full ref name (allocated) */
+	char *target;		/* Ref it points to if it is a symref, else NULL */
+	struct object_id oid;	/* Resolved value, valid if exists */
+	int exists;		/* Resolves to an object */
+};
+
+struct ref_snapshot {
+	struct ref_snapshot_entry head;
+	struct ref_snapshot_entry stash;
+	/* Only read when HEAD is a branch (tracking is skipped when detached) */
+	const char *remote_name;		/* Remote of the branch, "origin" by default */
+	struct ref_snapshot_entry remote_head;	/* refs/remotes/<remote>/HEAD */
+	struct ref_snapshot_entry remote_main;	/* refs/remotes/<remote>/main */
+	struct ref_snapshot_entry remote_master; /* refs/remotes/<remote>/master */
+	struct ref_snapshot_entry upstream;	/* Upstream tracking ref, if configured */
+};
+
+static void ref_snapshot_read(struct ref_store *refs, struct ref_snapshot_entry *entry,
+			      char *refname)
+{
+	const char *resolved;
+	int flags = 0;
+
+	entry->refname = refname;
+	resolved = refs_resolve_ref_unsafe(refs, refname, RESOLVE_REF_READING, &entry->oid,
+					   &flags);
+	entry->exists = !!resolved;
+	if (resolved && (flags & REF_ISSYMREF)) {
+		entry->target = xstrdup(resolved);
+	}
+}
+
+/*
+ * Resolve all refs of the prompt in one batch.
+ * Performance: O(1) - at most 6 loose ref reads plus lookups in the packed-refs
+ *              snapshot (mapped once)
+ * Safe for large repo mode: Yes (no index or worktree operations)
+ */
+static void ref_snapshot_load(struct ref_snapshot *snapshot, struct ref_store *refs)
+{
+	struct branch *branch;
+	const char *upstream;
+
+	memset(snapshot, 0, sizeof(*snapshot));
+	ref_snapshot_read(refs, &snapshot->head, xstrdup("HEAD"));
+	ref_snapshot_read(refs, &snapshot->stash, xstrdup("refs/stash"));
+
+	if (!snapshot->head.target || !starts_with(snapshot->head.target, "refs/heads/")) {
+		return;
+	}
+
+	/* Determine the remote (handles branch.<name>.remote config) */
+	branch = branch_get(NULL);
+	if (branch) {
+		snapshot->remote_name = remote_for_branch(branch, NULL);
+	}
+	if (!snapshot->remote_name) {
+		snapshot->remote_name = "origin";
+	}
+
+	ref_snapshot_read(refs, &snapshot->remote_head,
+			  xstrfmt("refs/remotes/%s/HEAD", snapshot->remote_name));
+	ref_snapshot_read(refs, &snapshot->remote_main,
+			  xstrfmt("refs/remotes/%s/main", snapshot->remote_name));
+	ref_snapshot_read(refs, &snapshot->remote_master,
+			  xstrfmt("refs/remotes/%s/master", snapshot->remote_name));
+
+	upstream = branch ? branch_get_upstream(branch, NULL) : NULL;
+	if (upstream) {
+		ref_snapshot_read(refs, &snapshot->upstream, xstrdup(upstream));
+	}
+}
+
+static void ref_snapshot_entry_release(struct ref_snapshot_entry *entry)
+{
+	FREE_AND_NULL(entry->refname);
+	FREE_AND_NULL(entry->target);
+}
+
+static void ref_snapshot_release(struct ref_snapshot *snapshot)
+{
+	ref_snapshot_entry_release(&snapshot->head);
+	ref_snapshot_entry_release(&snapshot->stash);
+	ref_snapshot_entry_release(&snapshot->remote_head);
+	ref_snapshot_entry_release(&snapshot->remote_main);
+	ref_snapshot_entry_release(&snapshot->remote_master);
+	ref_snapshot_entry_release(&snapshot->upstream);
+}
+
+/*
+ * Tag reverse index: the tag name of a detached HEAD comes from
+ * <common-dir>/prompt-tags, a table of tag targets sorted by OID, so it costs
+ * one binary search in any repository instead of loading all refs as
+ * decorations.
+ *
+ * Built from packed-refs (using its peeled "^" lines) and the loose refs under
+ * refs/tags, which override packed ones as in git; annotated tags without a
+ * peeled value are peeled through the object database. When several tags point
+ * at one commit, the alphabetically last is kept, which is the one the head of
+ * the decoration list named.
+ *
+ * File format (native byte order): header, the "<stat signature> <path>" lines
+ * of packed-refs and of every directory below refs/tags (tag updates rename a
+ * file into one of them), padded to 4 bytes, the records and the NUL-terminated
+ * names. Only the files ref backend is supported; reftable repositories use
+ * decorations as before.
+ */
+#define TAG_INDEX_MAGIC 0x47505449 /* "GPTI" */
+#define TAG_INDEX_VERSION 1
+
+struct tag_index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t hash_format;
+	uint32_t nr;
+	uint32_t deps_len;
+	uint32_t names_len;
+};
+
+struct tag_index_record {
+	unsigned char oid[GIT_MAX_RAWSZ];
+	uint32_t name; /* Offset into the names */
+};
+
+struct tag_index_target {
+	struct object_id oid;
+	int needs_peel; /* May be an annotated tag */
+};
+
+struct tag_index_sort {
+	struct object_id oid;
+	const char *name;
+};
+
+static struct lock_file tag_index_lock = LOCK_INIT;
+
+static struct tag_index_target *tag_index_set(struct string_list *tags, const char *name,
+					      const struct object_id *oid, int needs_peel)
+{
+	struct string_list_item *item = string_list_insert(tags, name);
+	struct tag_index_target *target = item->util;
+
+	if (!target) {
+		item->util = target = xcalloc(1, sizeof(*target));
+	}
+	oidcpy(&target->oid, oid);
+	target->needs_peel = needs_peel;
+	return target;
+}
+
+/*
+ * Add the tags of packed-refs. With the "peeled" trait every annotated tag is
+ * followed by its "^<peeled>" line, so nothing needs peeling.
+ */
+static void tag_index_add_packed(struct string_list *tags, struct strbuf *deps)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct strbuf buf = STRBUF_INIT;
+	struct tag_index_target *last = NULL;
+	const char *p, *eol;
+	int peeled = 0;
+
+	strbuf_addf(&path, "%s/packed-refs", repo_get_common_dir(the_repository));
+	add_dependency_line(deps, "", path.buf);
+	if (strbuf_read_file(&buf, path.buf, 0) < 0) {
+		goto cleanup;
+	}
+
+	for (p = buf.buf; p < buf.buf + buf.len; p = eol + 1) {
+		struct object_id oid;
+		const char *end, *name;
+		struct strbuf refname = STRBUF_INIT;
+
+		eol = memchr(p, '\n', buf.buf + buf.len - p);
+		if (!eol) {
+			break; /* Truncated */
+		}
+		if (*p == '#') {
+			struct strbuf traits = STRBUF_INIT;
+
+			strbuf_add(&traits, p, eol - p + 1);
+			peeled = strstr(traits.buf, " peeled ") ||
+				 strstr(traits.buf, " fully-peeled ");
+			strbuf_release(&traits);
+			continue;
+		}
+		if (*p == '^') {
+			if (last && !parse_oid_hex(p + 1, &oid, &end) && end == eol) {
+				oidcpy(&last->oid, &oid);
+				last->needs_peel = 0;
+			}
+			continue;
+		}
+
+		last = NULL;
+		if (parse_oid_hex(p, &oid, &end) || *end != ' ') {
+			continue;
+		}
+		strbuf_add(&refname, end + 1, eol - end - 1);
+		if (skip_prefix(refname.buf, "refs/tags/", &name)) {
+			last = tag_index_set(tags, name, &oid, !peeled);
+		}
+		strbuf_release(&refname);
+	}
+
+cleanup:
+	strbuf_release(&path);
+	strbuf_release(&buf);
+}
+
+/*
+ * Add the loose tags below path (refs/tags and its subdirectories).
+ */
+static void tag_index_add_loose(struct strbuf *path, size_t prefix_len, struct string_list *tags,
+				struct strbuf *deps)
+{
+	size_t len = path->len;
+	struct strbuf buf = STRBUF_INIT;
+	struct dirent *de;
+	DIR *dir;
+
+	add_dependency_line(deps, "", path->buf);
+	if (!(dir = opendir(path->buf))) {
+		return;
+	}
+	while ((de = readdir(dir))) {
+		struct object_id oid;
+		struct stat st;
+		const char *end;
+
+		if (de->d_name[0] == '.' || ends_with(de->d_name, ".lock")) {
+			continue;
+		}
+		strbuf_addf(path, "/%s", de->d_name);
+		if (!lstat(path->buf, &st)) {
+			if (S_ISDIR(st.st_mode)) {
+				tag_index_add_loose(path, prefix_len, tags, deps);
+			} else if (S_ISREG(st.st_mode) &&
+				   strbuf_read_file(&buf, path->buf, 0) >= 0 &&
+				   !parse_oid_hex(buf.buf, &oid, &end) &&
+				   (*end == '\n' || !*end)) {
+				tag_index_set(tags, path->buf + prefix_len, &oid, 1);
+			}
+		}
+		strbuf_reset(&buf);
+		strbuf_setlen(path, len);
+	}
+	closedir(dir);
+	strbuf_release(&buf);
+}
+
+static int compare_tag_index_sort(const void *a_, const void *b_)
+{
+	const struct tag_index_sort *a = a_, *b = b_;
+	int cmp = oidcmp(&a->oid, &b->oid);
+
+	return cmp ? cmp : strcmp(a->name, b->name);
+}
+
+/*
+ * Build the index file contents into out.
+ * Performance: O(t log t) for t tags, plus one object read per loose or
+ *              unpeeled packed tag; runs only when refs/tags or packed-refs changed
+ * Safe for large repo mode: Yes (refs only, no index or worktree operations)
+ */
+static void tag_index_build(struct strbuf *out)
+{
+	struct string_list tags = STRING_LIST_INIT_DUP;
+	struct strbuf deps = STRBUF_INIT;
+	struct strbuf path = STRBUF_INIT;
+	struct strbuf names = STRBUF_INIT;
+	struct tag_index_header header = {TAG_INDEX_MAGIC, TAG_INDEX_VERSION,
+					  the_repository->hash_algo->format_id, 0};
+	struct tag_index_sort *sorted;
+	size_t nr = 0;
+
+	tag_index_add_packed(&tags, &deps);
+	strbuf_addf(&path, "%s/refs/tags", repo_get_common_dir(the_repository));
+	tag_index_add_loose(&path, path.len + 1, &tags, &deps);
+	while (deps.len % 4) {
+		strbuf_addch(&deps, '\n'); /* Padding: empty lines after the dependencies */
+	}
+
+	ALLOC_ARRAY(sorted, tags.nr);
+	for (size_t i = 0; i < tags.nr; i++) {
+		struct tag_index_target *target = tags.items[i].util;
+
+		if (target->needs_peel &&
+		    oid_object_info(the_repository, &target->oid, NULL) == OBJ_TAG) {
+			struct object *obj = deref_tag(the_repository,
+						       parse_object(the_repository, &target->oid),
+						       tags.items[i].string, 0);
+			if (!obj) {
+				continue; /* Broken tag */
+			}
+			oidcpy(&target->oid, &obj->oid);
+		}
+		oidcpy(&sorted[nr].oid, &target->oid);
+		sorted[nr++].name = tags.items[i].string;
+	}
+	QSORT(sorted, nr, compare_tag_index_sort);
+
+	header.deps_len = deps.len;
+	strbuf_add(out, &header, sizeof(header));
+	strbuf_addbuf(out, &deps);
+	for (size_t i = 0; i < nr; i++) {
+		struct tag_index_record record = {{0}};
+
+		/* Only the last (alphabetically) of the tags of one commit */
+		if (i + 1 < nr && oideq(&sorted[i].oid, &sorted[i + 1].oid)) {
+			continue;
+		}
+		memcpy(record.oid, sorted[i].oid.hash, the_repository->hash_algo->rawsz);
+		record.name = names.len;
+		strbuf_add(&names, sorted[i].name, strlen(sorted[i].name) + 1);
+		strbuf_add(out, &record, sizeof(record));
+		header.nr++;
+	}
+	header.names_len = names.len;
+	memcpy(out->buf, &header, sizeof(header));
+	strbuf_addbuf(out, &names);
+
+	free(sorted);
+	string_list_clear(&tags, 1);
+	strbuf_release(&deps);
+	strbuf_release(&path);
+	strbuf_release(&names);
+}
+
+/*
+ * Check the header and sizes, and that no file the index was built from
+ * changed. Returns the header, or NULL if data must be rebuilt.
+ */
+static const struct tag_index_header *tag_index_check(const char *data, size_t size)
+{
+	const struct tag_index_header *header = (const struct tag_index_header *)data;
+	const char *p, *end;
+
+	if (size < sizeof(*header) || header->magic != TAG_INDEX_MAGIC ||
+	    header->version != TAG_INDEX_VERSION ||
+	    header->hash_format != the_repository->hash_algo->format_id ||
+	    header->deps_len % 4 ||
+	    size != sizeof(*header) + header->deps_len +
+			    (size_t)header->nr * sizeof(struct tag_index_record) +
+			    header->names_len ||
+	    (header->names_len && data[size - 1])) {
+		return NULL;
+	}
+
+	end = data + sizeof(*header) + header->deps_len;
+	if (check_dependency_lines(data + sizeof(*header), end, "", &p, "Tag index")) {
+		return NULL;
+	}
+	for (; p < end; p++) {
+		if (*p != '\n') {
+			return NULL; /* Not padding */
+		}
+	}
+	return header;
+}
+
+/*
+ * Binary search for the tag of oid. Returns its name (without refs/tags/) or
+ * NULL if no tag points at it.
+ */
+static const char *tag_index_find(const char *data, const struct object_id *oid)
+{
+	const struct tag_index_header *header = (const struct tag_index_header *)data;
+	const struct tag_index_record *records =
+		(const struct tag_index_record *)(data + sizeof(*header) + header->deps_len);
+	const char *names = (const char *)(records + header->nr);
+	size_t rawsz = the_repository->hash_algo->rawsz;
+	uint32_t lo = 0, hi = header->nr;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int cmp = memcmp(records[mid].oid, oid->hash, rawsz);
+
+		if (!cmp) {
+			return records[mid].name < header->names_len ? names + records[mid].name
+								      : NULL;
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Look up the tag name of a commit, rebuilding the index if refs changed.
+ * Performance: O(d + log t) - d stat() calls to validate (packed-refs and the
+ *              directories below refs/tags) and a binary search over t tags
+ * Safe for large repo mode: Yes (no index or worktree operations)
+ *
+ * Returns 1 if a name was added to name, 0 if no tag points at oid and -1 if
+ * the index is not available (reftable).
+ */
+static int tag_index_lookup(const struct object_id *oid, struct strbuf *name)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct strbuf built = STRBUF_INIT;
+	const char *data = NULL, *tag;
+	void *map = MAP_FAILED;
+	struct stat st;
+	int fd, ret;
+
+	if (the_repository->ref_storage_format != REF_STORAGE_FORMAT_FILES) {
+		return -1;
+	}
+
+	DEBUG_TIMER_START(tag_index);
+	strbuf_addf(&path, "%s/prompt-tags", repo_get_common_dir(the_repository));
+	fd = open(path.buf, O_RDONLY);
+	if (fd >= 0) {
+		if (!fstat(fd, &st) && st.st_size > 0) {
+			map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		close(fd);
+		if (map != MAP_FAILED && tag_index_check(map, st.st_size)) {
+			data = map;
+		}
+	}
+
+	if (!data) {
+		tag_index_build(&built);
+		data = built.buf;
+		if (debug_mode) {
+			fprintf(stderr, "[DEBUG] Tag index: rebuilt, %u commits tagged\n",
+				((const struct tag_index_header *)data)->nr);
+		}
+
+		/* Another process writing it at the same time builds the same result */
+		fd = hold_lock_file_for_update(&tag_index_lock, path.buf, 0);
+		if (fd >= 0) {
+			if (write_in_full(fd, built.buf, built.len) < 0) {
+				rollback_lock_file(&tag_index_lock);
+			} else {
+				commit_lock_file(&tag_index_lock);
+			}
+		}
+	}
+
+	tag = tag_index_find(data, oid);
+	if (tag) {
+		strbuf_addstr(name, tag);
+	}
+	ret = !!tag;
+	DEBUG_TIMER_END(tag_index, "Tag index lookup");
+
+	if (map != MAP_FAILED) {
+		munmap(map, st.st_size);
+	}
+	strbuf_release(&built);
+	strbuf_release(&path);
+	return ret;
+}
+
+/*
+ * Shared context for prompt generation.
+ * Filled once at startup and passed to all helper functions.
+ */
+struct prompt_context {
+	struct object_id oid;	/* HEAD commit */
+	const struct object_id *head_tree; /* HEAD's tree, NULL if it cannot be parsed */
+	struct ref_store *refs; /* Ref store */
+	struct ref_snapshot *snapshot; /* Every ref the prompt reads */
+	int large_repo;		/* Large repo flag */
+	int index_loaded;	/* Index loaded flag */
+	int fsmonitor;		/* Large repo, but fsmonitor makes status checks cheap */
+};
+
+/*
+ * BFS node tracking during graph traversal (ring buffer entry).
+ */
+struct bfs_node {
+	struct object_id oid;
+	int distance; /* Steps from the origin (start or target) */
+};
+
+/*
+ * BFS state for one side of the multi-target search (heap-allocated per search).
+ */
+struct bfs_state {
+	struct bfs_node queue[BFS_QUEUE_SIZE]; /* Ring buffer for this side */
+	int head;			       /* Queue head index */
+	int tail;			       /* Queue tail index */
+	int size;			       /* Current queue size */
+	int steps_remaining;		       /* Budget remaining for this side */
+};
+
+/*
+ * Distance of one reached commit from every side of the search.
+ * Side 0 is the start (HEAD), sides 1..nr_targets are the targets.
+ */
+struct bfs_distance_entry {
+	struct object_id oid;
+	int dist[BFS_MAX_SIDES]; /* Distance from each side (-1 if not reached) */
+	unsigned expanded;	 /* Bit per side whose parents were already visited */
+};
+
+/*
+ * Distance table: entries are bump-allocated from fixed-size arena blocks (so
+ * they never move) and found through an open-addressing table of {OID prefix,
+ * entry index} slots, so a probe touches one 8-byte slot per step and the entry
+ * itself only on a prefix match. Everything is released at once by
+ * bfs_table_clear().
+ *
+ * Performance: O(1) amortized lookup/insert, one allocation per 256 entries
+ */
+#define BFS_ARENA_BLOCK 256 /* Entries per arena block */
+#define BFS_TABLE_MIN 1024  /* Initial slots (power of 2), kept at most half full */
+
+struct bfs_table_slot {
+	uint32_t hash;	/* oidhash() of the entry: the first 4 bytes of the OID */
+	uint32_t index; /* Entry index + 1, 0 if the slot is empty */
+};
+
+struct bfs_distance_table {
+	struct bfs_distance_entry **blocks;
+	size_t nr_blocks, alloc_blocks;
+	uint32_t nr; /* Entries in use, also the next arena index */
+	struct bfs_table_slot *slots;
+	uint32_t mask; /* Number of slots - 1 */
+};
+
+/*
+ * Divergence between the start and one target.
+ */
+struct bfs_target_result {
+	int ahead;  /* Commits in start but not in target (-1 if not found) */
+	int behind; /* Commits in target but not in start (-1 if not found) */
+};
+
+/*
+ * Result of a multi-target divergence calculation.
+ */
+struct bfs_divergence_result {
+	struct bfs_target_result targets[BFS_MAX_TARGETS];
+	int commits_visited; /* Number of commits traversed (traversal cost) */
+	int in_progress;     /* 1 if an unfinished search was saved to resume next prompt */
+	int timed_out;	     /* 1 if --deadline-ms cut the search short (never cached) */
+};
+
+/*
+ * One search from the start against all targets, shared by both walks.
+ */
+struct bfs_search {
+	const struct object_id *start;
+	const struct object_id *targets;
+	int nr_targets;
+	int nr_sides;			  /* 1 + nr_targets */
+	struct bfs_distance_table distances;
+	struct bfs_divergence_result *result;
+	int done[BFS_MAX_TARGETS];	  /* 1 once a target was resolved or gave up */
+	int unresolved;			  /* Number of targets still being searched */
+	int commits_visited;
+	int timed_out;			  /* Stopped by --deadline-ms */
+};
+
+static void bfs_table_init(struct bfs_distance_table *table)
+{
+	memset(table, 0, sizeof(*table));
+	CALLOC_ARRAY(table->slots, BFS_TABLE_MIN);
+	table->mask = BFS_TABLE_MIN - 1;
+}
+
+static void bfs_table_clear(struct bfs_distance_table *table)
+{
+	for (size_t i = 0; i < table->nr_blocks; i++) {
+		free(table->blocks[i]);
+	}
+	free(table->blocks);
+	free(table->slots);
+	memset(table, 0, sizeof(*table));
+}
+
+/*
+ * Entry by arena index (0 <= i < table->nr), for iterating over all entries.
+ */
+static struct bfs_distance_entry *bfs_table_entry(struct bfs_distance_table *table, uint32_t i)
+{
+	return &table->blocks[i / BFS_ARENA_BLOCK][i % BFS_ARENA_BLOCK];
+}
+
+/*
+ * Return the slot holding oid, or the empty slot where it would be inserted.
+ */
+static struct bfs_table_slot *bfs_table_probe(struct bfs_distance_table *table,
+					      const struct object_id *oid, uint32_t hash)
+{
+	for (uint32_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+		struct bfs_table_slot *slot = &table->slots[i];
+		if (!slot->index) {
+			return slot;
+		}
+		if (slot->hash == hash &&
+		    oideq(&bfs_table_entry(table, slot->index - 1)->oid, oid)) {
+			return slot;
+		}
+	}
+}
+
+/*
+ * Double the slot array and re-insert every entry (the arena does not move).
+ */
+static void bfs_table_grow(struct bfs_distance_table *table)
+{
+	uint32_t nr_slots = (table->mask + 1) * 2;
+
+	free(table->slots);
+	CALLOC_ARRAY(table->slots, nr_slots);
+	table->mask = nr_slots - 1;
+
+	for (uint32_t i = 0; i < table->nr; i++) {
+		const struct object_id *oid = &bfs_table_entry(table, i)->oid;
+		uint32_t hash = oidhash(oid);
+		struct bfs_table_slot *slot = bfs_table_probe(table, oid, hash);
+		slot->hash = hash;
+		slot->index = i + 1;
+	}
+}
+
+static struct bfs_distance_entry *bfs_table_get(struct bfs_distance_table *table,
+						const struct object_id *oid)
+{
+	struct bfs_table_slot *slot = bfs_table_probe(table, oid, oidhash(oid));
+	return slot->index ? bfs_table_entry(table, slot->index - 1) : NULL;
+}
+
+/*
+ * Helper to get or create a distance entry in the table.
+ * Returns NULL if entry exists, or the newly created entry if it didn't exist.
+ */
+static struct bfs_distance_entry *get_or_create_entry(struct bfs_distance_table *table,
+						      const struct object_id *oid)
+{
+	uint32_t hash = oidhash(oid);
+	struct bfs_table_slot *slot = bfs_table_probe(table, oid, hash);
+	struct bfs_distance_entry *entry;
+
+	if (slot->index) {
+		return NULL; /* Already exists */
+	}
+
+	if (table->nr % BFS_ARENA_BLOCK == 0) {
+		ALLOC_GROW(table->blocks, table->nr_blocks + 1, table->alloc_blocks);
+		ALLOC_ARRAY(table->blocks[table->nr_blocks], BFS_ARENA_BLOCK);
+		table->nr_blocks++;
+	}
+
+	entry = bfs_table_entry(table, table->nr);
+	oidcpy(&entry->oid, oid);
+	for (int side = 0; side < BFS_MAX_SIDES; side++) {
+		entry->dist[side] = -1;
+	}
+	entry->expanded = 0;
+
+	slot->hash = hash;
+	slot->index = ++table->nr;
+	if (table->nr * 2 > table->mask) {
+		bfs_table_grow(table);
+	}
+	return entry;
+}
+
+/*
+ * Like get_or_create_entry(), but returns the existing entry too.
+ */
+static struct bfs_distance_entry *find_or_create_entry(struct bfs_distance_table *table,
+						       const struct object_id *oid)
+{
+	struct bfs_distance_entry *entry = get_or_create_entry(table, oid);
+	return entry ? entry : bfs_table_get(table, oid);
+}
+
+/*
+ * A side still needs to be walked: the start while any target is open,
+ * a target until it is resolved.
+ */
+static int bfs_side_active(const struct bfs_search *search, int side)
+{
+	return side ? !search->done[side - 1] : search->unresolved > 0;
+}
+
+/*
+ * Return 1 if the entry was reached from a side that is still active.
+ */
+static int bfs_entry_active(const struct bfs_search *search, const struct bfs_distance_entry *entry)
+{
+	for (int side = 0; side < search->nr_sides; side++) {
+		if (entry->dist[side] >= 0 && bfs_side_active(search, side)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Record the result for a target and stop searching for it.
+ */
+static void bfs_resolve(struct bfs_search *search, int target, int ahead, int behind)
+{
+	search->result->targets[target].ahead = ahead;
+	search->result->targets[target].behind = behind;
+	search->done[target] = 1;
+	search->unresolved--;
+
+	if (debug_mode) {
+		fprintf(stderr,
+			"[DEBUG] BFS: found intersection for target %d after %d commits, "
+			"ahead=%d, behind=%d\n",
+			target, search->commits_visited, ahead, behind);
+	}
+}
+
+/*
+ * Resolve every open target that this entry connects to the start.
+ */
+static void bfs_check_intersection(struct bfs_search *search,
+				   const struct bfs_distance_entry *entry)
+{
+	if (entry->dist[0] < 0) {
+		return;
+	}
+	for (int t = 0; t < search->nr_targets; t++) {
+		if (!search->done[t] && entry->dist[t + 1] >= 0) {
+			bfs_resolve(search, t, entry->dist[0], entry->dist[t + 1]);
+		}
+	}
+}
+
+/*
+ * Return 1 if some reached commit still has unvisited parents on an active side.
+ */
+static int search_has_frontier(struct bfs_search *search)
+{
+	for (uint32_t i = 0; i < search->distances.nr; i++) {
+		struct bfs_distance_entry *entry = bfs_table_entry(&search->distances, i);
+		for (int side = 0; side < search->nr_sides; side++) {
+			if (entry->dist[side] >= 0 && !(entry->expanded & (1u << side)) &&
+			    bfs_side_active(search, side)) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Resumable search (--resume-search): when a search runs out of budget, its
+ * distance map is saved to <common-dir>/prompt-search-<slot> and the next prompt
+ * with the same start and targets continues from the saved frontier, spending
+ * another max_traversal slice, until every merge-base is found.
+ *
+ * File format (native byte order):
+ *   header: magic, version, hash format, algorithm, flags, rounds, commits
+ *           visited so far, record count, target count, results of targets
+ *           resolved in earlier slices, start and target hashes
+ *   records: raw hash, int32 distance per side, uint32 expanded bits
+ * The frontier is implicit: every reached commit not yet expanded from that side.
+ */
+#define SEARCH_STATE_MAGIC 0x47505353 /* "GPSS" */
+#define SEARCH_STATE_VERSION 2
+#define SEARCH_RESUME_MAX_ROUNDS 20 /* Slices before a search is abandoned for good */
+
+#define SEARCH_STATE_FINAL (1u << 0) /* Abandoned: report too far without walking */
+
+enum search_algorithm {
+	SEARCH_BFS = 1,	       /* interleaved_bfs_walk() */
+	SEARCH_GENERATION = 2, /* generation_walk() */
+};
+
+struct search_state_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t hash_format;
+	uint32_t algorithm;
+	uint32_t flags;
+	uint32_t rounds;	  /* Slices spent so far */
+	uint32_t commits_visited; /* Total across all slices */
+	uint32_t nr;		  /* Number of records that follow */
+	uint32_t nr_targets;
+	int32_t ahead[BFS_MAX_TARGETS]; /* Results found in earlier slices (-1 if not) */
+	int32_t behind[BFS_MAX_TARGETS];
+	unsigned char start[GIT_MAX_RAWSZ];
+	unsigned char targets[BFS_MAX_TARGETS][GIT_MAX_RAWSZ];
+};
+
+/*
+ * Progress of a resumable search across prompts.
+ */
+struct search_progress {
+	uint32_t rounds;
+	uint32_t commits_visited;
+};
+
+static void search_state_path(struct strbuf *path, const char *slot)
+{
+	strbuf_addf(path, "%s/prompt-search-%s", repo_get_common_dir(the_repository), slot);
+}
+
+static void clear_search_state(const char *slot)
+{
+	struct strbuf path = STRBUF_INIT;
+	search_state_path(&path, slot);
+	unlink(path.buf);
+	strbuf_release(&path);
+}
+
+/*
+ * Load a saved search for the same start and targets into an empty search.
+ * Performance: O(saved commits) - single file read
+ *
+ * Returns 0 if a search was restored, 1 if it was abandoned earlier (the caller
+ * should report "too far" right away), -1 if there is nothing to resume.
+ */
+static int load_search_state(const char *slot, struct bfs_search *search,
+			     enum search_algorithm algorithm, struct search_progress *progress)
+{
+	const struct git_hash_algo *algo = the_repository->hash_algo;
+	const size_t record_size = algo->rawsz + (search->nr_sides + 1) * sizeof(uint32_t);
+	struct strbuf path = STRBUF_INIT;
+	struct strbuf buf = STRBUF_INIT;
+	struct search_state_header header;
+	int ret = -1;
+
+	search_state_path(&path, slot);
+	if (strbuf_read_file(&buf, path.buf, 0) < (ssize_t)sizeof(header)) {
+		goto cleanup;
+	}
+
+	memcpy(&header, buf.buf, sizeof(header));
+	if (header.magic != SEARCH_STATE_MAGIC || header.version != SEARCH_STATE_VERSION ||
+	    header.hash_format != algo->format_id || header.algorithm != algorithm ||
+	    header.nr_targets != search->nr_targets ||
+	    memcmp(header.start, search->start->hash, algo->rawsz) ||
+	    buf.len != sizeof(header) + header.nr * record_size) {
+		goto cleanup;
+	}
+	for (int t = 0; t < search->nr_targets; t++) {
+		if (memcmp(header.targets[t], search->targets[t].hash, algo->rawsz)) {
+			goto cleanup;
+		}
+	}
+
+	progress->rounds = header.rounds;
+	progress->commits_visited = header.commits_visited;
+
+	if (header.flags & SEARCH_STATE_FINAL) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	/* Targets resolved by earlier slices keep their answer */
+	for (int t = 0; t < search->nr_targets; t++) {
+		if (!search->done[t] && header.ahead[t] >= 0) {
+			search->result->targets[t].ahead = header.ahead[t];
+			search->result->targets[t].behind = header.behind[t];
+			search->done[t] = 1;
+			search->unresolved--;
+		}
+	}
+
+	const char *p = buf.buf + sizeof(header);
+	for (uint32_t i = 0; i < header.nr; i++, p += record_size) {
+		struct object_id oid;
+		int32_t dist[BFS_MAX_SIDES];
+		uint32_t expanded;
+
+		oidread(&oid, (const unsigned char *)p, algo);
+		memcpy(dist, p + algo->rawsz, search->nr_sides * sizeof(*dist));
+		memcpy(&expanded, p + algo->rawsz + search->nr_sides * sizeof(*dist),
+		       sizeof(expanded));
+
+		struct bfs_distance_entry *entry = get_or_create_entry(&search->distances, &oid);
+		if (entry) {
+			for (int side = 0; side < search->nr_sides; side++) {
+				entry->dist[side] = dist[side];
+			}
+			entry->expanded = expanded;
+		}
+	}
+	ret = 0;
+
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] BFS: resuming %s search (round %u, %u commits so far)\n",
+			slot, header.rounds + 1, header.commits_visited);
+	}
+
+cleanup:
+	strbuf_release(&path);
+	strbuf_release(&buf);
+	return ret;
+}
+
+/*
+ * Save a search atomically (temp file + rename). A final state keeps only the
+ * header, so later prompts report "too far" without walking again.
+ */
+static void save_search_state(const char *slot, struct bfs_search *search,
+			      enum search_algorithm algorithm,
+			      const struct search_progress *progress, int final)
+{
+	const struct git_hash_algo *algo = the_repository->hash_algo;
+	struct search_state_header header;
+	struct strbuf path = STRBUF_INIT;
+	struct strbuf temp_path = STRBUF_INIT;
+	struct strbuf buf = STRBUF_INIT;
+	int fd;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = SEARCH_STATE_MAGIC;
+	header.version = SEARCH_STATE_VERSION;
+	header.hash_format = algo->format_id;
+	header.algorithm = algorithm;
+	header.flags = final ? SEARCH_STATE_FINAL : 0;
+	header.rounds = progress->rounds;
+	header.commits_visited = progress->commits_visited;
+	header.nr_targets = search->nr_targets;
+	memcpy(header.start, search->start->hash, algo->rawsz);
+	for (int t = 0; t < search->nr_targets; t++) {
+		header.ahead[t] = search->result->targets[t].ahead;
+		header.behind[t] = search->result->targets[t].behind;
+		memcpy(header.targets[t], search->targets[t].hash, algo->rawsz);
+	}
+
+	strbuf_add(&buf, &header, sizeof(header));
+	if (!final) {
+		for (uint32_t i = 0; i < search->distances.nr; i++) {
+			struct bfs_distance_entry *entry = bfs_table_entry(&search->distances, i);
+			int32_t dist[BFS_MAX_SIDES];
+			uint32_t expanded = entry->expanded;
+
+			for (int side = 0; side < search->nr_sides; side++) {
+				dist[side] = entry->dist[side];
+			}
+			strbuf_add(&buf, entry->oid.hash, algo->rawsz);
+			strbuf_add(&buf, dist, search->nr_sides * sizeof(*dist));
+			strbuf_add(&buf, &expanded, sizeof(expanded));
+			header.nr++;
+		}
+		memcpy(buf.buf, &header, sizeof(header));
+	}
+
+	search_state_path(&path, slot);
+	strbuf_addf(&temp_path, "%s.tmp.%" PRIuMAX, path.buf, (uintmax_t)getpid());
+
+	fd = open(temp_path.buf, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		goto cleanup;
+	}
+	if (write_in_full(fd, buf.buf, buf.len) < 0) {
+		close(fd);
+		unlink(temp_path.buf);
+		goto cleanup;
+	}
+	close(fd);
+	if (rename(temp_path.buf, path.buf)) {
+		unlink(temp_path.buf);
+	}
+
+cleanup:
+	strbuf_release(&path);
+	strbuf_release(&temp_path);
+	strbuf_release(&buf);
+}
+
+/*
+ * Book-keeping after a resumable search slice left targets open: save the
+ * state for the next prompt, or mark the search abandoned when it cannot make
+ * further progress (frontier exhausted or broken, or round limit reached).
+ */
+static void finish_search_slice(const char *slot, struct bfs_search *search,
+				enum search_algorithm algorithm, struct search_progress *progress,
+				int broken)
+{
+	int final;
+
+	progress->rounds++;
+	progress->commits_visited += search->commits_visited;
+	final = broken || progress->rounds >= SEARCH_RESUME_MAX_ROUNDS ||
+		!search_has_frontier(search);
+
+	save_search_state(slot, search, algorithm, progress, final);
+	search->result->in_progress = !final;
+
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] BFS: %s search %s after %u rounds (%u commits)\n", slot,
+			final ? "abandoned" : "saved", progress->rounds,
+			progress->commits_visited);
+	}
+}
+
+/*
+ * Push a commit onto the generation-ordered frontier, parsing it first so its
+ * generation number and commit date are available to the queue comparator.
+ */
+static void generation_queue_put(struct prio_queue *queue, const struct object_id *oid)
+{
+	struct commit *commit = lookup_commit(the_repository, oid);
+	if (commit && !parse_commit_counted(commit)) {
+		prio_queue_put(queue, commit);
+		stats_queue_size(queue->nr);
+	}
+}
+
+/*
+ * Commit-graph aware divergence search, used when generation numbers are available.
+ *
+ * Strategy:
+ * 1. All sides share one priority queue ordered by generation (highest first)
+ * 2. Each distance entry carries the distance from every side, relaxed on discovery
+ * 3. A commit is popped only after all its children in the walk (they have higher
+ *    generations), so its distances are final shortest-path distances when popped
+ * 4. The first popped commit reached from the start and a target is their merge-base
+ *
+ * Unlike the round-robin BFS, a side that is "lower" in history simply waits
+ * until the other frontiers have come down to its generation, instead of spending
+ * its budget walking ancient history. The budget is therefore pooled.
+ *
+ * Performance: O(commits * log(frontier)) where commits ≤ sides * max_steps
+ *              Parents and generations come from the commit-graph file
+ * Safe for large repo mode: Yes (graph traversal independent of worktree/index size)
+ */
+static void generation_walk(struct bfs_search *search, int resumed, int max_steps)
+{
+	struct prio_queue queue = {compare_commits_by_gen_then_commit_date};
+	const unsigned all_sides = (1u << search->nr_sides) - 1;
+	struct bfs_distance_entry *entry;
+	int steps_remaining = search->nr_sides * max_steps;
+
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] BFS: generation-ordered search...\n");
+	}
+
+	if (resumed) {
+		/* Re-queue every commit with unvisited parents */
+		for (uint32_t i = 0; i < search->distances.nr; i++) {
+			entry = bfs_table_entry(&search->distances, i);
+			if (entry->expanded != all_sides && bfs_entry_active(search, entry)) {
+				generation_queue_put(&queue, &entry->oid);
+			}
+		}
+	} else {
+		for (int side = 0; side < search->nr_sides; side++) {
+			const struct object_id *oid =
+				side ? &search->targets[side - 1] : search->start;
+			int is_new;
+
+			if (!bfs_side_active(search, side)) {
+				continue;
+			}
+			entry = get_or_create_entry(&search->distances, oid);
+			is_new = !!entry;
+			if (!entry) {
+				entry = bfs_table_get(&search->distances, oid);
+			}
+			entry->dist[side] = 0;
+			if (is_new) {
+				generation_queue_put(&queue, oid);
+			}
+		}
+	}
+
+	while (steps_remaining > 0 && search->unresolved) {
+		if (!(search->commits_visited % BFS_DEADLINE_INTERVAL) &&
+		    deadline_expired(DEADLINE_DIVERGENCE)) {
+			search->timed_out = 1;
+			break;
+		}
+
+		struct commit *commit = prio_queue_get(&queue);
+		if (!commit) {
+			break;
+		}
+
+		entry = bfs_table_get(&search->distances, &commit->object.oid);
+		bfs_check_intersection(search, entry);
+		if (!bfs_entry_active(search, entry)) {
+			continue; /* Only reached from resolved targets */
+		}
+
+		steps_remaining--;
+		search->commits_visited++;
+
+		/* Popped commits are final for all sides (see above) */
+		entry->expanded = all_sides;
+
+		for (struct commit_list *parent = commit->parents; parent; parent = parent->next) {
+			const struct object_id *parent_oid = &parent->item->object.oid;
+			struct bfs_distance_entry *parent_entry =
+				get_or_create_entry(&search->distances, parent_oid);
+			int is_new = !!parent_entry;
+
+			if (!parent_entry) {
+				parent_entry = bfs_table_get(&search->distances, parent_oid);
+			}
+
+			/* Relax the distance for every active side that reached this commit */
+			for (int side = 0; side < search->nr_sides; side++) {
+				int dist = entry->dist[side];
+				int parent_dist = parent_entry->dist[side];
+				if (dist >= 0 && bfs_side_active(search, side) &&
+				    (parent_dist < 0 || parent_dist > dist + 1)) {
+					parent_entry->dist[side] = dist + 1;
+				}
+			}
+
+			if (is_new) {
+				generation_queue_put(&queue, parent_oid);
+			}
+		}
+	}
+
+	if (debug_mode && search->unresolved) {
+		fprintf(stderr, "[DEBUG] BFS: exhausted after %d commits (%d queued)\n",
+			search->commits_visited, (int)queue.nr);
+	}
+
+	clear_prio_queue(&queue);
+}
+
+/*
+ * Compare frontier entries by distance, so restored queues keep BFS order.
+ */
+static int compare_bfs_nodes(const void *a, const void *b)
+{
+	const struct bfs_node *na = a, *nb = b;
+	return na->distance - nb->distance;
+}
+
+/*
+ * Rebuild the ring buffers from a restored distance map: each active side's queue
+ * holds the commits reached from that side whose parents were not visited yet.
+ *
+ * Returns 0 on success, -1 if a frontier does not fit into its ring buffer.
+ */
+static int restore_bfs_queues(struct bfs_search *search, struct bfs_state *states)
+{
+	int ret = 0;
+
+	for (int side = 0; side < search->nr_sides; side++) {
+		struct bfs_state *state = &states[side];
+		struct bfs_node *nodes = NULL;
+		size_t nr = 0, alloc = 0;
+
+		if (!bfs_side_active(search, side)) {
+			continue;
+		}
+
+		for (uint32_t i = 0; i < search->distances.nr; i++) {
+			struct bfs_distance_entry *entry = bfs_table_entry(&search->distances, i);
+			if (entry->dist[side] < 0 || (entry->expanded & (1u << side))) {
+				continue;
+			}
+			ALLOC_GROW(nodes, nr + 1, alloc);
+			oidcpy(&nodes[nr].oid, &entry->oid);
+			nodes[nr].distance = entry->dist[side];
+			nr++;
+		}
+
+		if (nr >= BFS_QUEUE_SIZE - 1) {
+			ret = -1;
+		} else {
+			QSORT(nodes, nr, compare_bfs_nodes);
+			COPY_ARRAY(state->queue, nodes, nr);
+			state->head = 0;
+			state->tail = nr;
+			state->size = nr;
+		}
+		free(nodes);
+	}
+	return ret;
+}
+
+/*
+ * Interleaved multi-target BFS, used without commit-graph generations.
+ *
+ * Strategy:
+ * 1. Maintain one queue per side (0=start, 1..n=targets) for perfect interleaving
+ * 2. Track distances from all sides in a single distance table
+ * 3. Alternate: process one from each active queue in round-robin fashion
+ * 4. When a commit reached from the start is also reached from a target, that is
+ *    their merge-base: ahead = distance from start, behind = distance from target
+ * 5. Resolved targets stop walking; the start side walks until all are resolved
+ *
+ * The start/target interleaving is the same as a separate two-sided search per
+ * target, so results match, but the start side is parsed and walked only once.
+ *
+ * Returns 1 if the search broke down (frontier overflow) and cannot be resumed.
+ */
+static int interleaved_bfs_walk(struct bfs_search *search, int resumed, int max_steps)
+{
+	struct bfs_state *states;
+	int broken = 0;
+	int side;
+
+	CALLOC_ARRAY(states, search->nr_sides);
+	for (side = 0; side < search->nr_sides; side++) {
+		states[side].steps_remaining = max_steps;
+	}
+
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] BFS: %d-queue interleaved search...\n", search->nr_sides);
+	}
+
+	if (resumed) {
+		if (restore_bfs_queues(search, states) < 0) {
+			broken = 1;
+			goto cleanup;
+		}
+	} else {
+		/* Enqueue initial nodes */
+		for (side = 0; side < search->nr_sides; side++) {
+			struct bfs_state *state = &states[side];
+			const struct object_id *oid =
+				side ? &search->targets[side - 1] : search->start;
+			struct bfs_distance_entry *entry;
+
+			if (!bfs_side_active(search, side)) {
+				continue;
+			}
+			entry = find_or_create_entry(&search->distances, oid);
+			entry->dist[side] = 0;
+
+			oidcpy(&state->queue[state->tail].oid, oid);
+			state->queue[state->tail].distance = 0;
+			state->tail = (state->tail + 1) & (BFS_QUEUE_SIZE - 1);
+			state->size++;
+		}
+	}
+
+	/* Interleaved BFS - alternate between queues */
+	int made_progress = 1;
+	int rounds = 0;
+	while (made_progress && search->unresolved) {
+		made_progress = 0;
+
+		if (!(rounds++ % BFS_DEADLINE_INTERVAL) && deadline_expired(DEADLINE_DIVERGENCE)) {
+			search->timed_out = 1;
+			break;
+		}
+
+		for (side = 0; side < search->nr_sides && search->unresolved; side++) {
+			struct bfs_state *state = &states[side];
+
+			if (!bfs_side_active(search, side) || state->size <= 0 ||
+			    state->steps_remaining <= 0) {
+				continue;
+			}
+
+			made_progress = 1;
+
+			/* Dequeue from this side */
+			struct bfs_node current = state->queue[state->head];
+			state->head = (state->head + 1) & (BFS_QUEUE_SIZE - 1);
+			state->size--;
+			search->commits_visited++;
+
+			/* Check if we've found an intersection */
+			struct bfs_distance_entry *current_entry =
+				bfs_table_get(&search->distances, &current.oid);
+			bfs_check_intersection(search, current_entry);
+			if (!bfs_side_active(search, side)) {
+				continue;
+			}
+			current_entry->expanded |= 1u << side;
+
+			/* Parse commit and traverse parents */
+			struct commit *commit = lookup_commit(the_repository, &current.oid);
+			if (!commit || parse_commit_counted(commit)) {
+				continue;
+			}
+
+			for (struct commit_list *parent = commit->parents; parent;
+			     parent = parent->next) {
+				struct bfs_distance_entry *parent_entry = find_or_create_entry(
+					&search->distances, &parent->item->object.oid);
+
+				/* Update distance for this side */
+				if (parent_entry->dist[side] >= 0) {
+					continue;
+				}
+				parent_entry->dist[side] = current.distance + 1;
+
+				/* Check if we've found an intersection (fast path) */
+				bfs_check_intersection(search, parent_entry);
+				if (!bfs_side_active(search, side)) {
+					break;
+				}
+
+				/* Enqueue for further exploration if budget allows */
+				if (state->steps_remaining > 0) {
+					if (state->size >= BFS_QUEUE_SIZE - 1) {
+						/* Frontier too wide - give up on this side */
+						broken = 1;
+						if (side) {
+							search->done[side - 1] = 1;
+							search->unresolved--;
+						} else {
+							goto cleanup;
+						}
+						break;
+					}
+					oidcpy(&state->queue[state->tail].oid,
+					       &parent->item->object.oid);
+					state->queue[state->tail].distance = current.distance + 1;
+					state->tail = (state->tail + 1) & (BFS_QUEUE_SIZE - 1);
+					state->size++;
+					state->steps_remaining--;
+					stats_queue_size(state->size);
+				}
+			}
+		}
+	}
+
+cleanup:
+	if (debug_mode && search->unresolved) {
+		fprintf(stderr, "[DEBUG] BFS: exhausted after %d commits (start steps left: %d)\n",
+			search->commits_visited, states[0].steps_remaining);
+	}
+
+	free(states);
+	return broken;
+}
+
+/*
+ * Find divergence between the start (usually HEAD) and up to BFS_MAX_TARGETS
+ * targets (usually origin/master and the upstream) in a single walk that shares
+ * the start side's frontier, commit parsing and visited-commit table.
+ *
+ * Uses generation_walk() when the commit-graph provides generation numbers,
+ * interleaved_bfs_walk() otherwise. With a resume_slot, an exhausted search is
+ * saved and continued by the next call with the same commits.
+ *
+ * Performance: O(commits) where commits ≤ (1 + targets) * max_steps
+ *              Limited by max_traversal parameter (default 1000)
+ *              Early termination when all merge-bases are found
+ * Safe for large repo mode: Yes (graph traversal independent of worktree/index size)
+ *
+ * Returns per target:
+ *   - {ahead, behind} if relationship found within max_steps (both >= 0)
+ *   - {-1, -1} if too far apart (no common ancestor within max_steps)
+ * in_progress is set if the search will continue on the next call.
+ */
+static struct bfs_divergence_result
+bfs_find_divergence(const struct object_id *start,   /* Usually HEAD */
+		    const struct object_id *targets, /* Usually origin/master and upstream */
+		    int nr_targets, int max_steps,
+		    const char *resume_slot) /* Name of the saved search, NULL to not resume */
+{
+	struct bfs_divergence_result result;
+	struct bfs_search search = {start, targets, nr_targets, nr_targets + 1};
+	struct search_progress progress = {0, 0};
+	enum search_algorithm algorithm;
+	int loaded = -1;
+	int broken = 0;
+
+	memset(&result, 0, sizeof(result));
+	search.result = &result;
+	search.unresolved = nr_targets;
+	for (int t = 0; t < BFS_MAX_TARGETS; t++) {
+		result.targets[t].ahead = -1;
+		result.targets[t].behind = -1;
+	}
+
+	/* Quick check: start == target */
+	for (int t = 0; t < nr_targets; t++) {
+		if (oideq(start, &targets[t])) {
+			result.targets[t].ahead = 0;
+			result.targets[t].behind = 0;
+			search.done[t] = 1;
+			search.unresolved--;
+		}
+	}
+	if (!search.unresolved) {
+		return result;
+	}
+
+	/* Prefer the generation-ordered walk when the commit-graph provides generations */
+	algorithm = generation_numbers_enabled(the_repository) ? SEARCH_GENERATION : SEARCH_BFS;
+
+	/* Initialize distance table */
+	bfs_table_init(&search.distances);
+
+	if (resume_slot) {
+		loaded = load_search_state(resume_slot, &search, algorithm, &progress);
+		if (loaded > 0) {
+			goto cleanup; /* Abandoned earlier: too far */
+		}
+	}
+
+	if (search.unresolved) {
+		uint64_t walk_start = getnanotime();
+
+		if (algorithm == SEARCH_GENERATION) {
+			generation_walk(&search, !loaded, max_steps);
+		} else {
+			broken = interleaved_bfs_walk(&search, !loaded, max_steps);
+		}
+		stats_walk_end(algorithm == SEARCH_GENERATION ? "generation" : "bfs", walk_start,
+			       search.commits_visited);
+	}
+
+	if (resume_slot) {
+		if (!search.unresolved && !broken) {
+			clear_search_state(resume_slot);
+			/* Cost of the whole search, so the cache keeps what took many slices */
+			search.commits_visited += progress.commits_visited;
+		} else {
+			finish_search_slice(resume_slot, &search, algorithm, &progress, broken);
+		}
+	}
+
+cleanup:
+	result.commits_visited = search.commits_visited;
+	result.timed_out = search.timed_out;
+
+	/* Release all entries at once */
+	bfs_table_clear(&search.distances);
+
+	return result;
+}
+
+/*
+ * Exact counting (--exact-counts): the searches above report the distance to the
+ * nearest merge-base, which undercounts on merge-heavy histories (commits on
+ * merged side branches are never counted). This walk paints every commit with
+ * the sides it is reachable from, like `git rev-list --left-right --count`, and
+ * counts per target the commits reachable from only one of HEAD and the target.
+ *
+ * Paint state lives in a commit-slab rather than in object flags, so nothing has
+ * to be cleared from the (possibly long-lived) object pool afterwards.
+ */
+#define PAINT_QUEUED (1u << 7) /* Above the side bits: commit is in the queue */
+
+struct paint_info {
+	unsigned char flags;   /* Bit per side the commit is reachable from, plus PAINT_QUEUED */
+	unsigned char counted; /* Side bits already added to the counts */
+};
+
+define_commit_slab(paint_slab, struct paint_info);
+
+/*
+ * Return 1 if side bits make a commit count for exactly one of HEAD and target t.
+ */
+static int paint_one_sided(unsigned flags, int t)
+{
+	return !(flags & 1u) != !(flags & (2u << t));
+}
+
+/*
+ * A commit is pending for target t while its paint can still change the counts
+ * for t: it is one-sided now, or it was counted while one-sided.
+ */
+static int paint_pending(const struct paint_info *info, int t)
+{
+	return paint_one_sided(info->flags, t) || paint_one_sided(info->counted, t);
+}
+
+/*
+ * Add side bits to a commit and queue it if they are new.
+ */
+static void paint_commit(struct prio_queue *queue, struct paint_slab *paint, int *pending,
+			 int nr_targets, struct commit *commit, unsigned flags)
+{
+	struct paint_info *info;
+	unsigned old;
+
+	if (parse_commit_counted(commit)) {
+		return; /* Missing (e.g. shallow): nothing to count beyond it */
+	}
+
+	info = paint_slab_at(paint, commit);
+	old = info->flags;
+	if ((old & flags) == flags) {
+		return;
+	}
+
+	if (old & PAINT_QUEUED) {
+		for (int t = 0; t < nr_targets; t++) {
+			pending[t] -= paint_pending(info, t);
+		}
+	}
+	info->flags |= flags | PAINT_QUEUED;
+	for (int t = 0; t < nr_targets; t++) {
+		pending[t] += paint_pending(info, t);
+	}
+
+	if (!(old & PAINT_QUEUED)) {
+		prio_queue_put(queue, commit);
+		stats_queue_size(queue->nr);
+	}
+}
+
+/*
+ * Count exact ahead/behind between the start and each target.
+ *
+ * Strategy:
+ * 1. Paint the start with bit 0 and target t with bit t+1
+ * 2. Pop commits by generation (commit date without a commit-graph) and pass
+ *    their paint to their parents; the frontier is a growable priority queue
+ * 3. A popped commit painted by HEAD but not target t counts towards ahead,
+ *    painted by t but not HEAD towards behind (re-popped commits are re-counted)
+ * 4. Target t is done once no queued commit is pending for it: everything
+ *    below the queue is then reachable from both or from neither
+ *
+ * With generation numbers parents pop after all their children, so counts are
+ * exact; with commit dates only, clock skew can make them off (as in rev-list).
+ *
+ * Performance: O(commits * log(frontier)) where commits ≤ (1 + targets) * max_steps
+ *              Walks the whole symmetric difference, so it costs more than the
+ *              distance search on long-lived branches
+ * Safe for large repo mode: Yes (graph traversal independent of worktree/index size)
+ *
+ * Returns {ahead, behind} per target, or {-1, -1} if the budget ran out first.
+ */
+static struct bfs_divergence_result count_divergence_exact(const struct object_id *start,
+							   const struct object_id *targets,
+							   int nr_targets, int max_steps)
+{
+	struct bfs_divergence_result result;
+	struct prio_queue queue = {compare_commits_by_gen_then_commit_date};
+	struct paint_slab paint;
+	int pending[BFS_MAX_TARGETS] = {0};
+	int ahead[BFS_MAX_TARGETS] = {0};
+	int behind[BFS_MAX_TARGETS] = {0};
+	int steps_remaining = (nr_targets + 1) * max_steps;
+	uint64_t walk_start = getnanotime();
+	int open;
+
+	memset(&result, 0, sizeof(result));
+	for (int t = 0; t < BFS_MAX_TARGETS; t++) {
+		result.targets[t].ahead = -1;
+		result.targets[t].behind = -1;
+	}
+
+	init_paint_slab(&paint);
+
+	for (int side = 0; side <= nr_targets; side++) {
+		const struct object_id *oid = side ? &targets[side - 1] : start;
+		struct commit *commit = lookup_commit(the_repository, oid);
+		if (commit) {
+			paint_commit(&queue, &paint, pending, nr_targets, commit, 1u << side);
+		}
+	}
+
+	do {
+		struct commit *commit;
+		struct paint_info *info;
+		unsigned flags;
+
+		open = 0;
+		for (int t = 0; t < nr_targets; t++) {
+			open += pending[t] > 0;
+		}
+		if (!open || steps_remaining <= 0) {
+			break;
+		}
+		if (!(result.commits_visited % BFS_DEADLINE_INTERVAL) &&
+		    deadline_expired(DEADLINE_DIVERGENCE)) {
+			result.timed_out = 1;
+			break;
+		}
+		if (!(commit = prio_queue_get(&queue))) {
+			break;
+		}
+		steps_remaining--;
+		result.commits_visited++;
+
+		info = paint_slab_at(&paint, commit);
+		for (int t = 0; t < nr_targets; t++) {
+			pending[t] -= paint_pending(info, t);
+		}
+		info->flags &= ~PAINT_QUEUED;
+		flags = info->flags;
+
+		/* Move this commit's contribution from its counted paint to its current one */
+		for (int t = 0; t < nr_targets; t++) {
+			unsigned side = 2u << t;
+			ahead[t] += (flags & 1u && !(flags & side)) -
+				    (info->counted & 1u && !(info->counted & side));
+			behind[t] += (flags & side && !(flags & 1u)) -
+				     (info->counted & side && !(info->counted & 1u));
+		}
+		info->counted = flags;
+
+		for (struct commit_list *parent = commit->parents; parent; parent = parent->next) {
+			paint_commit(&queue, &paint, pending, nr_targets, parent->item, flags);
+		}
+	} while (1);
+
+	for (int t = 0; t < nr_targets; t++) {
+		if (!pending[t]) {
+			result.targets[t].ahead = ahead[t];
+			result.targets[t].behind = behind[t];
+		}
+	}
+
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] Exact counts: %d commits painted, %d targets open\n",
+			result.commits_visited, open);
+	}
+
+	stats_walk_end("exact", walk_start, result.commits_visited);
+	clear_prio_queue(&queue);
+	clear_paint_slab(&paint);
+	return result;
+}
+
+/*
+ * Section 1: Determine branch name and color based on working tree state.
+ * This is pure filesystem operations - no network refs needed.
+ *
+ * Takes git_state to check for conflicts when determining staged changes.
+ *
+ * Performance: Large repo mode: O(1) - only ref resolution and tag lookup
+ *              Large repo mode with fsmonitor: O(changed) stats plus O(n) in-memory scans
+ *              Small repo mode: O(n + m) - calls has_worktree_changes() and has_staged_changes()
+ *                n = index entries, m = worktree files
+ *              Untracked check stops at the first untracked file (see has_untracked_files())
+ * Safe for large repo mode: Partially (branch name is fast, color determination skipped)
+ *
+ * Returns:
+ *   detached - 1 if in detached HEAD state, 0 if on a branch
+ */
+static int get_branch_name_and_color(struct strbuf *branch, const char **color,
+				     const struct prompt_context *ctx,
+				     const struct git_state *state)
+{
+	const char *branch_name;
+	int detached = 0;
+
+	DEBUG_TIMER_START(branch_name);
+
+	/* Get current branch or detached HEAD */
+	branch_name = ctx->snapshot->head.target;
+	if (branch_name && skip_prefix(branch_name, "refs/heads/", &branch_name)) {
+		strbuf_addstr(branch, branch_name);
+	} else {
+		/* Detached HEAD */
+		detached = 1;
+
+		/*
+		 * Try to get a tag name: the reverse index is cheap in any repository,
+		 * decorations (reftable) are skipped for large repos
+		 */
+		if (tag_index_lookup(&ctx->oid, branch) < 0 && !ctx->large_repo) {
+			struct commit *commit = lookup_commit_reference(the_repository, &ctx->oid);
+			if (commit) {
+				const struct name_decoration *decoration =
+					get_name_decoration(&commit->object);
+				decorations_loaded = 1;
+				/* Iterate through decorations to find a tag */
+				while (decoration) {
+					if (decoration->type == DECORATION_REF_TAG) {
+						const char *tag_name = decoration->name;
+						/* Strip refs/tags/ prefix if present */
+						skip_prefix(tag_name, "refs/tags/", &tag_name);
+						strbuf_addstr(branch, tag_name);
+						break;
+					}
+					decoration = decoration->next;
+				}
+			}
+		}
+
+		/* Fallback to short commit hash */
+		if (!branch->len) {
+			strbuf_add_unique_abbrev(branch, &ctx->oid, 7);
+		}
+	}
+
+	DEBUG_TIMER_END(branch_name, "Branch name");
+
+	/* Determine color based on working tree and staging area state */
+	/* Check conflicts FIRST - they always take priority regardless of repo size */
+	if (state->has_conflicts) {
+		/* Conflicts always show RED - need immediate attention */
+		*color = COLOR_MODIFIED;
+		if (debug_mode) {
+			fprintf(stderr, "[DEBUG] Color: RED (conflicts)\n");
+		}
+	} else if (state->has_state) {
+		/* Git operation in progress (merge/rebase/cherry-pick) - staged changes exist */
+		*color = COLOR_STAGED;
+		if (debug_mode) {
+			fprintf(stderr, "[DEBUG] Color: YELLOW (git operation in progress: %s)\n",
+				state->state_name);
+		}
+	} else if (ctx->large_repo && !ctx->fsmonitor) {
+		/*
+		 * Large repo mode - skip expensive status checks, show GRAY as fallback.
+		 * A valid cache-tree root still tells staged changes apart for free;
+		 * unstaged changes are unknown either way, so a match stays GRAY.
+		 */
+		if (!deadline_expired(DEADLINE_STATUS) &&
+		    has_staged_changes_from_cache_tree(the_repository, ctx->head_tree) > 0) {
+			*color = COLOR_STAGED;
+			if (debug_mode) {
+				fprintf(stderr, "[DEBUG] Color: YELLOW (large repo, cache-tree)\n");
+			}
+		} else {
+			*color = COLOR_LARGE_REPO;
+			if (debug_mode) {
+				fprintf(stderr, "[DEBUG] Color: GRAY (large repo mode)\n");
+			}
+		}
+	} else if (!ctx->index_loaded) {
+		/* Can't read index, treat as clean */
+		*color = COLOR_CLEAN;
+	} else {
+		DEBUG_TIMER_START(status_check);
+		uint64_t status_start = getnanotime();
+
+		/* Check for unstaged changes (working tree differs from index) */
+		int unstaged = has_worktree_changes(the_repository);
+		STATS_TIMER_END(status_check, STATS_REFRESH);
+
+		/* Gitlinks are skipped above; --submodules checks them once the rest is clean */
+		if (!unstaged && check_submodules) {
+			unstaged = has_submodule_changes(the_repository->index);
+		}
+
+		/* Check for staged changes (index differs from HEAD) - RED wins anyway */
+		int staged = 0;
+		if (!unstaged) {
+			uint64_t staged_start = getnanotime();
+
+			staged = deadline_expired(DEADLINE_STATUS)
+					 ? -1
+					 : has_staged_changes(the_repository, ctx->head_tree, state);
+			stats_phase_end(STATS_STAGED, staged_start);
+		}
+
+		DEBUG_TIMER_END(status_check, "Status: change check");
+
+		/* Only a clean worktree was checked completely */
+		if (!unstaged && staged >= 0 && !ctx->fsmonitor) {
+			status_cost_sample(STATUS_COST_REFRESH, status_start);
+		}
+
+		if (debug_mode) {
+			fprintf(stderr, "[DEBUG] has_worktree_changes = %d\n", unstaged);
+			fprintf(stderr, "[DEBUG] has_staged_changes = %d\n", staged);
+		}
+
+		if (unstaged < 0 || staged < 0) {
+			/* Out of time (--deadline-ms) - status unknown, same as large repo mode */
+			*color = COLOR_LARGE_REPO;
+			if (debug_mode) {
+				fprintf(stderr, "[DEBUG] Color: GRAY (deadline)\n");
+			}
+		} else if (unstaged) {
+			/* Unstaged changes take priority - RED (action needed before staging) */
+			*color = COLOR_MODIFIED;
+			if (debug_mode) {
+				fprintf(stderr, "[DEBUG] Color: RED (unstaged changes)\n");
+			}
+		} else if (staged) {
+			/* Staged changes - YELLOW (ready to commit) */
+			*color = COLOR_STAGED;
+			if (debug_mode) {
+				fprintf(stderr, "[DEBUG] Color: YELLOW (staged changes)\n");
+			}
+		} else if (ctx->large_repo && !the_repository->index->untracked) {
+			/*
+			 * Large repo mode avoids full directory walks; without the untracked
+			 * cache untracked files are unknown, so tracked-clean stays GRAY
+			 */
+			*color = COLOR_LARGE_REPO;
+			if (debug_mode) {
+				fprintf(stderr, "[DEBUG] Color: GRAY (untracked check skipped, "
+						"no untracked cache)\n");
+			}
+		} else {
+			/* No tracked changes - check for untracked files */
+			DEBUG_TIMER_START(status_untracked);
+			uint64_t untracked_start = getnanotime();
+
+			int untracked = has_untracked_files(the_repository->index);
+
+			if (!untracked && !ctx->fsmonitor) {
+				status_cost_sample(STATUS_COST_UNTRACKED, untracked_start);
+			}
+
+			if (untracked < 0) {
+				/* Out of time (--deadline-ms) - status unknown */
+				*color = COLOR_LARGE_REPO;
+				if (debug_mode) {
+					fprintf(stderr, "[DEBUG] Color: GRAY (deadline)\n");
+				}
+			} else if (untracked) {
+				/* Untracked files only (cyan - informational) */
+				*color = COLOR_UNTRACKED;
+				if (debug_mode) {
+					fprintf(stderr, "[DEBUG] Color: CYAN (untracked files)\n");
+				}
+			} else {
+				/* Clean working tree (green - ideal) */
+				*color = COLOR_CLEAN;
+				if (debug_mode) {
+					fprintf(stderr, "[DEBUG] Color: GREEN (clean)\n");
+				}
+			}
+
+			DEBUG_TIMER_END(status_untracked, "Status: untracked check");
+			STATS_TIMER_END(status_untracked, STATS_UNTRACKED);
+		}
+	}
+
+	return detached;
+}
+
+/*
+ * Divergence results for one (HEAD, main, upstream) combination.
+ * Values are -1 when unknown (too far diverged or ref missing).
+ */
+struct divergence_data {
+	int cached;  /* 1 if data is from cache or valid, 0 if cache miss */
+	int derived; /* 1 if adjusted from a cached ancestor key (still needs writing) */
+	int main_ahead;
+	int main_behind;
+	int upstream_ahead;
+	int upstream_behind;
+};
+
+/*
+ * Cache key: the commits the divergence was computed from.
+ * Missing refs (e.g., no tracking branch) are flagged and left zeroed.
+ */
+struct divergence_cache_key {
+	struct object_id head;
+	struct object_id main;
+	struct object_id upstream;
+	int has_main;
+	int has_upstream;
+	int exact_counts; /* Counted with --exact-counts rather than distances */
+};
+
+/*
+ * Cache file format (<common-dir>/prompt-cache, native byte order):
+ *   header: magic, version, hash format id, record count
+ *   records: DIVERGENCE_CACHE_ENTRIES fixed-size slots, probed linearly
+ * The common dir is shared by all worktrees, so switching between branches or
+ * worktrees finds earlier results instead of overwriting a single entry.
+ */
+#define DIVERGENCE_CACHE_MAGIC 0x47504443 /* "GPDC" */
+#define DIVERGENCE_CACHE_VERSION 1
+#define DIVERGENCE_CACHE_ENTRIES 64 /* ~7.5KB file, evicted least recently used */
+#define DIVERGENCE_DELTA_LIMIT 32   /* Max new commits per tip walked to reuse an entry */
+
+#define DIVERGENCE_HAS_MAIN (1u << 0)
+#define DIVERGENCE_HAS_UPSTREAM (1u << 1)
+#define DIVERGENCE_EXACT_COUNTS (1u << 2) /* Counts and distances are never mixed */
+
+struct divergence_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t hash_format;
+	uint32_t nr;
+};
+
+struct divergence_cache_record {
+	/* Key: compared byte-wise up to and including flags */
+	unsigned char head[GIT_MAX_RAWSZ];
+	unsigned char main[GIT_MAX_RAWSZ];
+	unsigned char upstream[GIT_MAX_RAWSZ];
+	uint32_t flags;
+	/* Value */
+	int32_t main_ahead;
+	int32_t main_behind;
+	int32_t upstream_ahead;
+	int32_t upstream_behind;
+	uint32_t last_used; /* time() of the last hit or write, for LRU eviction */
+};
+
+#define DIVERGENCE_CACHE_KEY_SIZE                                                                  \
+	(offsetof(struct divergence_cache_record, flags) + sizeof(uint32_t))
+
+/*
+ * Build cache key from OIDs.
+ * NULL OIDs for missing refs.
+ */
+static void build_cache_key(struct divergence_cache_key *key, const struct object_id *head_oid,
+			    const struct object_id *remote_oid,
+			    const struct object_id *tracking_oid, int has_remote, int has_tracking)
+{
+	memset(key, 0, sizeof(*key));
+	oidcpy(&key->head, head_oid);
+	if (has_remote) {
+		oidcpy(&key->main, remote_oid);
+		key->has_main = 1;
+	}
+	if (has_tracking) {
+		oidcpy(&key->upstream, tracking_oid);
+		key->has_upstream = 1;
+	}
+	key->exact_counts = exact_counts;
+}
+
+/*
+ * Fill the key part of a record, so keys can be compared with a single memcmp().
+ */
+static void cache_record_set_key(struct divergence_cache_record *rec,
+				 const struct divergence_cache_key *key)
+{
+	size_t rawsz = the_repository->hash_algo->rawsz;
+
+	memset(rec, 0, sizeof(*rec));
+	memcpy(rec->head, key->head.hash, rawsz);
+	if (key->has_main) {
+		memcpy(rec->main, key->main.hash, rawsz);
+		rec->flags |= DIVERGENCE_HAS_MAIN;
+	}
+	if (key->has_upstream) {
+		memcpy(rec->upstream, key->upstream.hash, rawsz);
+		rec->flags |= DIVERGENCE_HAS_UPSTREAM;
+	}
+	if (key->exact_counts) {
+		rec->flags |= DIVERGENCE_EXACT_COUNTS;
+	}
+}
+
+static void divergence_cache_path(struct strbuf *path)
+{
+	strbuf_addf(path, "%s/prompt-cache", repo_get_common_dir(the_repository));
+}
+
+/*
+ * Map an open cache file read-only and validate its header.
+ * Returns the mapping (records follow the header) and sets *size,
+ * or NULL if the file is empty, truncated, or in a different format.
+ */
+static struct divergence_cache_header *map_divergence_cache(int fd, size_t *size)
+{
+	struct divergence_cache_header *header;
+	struct stat st;
+	void *map;
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*header)) {
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	header = map;
+	if (header->magic != DIVERGENCE_CACHE_MAGIC || header->version != DIVERGENCE_CACHE_VERSION ||
+	    header->hash_format != the_repository->hash_algo->format_id ||
+	    header->nr > DIVERGENCE_CACHE_ENTRIES ||
+	    st.st_size != (off_t)(sizeof(*header) +
+				  header->nr * sizeof(struct divergence_cache_record))) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	*size = st.st_size;
+	return header;
+}
+
+/*
+ * Collect tip and its single-parent ancestors, stopping at merges, roots or
+ * after max entries. chain[0] is the tip itself, chain[k] is k commits below it.
+ *
+ * Returns the number of entries stored.
+ */
+static int collect_linear_chain(const struct object_id *tip, struct object_id *chain, int max)
+{
+	struct commit *commit = lookup_commit(the_repository, tip);
+	int nr = 0;
+
+	oidcpy(&chain[nr++], tip);
+	while (nr < max && commit && !parse_commit_counted(commit) &&
+	       commit->parents && !commit->parents->next) {
+		commit = commit->parents->item;
+		oidcpy(&chain[nr++], &commit->object.oid);
+	}
+	return nr;
+}
+
+/*
+ * Return the position of a raw hash in a chain, or -1 if absent.
+ */
+static int chain_position(const struct object_id *chain, int nr, const unsigned char *hash)
+{
+	for (int i = 0; i < nr; i++) {
+		if (!memcmp(chain[i].hash, hash, the_repository->hash_algo->rawsz)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Return 1 if the first n1 commits of one chain and the first n2 of another
+ * share a commit (e.g. a commit that was pushed, so the same new commits were
+ * added below HEAD and below the remote tip).
+ */
+static int chains_overlap(const struct object_id *c1, int n1, const struct object_id *c2, int n2)
+{
+	for (int i = 0; i < n1; i++) {
+		for (int j = 0; j < n2; j++) {
+			if (oideq(&c1[i], &c2[j])) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Adjust one cached ahead/behind pair after HEAD gained head_delta commits and
+ * the target gained target_delta commits, each along a linear chain.
+ *
+ * New HEAD commits are only guaranteed to be outside the target's history if the
+ * old HEAD was not already contained in it (ahead > 0) or contained the target
+ * (behind == 0); symmetrically for new target commits. Otherwise the cached
+ * relationship says nothing about the new one (e.g. a fast-forward pull).
+ *
+ * Returns 1 and sets the new pair on success, 0 if it cannot be derived.
+ */
+static int adjust_divergence_pair(int ahead, int behind, int head_delta, int target_delta,
+				  int *new_ahead, int *new_behind)
+{
+	if (ahead < 0 || behind < 0) {
+		return 0; /* Unknown before; moving tips may well bring them within reach */
+	}
+	if (head_delta && !(ahead > 0 || behind == 0)) {
+		return 0;
+	}
+	if (target_delta && !(behind > 0 || ahead == 0)) {
+		return 0;
+	}
+
+	*new_ahead = ahead + head_delta;
+	*new_behind = behind + target_delta;
+
+	/* Report what a fresh search with the same budget would report */
+	if (*new_ahead > max_traversal || *new_behind > max_traversal) {
+		*new_ahead = -1;
+		*new_behind = -1;
+	}
+	return 1;
+}
+
+/*
+ * Incremental reuse: derive divergence for a missed key from a cached entry whose
+ * HEAD, main and upstream are each the same as or a short linear ancestor
+ * (within DIVERGENCE_DELTA_LIMIT commits) of the new ones. This covers the common
+ * "commit, commit, commit" and "fetch a handful of new upstream commits" cases.
+ *
+ * Performance: O(DIVERGENCE_DELTA_LIMIT) commit parses per tip, plus
+ *              O(records * DIVERGENCE_DELTA_LIMIT) hash compares
+ * Safe for large repo mode: Yes (graph operations only)
+ *
+ * Returns 1 and fills data (derived=1) on success, 0 otherwise.
+ */
+static int derive_divergence(const struct divergence_cache_key *key,
+			     const struct divergence_cache_record *records, uint32_t nr,
+			     struct divergence_data *data)
+{
+	struct object_id head_chain[DIVERGENCE_DELTA_LIMIT + 1];
+	struct object_id main_chain[DIVERGENCE_DELTA_LIMIT + 1];
+	struct object_id upstream_chain[DIVERGENCE_DELTA_LIMIT + 1];
+	int head_nr, main_nr = 0, upstream_nr = 0;
+	uint32_t flags = (key->has_main ? DIVERGENCE_HAS_MAIN : 0) |
+			 (key->has_upstream ? DIVERGENCE_HAS_UPSTREAM : 0) |
+			 (key->exact_counts ? DIVERGENCE_EXACT_COUNTS : 0);
+	/* When upstream is main, only the main pair is ever computed or shown */
+	int upstream_is_main = key->has_main && key->has_upstream &&
+			       oideq(&key->main, &key->upstream);
+	int best_cost = INT_MAX;
+	struct divergence_data best = *data;
+
+	if (!nr) {
+		return 0;
+	}
+
+	head_nr = collect_linear_chain(&key->head, head_chain, DIVERGENCE_DELTA_LIMIT + 1);
+	if (key->has_main) {
+		main_nr = collect_linear_chain(&key->main, main_chain, DIVERGENCE_DELTA_LIMIT + 1);
+	}
+	if (key->has_upstream && !upstream_is_main) {
+		upstream_nr = collect_linear_chain(&key->upstream, upstream_chain,
+						   DIVERGENCE_DELTA_LIMIT + 1);
+	}
+
+	for (uint32_t i = 0; i < nr; i++) {
+		const struct divergence_cache_record *rec = &records[i];
+		struct divergence_data candidate = *data;
+		int head_delta, main_delta = 0, upstream_delta = 0;
+
+		if (rec->flags != flags) {
+			continue;
+		}
+
+		head_delta = chain_position(head_chain, head_nr, rec->head);
+		if (head_delta < 0) {
+			continue;
+		}
+
+		if (key->has_main) {
+			main_delta = chain_position(main_chain, main_nr, rec->main);
+			if (main_delta < 0 || chains_overlap(head_chain, head_delta, main_chain,
+							     main_delta) ||
+			    !adjust_divergence_pair(rec->main_ahead, rec->main_behind, head_delta,
+						    main_delta, &candidate.main_ahead,
+						    &candidate.main_behind)) {
+				continue;
+			}
+		}
+
+		if (key->has_upstream && !upstream_is_main) {
+			upstream_delta = chain_position(upstream_chain, upstream_nr, rec->upstream);
+			if (upstream_delta < 0 ||
+			    chains_overlap(head_chain, head_delta, upstream_chain, upstream_delta) ||
+			    !adjust_divergence_pair(rec->upstream_ahead, rec->upstream_behind,
+						    head_delta, upstream_delta,
+						    &candidate.upstream_ahead,
+						    &candidate.upstream_behind)) {
+				continue;
+			}
+		}
+
+		if (head_delta + main_delta + upstream_delta < best_cost) {
+			best_cost = head_delta + main_delta + upstream_delta;
+			best = candidate;
+		}
+	}
+
+	if (best_cost == INT_MAX) {
+		return 0;
+	}
+
+	*data = best;
+	data->derived = 1;
+
+	if (debug_mode) {
+		fprintf(stderr,
+			"[DEBUG] Cache: DERIVED from entry %d commits away (main=%d↑%d↓, "
+			"upstream=%d↑%d↓)\n",
+			best_cost, data->main_ahead, data->main_behind, data->upstream_ahead,
+			data->upstream_behind);
+	}
+	return 1;
+}
+
+/*
+ * Try to read cached divergence data from <common-dir>/prompt-cache
+ * Performance: O(1) - one mmap() and a linear probe of at most 64 records
+ * Safe for large repo mode: Yes (simple file I/O)
+ *
+ * On a miss, tries derive_divergence() against the mapped records.
+ *
+ * Returns cache data with cached=0 if cache miss, cached=1 if cache hit
+ *   (derived=1 if the values were adjusted from a cached ancestor key)
+ */
+static struct divergence_data read_divergence_cache(const struct divergence_cache_key *key)
+{
+	struct divergence_data data = {0, 0, -1, -1, -1, -1};
+	struct strbuf cache_path = STRBUF_INIT;
+	struct divergence_cache_header *header = NULL;
+	struct divergence_cache_record probe;
+	size_t size = 0;
+	int fd;
+
+	divergence_cache_path(&cache_path);
+	fd = open(cache_path.buf, O_RDWR);
+	if (fd < 0) {
+		fd = open(cache_path.buf, O_RDONLY); /* read-only repository */
+	}
+	if (fd < 0) {
+		goto cleanup;
+	}
+
+	header = map_divergence_cache(fd, &size);
+	if (!header) {
+		goto cleanup;
+	}
+
+	cache_record_set_key(&probe, key);
+
+	const struct divergence_cache_record *records = (const void *)(header + 1);
+	for (uint32_t i = 0; i < header->nr; i++) {
+		const struct divergence_cache_record *rec = &records[i];
+		if (memcmp(rec, &probe, DIVERGENCE_CACHE_KEY_SIZE)) {
+			continue;
+		}
+
+		/* Cache hit! */
+		data.cached = 1;
+		data.main_ahead = rec->main_ahead;
+		data.main_behind = rec->main_behind;
+		data.upstream_ahead = rec->upstream_ahead;
+		data.upstream_behind = rec->upstream_behind;
+
+		/* Refresh the LRU stamp in place (at most once per second per entry) */
+		uint32_t now = (uint32_t)time(NULL);
+		if (rec->last_used != now) {
+			off_t offset = (const char *)&rec->last_used - (const char *)header;
+			if (pwrite(fd, &now, sizeof(now), offset) < 0 && debug_mode) {
+				fprintf(stderr, "[DEBUG] Cache: could not refresh LRU stamp\n");
+			}
+		}
+
+		if (debug_mode) {
+			fprintf(stderr, "[DEBUG] Cache: HIT (main=%d↑%d↓, upstream=%d↑%d↓)\n",
+				data.main_ahead, data.main_behind, data.upstream_ahead,
+				data.upstream_behind);
+		}
+		break;
+	}
+
+	if (!data.cached) {
+		derive_divergence(key, records, header->nr, &data);
+	}
+
+cleanup:
+	if (!data.cached && !data.derived && debug_mode) {
+		fprintf(stderr, "[DEBUG] Cache: MISS (computing divergence)\n");
+	}
+
+	if (header) {
+		munmap(header, size);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	strbuf_release(&cache_path);
+	return data;
+}
+
+/*
+ * Write divergence data to cache atomically
+ * Only writes if traversal cost >= 10 (i.e., BFS visited >= 10 commits), or if the
+ * data was derived from a cached entry (it stands in for a full traversal)
+ *
+ * The existing records are carried over; an entry with the same key is replaced,
+ * otherwise the new entry takes a free slot or evicts the least recently used one.
+ *
+ * Performance: O(1) - bounded file rewrite (atomic via temp file + rename)
+ * Safe for large repo mode: Yes (simple file I/O)
+ */
+static void write_divergence_cache(const struct divergence_cache_key *key,
+				   const struct divergence_data *data, int total_cost)
+{
+	struct strbuf cache_path = STRBUF_INIT;
+	struct strbuf temp_path = STRBUF_INIT;
+	struct divergence_cache_header header = {DIVERGENCE_CACHE_MAGIC, DIVERGENCE_CACHE_VERSION,
+						 the_repository->hash_algo->format_id, 0};
+	struct divergence_cache_record records[DIVERGENCE_CACHE_ENTRIES];
+	struct divergence_cache_record entry;
+	uint32_t slot;
+	int fd;
+
+	/*
+	 * Only cache if BFS was expensive (visited >= 10 commits total).
+	 * This avoids writing cache for trivial cases while capturing expensive traversals.
+	 */
+	if (total_cost < 10 && !data->derived) {
+		if (debug_mode) {
+			fprintf(stderr,
+				"[DEBUG] Cache: SKIP_WRITE (total_cost=%d commits visited)\n",
+				total_cost);
+		}
+		return;
+	}
+
+	divergence_cache_path(&cache_path);
+
+	/* Load the current records, if any */
+	fd = open(cache_path.buf, O_RDONLY);
+	if (fd >= 0) {
+		size_t size;
+		struct divergence_cache_header *old = map_divergence_cache(fd, &size);
+		if (old) {
+			header.nr = old->nr;
+			COPY_ARRAY(records, (const struct divergence_cache_record *)(old + 1), old->nr);
+			munmap(old, size);
+		}
+		close(fd);
+	}
+
+	cache_record_set_key(&entry, key);
+	entry.main_ahead = data->main_ahead;
+	entry.main_behind = data->main_behind;
+	entry.upstream_ahead = data->upstream_ahead;
+	entry.upstream_behind = data->upstream_behind;
+	entry.last_used = (uint32_t)time(NULL);
+
+	/* Same key, else a free slot, else the least recently used entry */
+	for (slot = 0; slot < header.nr; slot++) {
+		if (!memcmp(&records[slot], &entry, DIVERGENCE_CACHE_KEY_SIZE)) {
+			break;
+		}
+	}
+	if (slot == header.nr) {
+		if (header.nr < DIVERGENCE_CACHE_ENTRIES) {
+			header.nr++;
+		} else {
+			slot = 0;
+			for (uint32_t i = 1; i < header.nr; i++) {
+				if (records[i].last_used < records[slot].last_used) {
+					slot = i;
+				}
+			}
+		}
+	}
+	records[slot] = entry;
+
+	/* Atomic write: temp file (unique per process) + rename */
+	strbuf_addf(&temp_path, "%s.tmp.%" PRIuMAX, cache_path.buf, (uintmax_t)getpid());
+
+	fd = open(temp_path.buf, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		goto cleanup;
+	}
+
+	if (write_in_full(fd, &header, sizeof(header)) < 0 ||
+	    write_in_full(fd, records, header.nr * sizeof(*records)) < 0) {
+		close(fd);
+		unlink(temp_path.buf);
+		goto cleanup;
+	}
+	close(fd);
+
+	/* Atomic rename */
+	if (rename(temp_path.buf, cache_path.buf) == 0) {
+		STATS_ADD(cache_writes, 1);
+		if (debug_mode) {
+			fprintf(stderr,
+				"[DEBUG] Cache: WRITE (total_cost=%d commits visited, %u entries)\n",
+				total_cost, header.nr);
+		}
+	} else {
+		unlink(temp_path.buf);
+	}
+
+cleanup:
+	strbuf_release(&cache_path);
+	strbuf_release(&temp_path);
+}
+
+/*
+ * Section 2: Collect tracking indicators using BFS.
+ * Uses bidirectional BFS to determine ahead/behind/diverged status.
+ *
+ * Two-phase approach:
+ * Phase 1: Check divergence from origin/master (main codebase)
+ * Phase 2: Check divergence from upstream tracking branch (what you pushed)
+ *
+ * Performance: O(commits) where commits ≤ 2 * max_traversal (default 2000)
+ *              Fast path: cache hit is O(1) (file read + parse)
+ *              Slow path: BFS traversal limited by max_traversal
+ * Safe for large repo mode: Yes (graph operations, independent of worktree/index)
+ */
+static void get_tracking_indicators(struct strbuf *indicators, int detached,
+				    const struct prompt_context *ctx)
+{
+	/* Fast exit: detached HEAD has no tracking */
+	if (detached) {
+		return;
+	}
+
+	/*
+	 * Phase 1: Check divergence from default remote's default branch
+	 * Skip if we're on the main branch itself.
+	 */
+	DEBUG_TIMER_START(divergence);
+
+	const struct ref_snapshot *snapshot = ctx->snapshot;
+	const char *main_branch = NULL; /* e.g. "origin/main", for debug output */
+	int main_from_symref = 0; /* 1 if main_branch from origin/HEAD symref, 0 if from fallback */
+	struct object_id main_oid;
+	int has_main_oid = 0;
+
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] Using remote: %s\n", snapshot->remote_name);
+	}
+
+	/* Try to detect remote's default branch via <remote>/HEAD symbolic ref */
+	if (snapshot->remote_head.exists &&
+	    skip_prefix(snapshot->remote_head.target ? snapshot->remote_head.target
+						     : snapshot->remote_head.refname,
+			"refs/remotes/", &main_branch)) {
+		/* Successfully resolved <remote>/HEAD to something like "origin/main" */
+		oidcpy(&main_oid, &snapshot->remote_head.oid);
+		has_main_oid = 1;
+		main_from_symref = 1; /* Came from origin/HEAD symref */
+	} else {
+		/* No <remote>/HEAD configured - try common fallbacks (main, master) */
+		const struct ref_snapshot_entry *fallback = NULL;
+
+		if (debug_mode) {
+			fprintf(stderr, "[DEBUG] No refs/remotes/%s/HEAD - trying fallbacks\n",
+				snapshot->remote_name);
+		}
+
+		if (snapshot->remote_main.exists) {
+			fallback = &snapshot->remote_main;
+		} else if (snapshot->remote_master.exists) {
+			fallback = &snapshot->remote_master;
+		}
+
+		if (fallback) {
+			skip_prefix(fallback->refname, "refs/remotes/", &main_branch);
+			oidcpy(&main_oid, &fallback->oid);
+			has_main_oid = 1;
+			if (debug_mode) {
+				fprintf(stderr, "[DEBUG] Using fallback: %s\n", main_branch);
+			}
+		} else if (debug_mode) {
+			fprintf(stderr, "[DEBUG] No fallback refs found - skipping divergence\n");
+		}
+	}
+
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] main_branch = %s\n", main_branch ? main_branch : "(null)");
+	}
+
+	/*
+	 * Phase 2: Check divergence from upstream tracking branch
+	 * Skip if upstream is the same as main_branch (avoid redundant indicators)
+	 */
+	struct object_id upstream_oid;
+	int has_upstream = 0;
+	int upstream_is_main = 0;
+	const char *upstream = snapshot->upstream.refname;
+
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] upstream = %s\n", upstream ? upstream : "(null)");
+	}
+
+	if (snapshot->upstream.exists) {
+		oidcpy(&upstream_oid, &snapshot->upstream.oid);
+		has_upstream = 1;
+
+		if (has_main_oid && oideq(&upstream_oid, &main_oid)) {
+			upstream_is_main = 1;
+			if (debug_mode) {
+				fprintf(stderr, "[DEBUG] upstream_is_main = 1 (upstream matches "
+						"main_branch)\n");
+			}
+		}
+		if (debug_mode && !upstream_is_main) {
+			fprintf(stderr, "[DEBUG] upstream_is_main = 0\n");
+		}
+	}
+
+	/*
+	 * Build cache key once - used for both read and write
+	 */
+	struct divergence_cache_key cache_key;
+	build_cache_key(&cache_key, &ctx->oid, has_main_oid ? &main_oid : NULL,
+			has_upstream ? &upstream_oid : NULL, has_main_oid, has_upstream);
+
+	/*
+	 * Try cache first - check if we have cached divergence data
+	 */
+	struct divergence_data data = read_divergence_cache(&cache_key);
+	if (data.cached || data.derived) {
+		STATS_ADD(cache_hits, 1);
+	} else {
+		STATS_ADD(cache_misses, 1);
+	}
+
+	/*
+	 * With --resume-search, a cached "too far" may predate the saved search.
+	 * Search again: it either continues or, if abandoned, answers immediately.
+	 */
+	if (resume_search && !exact_counts && data.cached &&
+	    ((has_main_oid && data.main_ahead < 0) ||
+	     (has_upstream && !upstream_is_main && data.upstream_ahead < 0))) {
+		data.cached = 0;
+	}
+
+	if (data.derived) {
+		/* Adjusted from a cached ancestor key - store it under the new key */
+		write_divergence_cache(&cache_key, &data, 0);
+	} else if (!data.cached) {
+		/*
+		 * Cache miss - compute with BFS. Main and upstream are searched together,
+		 * so the walk back from HEAD is shared instead of repeated per target.
+		 */
+		struct object_id targets[BFS_MAX_TARGETS];
+		int main_index = -1, upstream_index = -1;
+		int nr_targets = 0;
+
+		if (debug_mode) {
+			fprintf(stderr, "[DEBUG] BFS: HEAD = %s\n", oid_to_hex(&ctx->oid));
+		}
+		if (has_main_oid) {
+			if (debug_mode) {
+				fprintf(stderr, "[DEBUG] BFS: %s = %s\n", main_branch,
+					oid_to_hex(&main_oid));
+			}
+			main_index = nr_targets;
+			oidcpy(&targets[nr_targets++], &main_oid);
+		}
+		/* Only check upstream divergence if it's different from main */
+		if (has_upstream && !upstream_is_main) {
+			if (debug_mode) {
+				fprintf(stderr, "[DEBUG] BFS: upstream = %s = %s\n", upstream,
+					oid_to_hex(&upstream_oid));
+			}
+			upstream_index = nr_targets;
+			oidcpy(&targets[nr_targets++], &upstream_oid);
+		}
+
+		if (nr_targets) {
+			struct bfs_divergence_result result =
+				exact_counts
+					? count_divergence_exact(&ctx->oid, targets, nr_targets,
+								 max_traversal)
+					: bfs_find_divergence(&ctx->oid, targets, nr_targets,
+							      max_traversal,
+							      resume_search ? "tracking" : NULL);
+			if (main_index >= 0) {
+				data.main_ahead = result.targets[main_index].ahead;
+				data.main_behind = result.targets[main_index].behind;
+			}
+			if (upstream_index >= 0) {
+				data.upstream_ahead = result.targets[upstream_index].ahead;
+				data.upstream_behind = result.targets[upstream_index].behind;
+			}
+			if (debug_mode) {
+				fprintf(stderr,
+					"[DEBUG] divergence: main ahead=%d, behind=%d, upstream "
+					"ahead=%d, behind=%d, cost=%d\n",
+					data.main_ahead, data.main_behind, data.upstream_ahead,
+					data.upstream_behind, result.commits_visited);
+			}
+
+			/*
+			 * Write to cache, unless "too far" is only temporary: the search
+			 * continues, or it was cut short by --deadline-ms
+			 */
+			if (!result.in_progress && !result.timed_out) {
+				write_divergence_cache(&cache_key, &data, result.commits_visited);
+			}
+		}
+	}
+
+	DEBUG_TIMER_END(divergence, "Divergence check");
+	STATS_TIMER_END(divergence, STATS_DIVERGENCE);
+
+	/*
+	 * Display strategy: Show two separate indicators
+	 * 1. Relationship to origin/master (main codebase)
+	 * 2. Relationship to upstream tracking branch
+	 */
+
+	/* Show main divergence when main_branch exists */
+	/* Skip if we already showed it as upstream indicator AND would be duplicate */
+	if (main_branch && (!has_upstream || !upstream_is_main)) {
+		if (data.main_ahead >= 0 && data.main_behind >= 0) {
+			/* Both values known - found merge-base, can show accurate divergence */
+			if (data.main_ahead > 0 && data.main_behind > 0) {
+				/* Diverged: both ahead and behind - never use parentheses */
+				strbuf_color_addf(indicators, COLOR_DIVERGED, "↑%d↓%d",
+						  data.main_ahead, data.main_behind);
+			} else if (data.main_ahead > 0) {
+				/* Ahead of main - never use parentheses */
+				strbuf_color_addf(indicators, COLOR_AHEAD, "↑%d", data.main_ahead);
+			} else if (data.main_behind > 0) {
+				/* Behind main - never use parentheses */
+				strbuf_color_addf(indicators, COLOR_BEHIND, "↓%d", data.main_behind);
+			}
+			/* If both are 0, we're in sync - don't show anything */
+		} else {
+			/* Both searches exhausted - too far apart */
+			strbuf_color_addf(indicators, COLOR_DIVERGED, "↕");
+		}
+	}
+
+	/* Show upstream == main divergence with appropriate formatting */
+	if (has_upstream && upstream_is_main) {
+		/*
+		 * Use parentheses if main came from fallback (not from origin/HEAD symref).
+		 * When origin/HEAD symref exists and points to same as upstream, treat as
+		 * canonical main branch (no parentheses). Otherwise use parentheses to
+		 * indicate upstream tracking relationship.
+		 */
+		int use_parens = !main_from_symref;
+
+		if (data.main_ahead >= 0 && data.main_behind >= 0) {
+			if (data.main_ahead > 0 && data.main_behind > 0) {
+				if (use_parens) {
+					strbuf_color_addf(indicators, COLOR_DIVERGED, "(↑%d↓%d)",
+							  data.main_ahead, data.main_behind);
+				} else {
+					strbuf_color_addf(indicators, COLOR_DIVERGED, "↑%d↓%d",
+							  data.main_ahead, data.main_behind);
+				}
+			} else if (data.main_ahead > 0) {
+				if (use_parens) {
+					strbuf_color_addf(indicators, COLOR_AHEAD, "(↑%d)", data.main_ahead);
+				} else {
+					strbuf_color_addf(indicators, COLOR_AHEAD, "↑%d", data.main_ahead);
+				}
+			} else if (data.main_behind > 0) {
+				if (use_parens) {
+					strbuf_color_addf(indicators, COLOR_BEHIND, "(↓%d)", data.main_behind);
+				} else {
+					strbuf_color_addf(indicators, COLOR_BEHIND, "↓%d", data.main_behind);
+				}
+			}
+		} else {
+			if (use_parens) {
+				strbuf_color_addf(indicators, COLOR_DIVERGED, "(↕)");
+			} else {
+				strbuf_color_addf(indicators, COLOR_DIVERGED, "↕");
+			}
+		}
+	}
+
+	/* Show upstream tracking divergence */
+	/* Skip if upstream == main_branch (we already showed main divergence above) */
+	if (has_upstream && !upstream_is_main) {
+		if (data.upstream_ahead >= 0 && data.upstream_behind >= 0) {
+			/* Both values known - found merge-base, can show accurate divergence */
+			if (data.upstream_ahead > 0 && data.upstream_behind > 0) {
+				/* Diverged from upstream - both ahead and behind */
+				strbuf_color_addf(indicators, COLOR_DIVERGED, "(↑%d↓%d)",
+						  data.upstream_ahead, data.upstream_behind);
+			} else if (data.upstream_ahead > 0) {
+				/* Ahead of upstream - need to push */
+				strbuf_color_addf(indicators, COLOR_AHEAD, "(↑%d)",
+						  data.upstream_ahead);
+			} else if (data.upstream_behind > 0) {
+				/* Behind upstream - need to pull */
+				strbuf_color_addf(indicators, COLOR_BEHIND, "(↓%d)",
+						  data.upstream_behind);
+			}
+			/* If both are 0, we're in sync - don't show anything */
+		} else {
+			/* Both searches exhausted - too far apart */
+			strbuf_color_addf(indicators, COLOR_DIVERGED, "(↕)");
+		}
+	}
+}
+
+/*
+ * Section 3: Collect miscellaneous indicators.
+ * Includes: detached HEAD, git state (merge/rebase/etc), stash.
+ *
+ * Takes git_state computed earlier to avoid redundant checks.
+ *
+ * Performance: O(1) - checks simple flags and ref existence
+ * Safe for large repo mode: Yes (no index or worktree operations)
+ */
+static void get_misc_indicators(struct strbuf *indicators, int detached,
+				const struct prompt_context *ctx, const struct git_state *state)
+{
+	/* Detached HEAD indicator (emoji, color has no effect) */
+	if (detached) {
+		strbuf_addstr(indicators, "⚡");
+	}
+
+	/* Display git state if present (merge, rebase, cherry-pick, etc.) */
+	if (state->has_state) {
+		strbuf_color_addf(indicators, state->state_color, "[%s]", state->state_name);
+	}
+
+	/* Check for stashed changes (emoji, color has no effect) */
+	if (ctx->snapshot->stash.exists) {
+		strbuf_addstr(indicators, "💾");
+	}
+}
+
+/*
+ * Load git config (needed for core.excludesfile and other settings).
+ * With --local only the repository's own config file is read, so the
+ * user's global and system config cannot influence the result (useful for tests).
+ */
+static void load_config(void)
+{
+	DEBUG_TIMER_START(config);
+	if (local_mode) {
+		struct strbuf path = STRBUF_INIT;
+		strbuf_addf(&path, "%s/config", repo_get_common_dir(the_repository));
+		git_config_from_file(git_default_config, path.buf, NULL);
+		strbuf_release(&path);
+	} else {
+		repo_config(the_repository, git_default_config, NULL);
+	}
+	DEBUG_TIMER_END(config, "Config load");
+	STATS_TIMER_END(config, STATS_CONFIG);
+}
+
+/*
+ * The tracking section on its own thread: the divergence walk (object database
+ * and CPU) overlaps with the status section (lstat()s and readdir()s), so a
+ * cache miss costs roughly the slower of the two instead of their sum.
+ *
+ * The sections share only the read-only prompt_context. Refs are read up front
+ * into the snapshot and HEAD's tree is parsed before the thread starts, so the
+ * status side never touches the object table the walk fills; what object
+ * database access it still does is serialized by the object read lock.
+ */
+struct tracking_job {
+	struct strbuf indicators;
+	const struct prompt_context *ctx;
+	int detached;
+};
+
+static void *tracking_thread(void *data)
+{
+	struct tracking_job *job = data;
+
+	get_tracking_indicators(&job->indicators, job->detached, job->ctx);
+	return NULL;
+}
+
+/*
+ * Compute the complete prompt for the current repository and append it to out.
+ * Leaves out untouched if HEAD cannot be resolved (e.g. unborn branch).
+ *
+ * Performance: index load plus the slower of the status and tracking sections
+ * Safe for large repo mode: Yes (each section applies its own large repo policy)
+ */
+static void render_prompt(struct strbuf *out)
+{
+	struct strbuf branch = STRBUF_INIT;
+	struct strbuf indicators = STRBUF_INIT;
+	const char *branch_color = COLOR_CLEAN;
+	int detached = 0;
+	struct prompt_context ctx;
+	struct ref_snapshot snapshot;
+	struct tracking_job tracking = {STRBUF_INIT, &ctx, 0};
+	pthread_t tracking_tid;
+	int tracking_threaded = 0;
+	struct commit *head_commit;
+	struct tree *head_tree;
+
+	/* Read all refs at once; stop if HEAD does not exist */
+	ctx.refs = get_main_ref_store(the_repository);
+	ref_snapshot_load(&snapshot, ctx.refs);
+	if (!snapshot.head.exists) {
+		ref_snapshot_release(&snapshot);
+		return;
+	}
+
+	/* Initialize shared context */
+	oidcpy(&ctx.oid, &snapshot.head.oid);
+	ctx.snapshot = &snapshot;
+	ctx.head_tree = NULL;
+	head_commit = lookup_commit(the_repository, &ctx.oid);
+	if (head_commit && !repo_parse_commit(the_repository, head_commit) &&
+	    (head_tree = repo_get_commit_tree(the_repository, head_commit))) {
+		ctx.head_tree = &head_tree->object.oid;
+	}
+	ctx.large_repo = is_large_repo();
+	prompt_stats.large_repo = ctx.large_repo;
+	ctx.index_loaded = 0;
+	ctx.fsmonitor = 0;
+
+	/*
+	 * Load the index once at the start for all operations.
+	 * This avoids multiple expensive index reads throughout the function.
+	 *
+	 * For large repos: skip index loading for performance. If a git operation
+	 * is in progress (merge/rebase/etc), get_git_state() still detects
+	 * conflicts by scanning the mapped index (see has_unmerged_files_mapped()),
+	 * as conflicts are critical information that must always be accurate.
+	 *
+	 * Large repos with a working fsmonitor load the index too: only the paths
+	 * the monitor reports as changed need checking.
+	 */
+	int index_deadline = deadline_expired(DEADLINE_INDEX);
+	if (index_deadline) {
+		/* Out of time before the index was even read: status unknown (GRAY) */
+		ctx.large_repo = 1;
+	}
+
+	if (!ctx.large_repo) {
+		uint64_t index_start = getnanotime();
+		int index_cached = the_repository->index->initialized; /* Daemon */
+
+		DEBUG_TIMER_START(index);
+		if (repo_read_index(the_repository) >= 0) {
+			ctx.index_loaded = 1;
+			if (!index_cached) {
+				status_cost_sample(STATUS_COST_INDEX, index_start);
+			}
+		}
+		DEBUG_TIMER_END(index, "Index load");
+		STATS_TIMER_END(index, STATS_INDEX);
+	} else if (!index_deadline && load_index_with_fsmonitor(the_repository)) {
+		ctx.index_loaded = 1;
+		ctx.fsmonitor = 1;
+	}
+
+	/*
+	 * Get git state first (merge, rebase, cherry-pick, etc.).
+	 * This is needed by branch color determination to detect conflicts.
+	 * We compute it once and reuse it for both color and display.
+	 */
+	struct git_state state = get_git_state();
+
+	/* Section 2 (detached HEAD has no tracking) runs concurrently with 1 and 3 */
+	tracking.detached =
+		!snapshot.head.target || !starts_with(snapshot.head.target, "refs/heads/");
+	if (HAVE_THREADS && !tracking.detached) {
+		enable_obj_read_lock();
+		tracking_threaded =
+			!pthread_create(&tracking_tid, NULL, tracking_thread, &tracking);
+		if (!tracking_threaded) {
+			disable_obj_read_lock();
+		}
+	}
+
+	/* Section 1: Get branch name and color */
+	detached = get_branch_name_and_color(&branch, &branch_color, &ctx, &state);
+
+	/* Section 3: Get misc indicators (detached, git state, stash) */
+	get_misc_indicators(&indicators, detached, &ctx, &state);
+
+	/* Section 2: Get tracking indicators (upstream, divergence from main) */
+	if (tracking_threaded) {
+		pthread_join(tracking_tid, NULL);
+		disable_obj_read_lock();
+	} else {
+		get_tracking_indicators(&tracking.indicators, detached, &ctx);
+	}
+	strbuf_addbuf(&indicators, &tracking.indicators);
+
+	if (write_index && ctx.index_loaded && !deadline_reached()) {
+		write_index_if_able(the_repository);
+	}
+	if (latency_target_ms > 0) {
+		status_cost_update();
+	}
+
+	/* Assemble the prompt */
+	strbuf_color_addf(out, branch_color, "[%s]", branch.buf);
+
+	if (indicators.len) {
+		strbuf_addf(out, " %s", indicators.buf);
+	}
+	strbuf_addch(out, ' ');
+
+	deadline_report();
+
+	ref_snapshot_release(&snapshot);
+	strbuf_release(&branch);
+	strbuf_release(&indicators);
+	strbuf_release(&tracking.indicators);
+}
+
+/*
+ * Daemon mode: one long-lived process per repository keeps the_repository,
+ * the parsed config, the loaded index and all parsed commits warm, and answers
+ * prompt requests on <gitdir>/prompt-daemon.sock.
+ *
+ * Protocol (one request per connection):
+ *   client: "prompt <color> <large-repo-size> <max-traversal> <local> <resume-search>
+ *            <exact-counts> <deadline-ms> <latency-target> <submodules>\n"
+ *   daemon: the rendered prompt, then closes the connection
+ * An empty reply tells the client to fall back to rendering in-process.
+ */
+static struct strvec daemon_args = STRVEC_INIT; /* Original argv, for re-exec */
+static char *daemon_socket_path;
+static ino_t daemon_socket_ino;
+
+/*
+ * Files whose change invalidates state held by the daemon.
+ * Ref values themselves are never cached (the refs backend re-reads loose refs
+ * and stat-validates packed-refs on every lookup), so refs only matter for the
+ * tag decorations that get_name_decoration() loads once per process.
+ */
+enum daemon_stamp_id {
+	STAMP_INDEX,
+	STAMP_HEAD,
+	STAMP_PACKED_REFS,
+	STAMP_TAGS,
+	STAMP_CONFIG,
+	STAMP_GLOBAL_CONFIG,
+	STAMP_XDG_CONFIG,
+	STAMP_NR
+};
+
+struct daemon_stamp {
+	char *path;	/* NULL if not applicable (e.g. no $HOME) */
+	struct stat st; /* Last observed stat data */
+	int exists;	/* 1 if the file existed at last check */
+};
+
+static struct daemon_stamp daemon_stamps[STAMP_NR];
+
+/*
+ * Re-stat a stamp file and record the new state.
+ * Performance: O(1) - single stat() syscall
+ *
+ * Returns 1 if the file appeared, disappeared or changed since the last call.
+ */
+static int daemon_stamp_changed(struct daemon_stamp *stamp)
+{
+	struct stat st;
+	int exists, changed;
+
+	if (!stamp->path) {
+		return 0;
+	}
+
+	exists = !stat(stamp->path, &st);
+	if (exists != stamp->exists) {
+		changed = 1;
+	} else if (!exists) {
+		changed = 0;
+	} else {
+		changed = st.st_mtime != stamp->st.st_mtime ||
+			  ST_MTIME_NSEC(st) != ST_MTIME_NSEC(stamp->st) ||
+			  st.st_size != stamp->st.st_size || st.st_ino != stamp->st.st_ino;
+	}
+
+	stamp->exists = exists;
+	if (exists) {
+		stamp->st = st;
+	}
+	return changed;
+}
+
+static void daemon_stamps_init(void)
+{
+	const char *gitdir = repo_get_git_dir(the_repository);
+	const char *commondir = repo_get_common_dir(the_repository);
+	const char *home = getenv("HOME");
+
+	daemon_stamps[STAMP_INDEX].path = xstrfmt("%s/index", gitdir);
+	daemon_stamps[STAMP_HEAD].path = xstrfmt("%s/HEAD", gitdir);
+	daemon_stamps[STAMP_PACKED_REFS].path = xstrfmt("%s/packed-refs", commondir);
+	daemon_stamps[STAMP_TAGS].path = xstrfmt("%s/refs/tags", commondir);
+	daemon_stamps[STAMP_CONFIG].path = xstrfmt("%s/config", commondir);
+	if (!local_mode) {
+		if (home) {
+			daemon_stamps[STAMP_GLOBAL_CONFIG].path = xstrfmt("%s/.gitconfig", home);
+		}
+		daemon_stamps[STAMP_XDG_CONFIG].path = xdg_config_home("config");
+	}
+
+	for (int i = 0; i < STAMP_NR; i++) {
+		daemon_stamp_changed(&daemon_stamps[i]);
+	}
+}
+
+static void daemon_cleanup(void)
+{
+	struct stat st;
+
+	/* Only remove the socket if it is still ours (another daemon may have replaced it) */
+	if (daemon_socket_path && !lstat(daemon_socket_path, &st) &&
+	    st.st_ino == daemon_socket_ino) {
+		unlink(daemon_socket_path);
+	}
+	FREE_AND_NULL(daemon_socket_path);
+}
+
+static void daemon_cleanup_on_signal(int signo)
+{
+	daemon_cleanup();
+	sigchain_pop(signo);
+	raise(signo);
+}
+
+/*
+ * Bring the warm state in line with the repository before serving a request.
+ * Performance: O(1) stat() calls, plus O(n) flag reset over the loaded index
+ */
+static void daemon_refresh_state(int listen_fd)
+{
+	int config_changed = 0, refs_changed = 0;
+
+	if (daemon_stamp_changed(&daemon_stamps[STAMP_INDEX])) {
+		/* Index rewritten (add, commit, checkout...) - reload on next use */
+		discard_index(the_repository->index);
+		if (debug_mode) {
+			fprintf(stderr, "[DEBUG] Daemon: index changed, discarded\n");
+		}
+	} else if (the_repository->index->initialized) {
+		/*
+		 * Index unchanged, but the worktree may have been edited since the
+		 * last request. Forget CE_UPTODATE so the worktree check re-stats files,
+		 * and ask the fsmonitor again (its token advanced with the last query).
+		 */
+		for (unsigned int i = 0; i < the_repository->index->cache_nr; i++) {
+			the_repository->index->cache[i]->ce_flags &= ~CE_UPTODATE;
+		}
+		the_repository->index->fsmonitor_has_run_once = 0;
+	}
+
+	for (int i = STAMP_HEAD; i <= STAMP_TAGS; i++) {
+		refs_changed |= daemon_stamp_changed(&daemon_stamps[i]);
+	}
+	for (int i = STAMP_CONFIG; i < STAMP_NR; i++) {
+		config_changed |= daemon_stamp_changed(&daemon_stamps[i]);
+	}
+
+	if (refs_changed && decorations_loaded) {
+		/*
+		 * Tag decorations cannot be unloaded, so start over with a fresh
+		 * process. Clients arriving meanwhile fall back to in-process rendering.
+		 */
+		if (debug_mode) {
+			fprintf(stderr, "[DEBUG] Daemon: refs changed, restarting\n");
+		}
+		close(listen_fd);
+		daemon_cleanup();
+		execvp(daemon_args.v[0], (char *const *)daemon_args.v);
+		die_errno("unable to restart '%s'", daemon_args.v[0]);
+	}
+
+	if (config_changed) {
+		/* Drop parsed config and remote/branch state derived from it */
+		repo_config_clear(the_repository);
+		remote_state_clear(the_repository->remote_state);
+		FREE_AND_NULL(the_repository->remote_state);
+		the_repository->remote_state = remote_state_new();
+		load_config();
+		if (debug_mode) {
+			fprintf(stderr, "[DEBUG] Daemon: config changed, reloaded\n");
+		}
+	}
+}
+
+static void daemon_serve(int listen_fd, int fd)
+{
+	struct timeval timeout = {DAEMON_CLIENT_TIMEOUT_MS / 1000,
+				  (DAEMON_CLIENT_TIMEOUT_MS % 1000) * 1000};
+	struct strbuf out = STRBUF_INIT;
+	char request[128];
+	size_t len = 0;
+	long req_large_repo_size;
+	int req_color, req_max_traversal, req_local, req_resume_search, req_exact_counts;
+	int req_deadline_ms;
+	int req_latency_target_ms;
+	int req_submodules;
+
+	/* Never let a stuck client block the daemon */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	while (len < sizeof(request) - 1) {
+		ssize_t n = xread(fd, request + len, sizeof(request) - 1 - len);
+		if (n <= 0) {
+			return;
+		}
+		len += n;
+		if (memchr(request, '\n', len)) {
+			break;
+		}
+	}
+	request[len] = '\0';
+
+	if (sscanf(request, "prompt %d %ld %d %d %d %d %d %d %d", &req_color,
+		   &req_large_repo_size, &req_max_traversal, &req_local, &req_resume_search,
+		   &req_exact_counts, &req_deadline_ms, &req_latency_target_ms,
+		   &req_submodules) != 9) {
+		return;
+	}
+
+	/* Config was loaded with our own --local setting; let the client handle a mismatch */
+	if (!!req_local != !!local_mode) {
+		return;
+	}
+
+	use_color = req_color;
+	large_repo_size = req_large_repo_size;
+	max_traversal = req_max_traversal;
+	resume_search = req_resume_search;
+	exact_counts = req_exact_counts;
+	deadline_ms = req_deadline_ms;
+	latency_target_ms = req_latency_target_ms;
+	check_submodules = req_submodules;
+	deadline_start();
+
+	DEBUG_TIMER_START(daemon_request);
+	daemon_refresh_state(listen_fd);
+	render_prompt(&out);
+	DEBUG_TIMER_END(daemon_request, "Daemon: request");
+
+	write_in_full(fd, out.buf, out.len);
+	strbuf_release(&out);
+}
+
+/*
+ * Serve prompt requests until no client connected for DAEMON_IDLE_TIMEOUT_MS.
+ * Returns 0 on idle exit, -1 if the socket could not be created.
+ */
+static int run_daemon(void)
+{
+	struct unix_stream_listen_opts opts = UNIX_STREAM_LISTEN_OPTS_INIT;
+	struct stat st;
+	int listen_fd;
+
+	daemon_socket_path = xstrfmt("%s/%s", repo_get_git_dir(the_repository), DAEMON_SOCKET_NAME);
+	listen_fd = unix_stream_listen(daemon_socket_path, &opts);
+	if (listen_fd < 0) {
+		error_errno("unable to listen on '%s'", daemon_socket_path);
+		FREE_AND_NULL(daemon_socket_path);
+		return -1;
+	}
+	if (!lstat(daemon_socket_path, &st)) {
+		daemon_socket_ino = st.st_ino;
+	}
+
+	atexit(daemon_cleanup);
+	sigchain_push_common(daemon_cleanup_on_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	daemon_stamps_init();
+
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] Daemon: listening on %s\n", daemon_socket_path);
+	}
+
+	for (;;) {
+		struct pollfd pfd = {.fd = listen_fd, .events = POLLIN};
+		int ret = poll(&pfd, 1, DAEMON_IDLE_TIMEOUT_MS);
+
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (!ret) {
+			if (debug_mode) {
+				fprintf(stderr, "[DEBUG] Daemon: idle, exiting\n");
+			}
+			break;
+		}
+
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		daemon_serve(listen_fd, fd);
+		close(fd);
+	}
+
+	close(listen_fd);
+	daemon_cleanup();
+	return 0;
+}
+
+/*
+ * Locate the daemon socket without setting up the repository.
+ * Mirrors the common cases of git's discovery: $GIT_DIR, a .git directory
+ * or a .git file (worktrees, submodules) in the current or a parent directory.
+ *
+ * Performance: O(depth) - one lstat() per parent directory
+ *
+ * Returns 0 and fills sock on success, -1 if no git dir was found.
+ */
+static int locate_daemon_socket(struct strbuf *sock)
+{
+	const char *env = getenv(GIT_DIR_ENVIRONMENT);
+	struct strbuf dir = STRBUF_INIT;
+	int ret = -1;
+
+	if (env) {
+		strbuf_addf(sock, "%s/%s", env, DAEMON_SOCKET_NAME);
+		return 0;
+	}
+
+	if (strbuf_getcwd(&dir) < 0) {
+		return -1;
+	}
+
+	for (;;) {
+		struct stat st;
+		size_t len = dir.len;
+
+		strbuf_addstr(&dir, "/.git");
+		if (!lstat(dir.buf, &st)) {
+			if (S_ISDIR(st.st_mode)) {
+				strbuf_addf(sock, "%s/%s", dir.buf, DAEMON_SOCKET_NAME);
+				ret = 0;
+			} else if (S_ISREG(st.st_mode)) {
+				const char *gitdir = read_gitfile_gently(dir.buf, NULL);
+				if (gitdir) {
+					strbuf_addf(sock, "%s/%s", gitdir, DAEMON_SOCKET_NAME);
+					ret = 0;
+				}
+			}
+			break;
+		}
+		strbuf_setlen(&dir, len);
+
+		/* Move to the parent directory, stop after the root */
+		char *slash = strrchr(dir.buf, '/');
+		if (!slash || !len) {
+			break;
+		}
+		strbuf_setlen(&dir, slash - dir.buf);
+	}
+
+	strbuf_release(&dir);
+	return ret;
+}
+
+/*
+ * Options that change the rendered prompt, as one line (the daemon request).
+ */
+static void add_prompt_options(struct strbuf *sb)
+{
+	strbuf_addf(sb, "prompt %d %ld %d %d %d %d %d %d %d\n", use_color, large_repo_size,
+		    max_traversal, local_mode, resume_search, exact_counts, deadline_ms,
+		    latency_target_ms, check_submodules);
+}
+
+/*
+ * Thin client: ask a running daemon for the prompt and print it.
+ * Performance: O(1) - one connect() and a single round trip
+ *
+ * The daemon serves one client at a time, so while it renders a cold prompt for
+ * another shell the reply may take long: after DAEMON_REPLY_WAIT_MS (or half of
+ * --deadline-ms) the prompt is rendered in-process instead.
+ *
+ * Returns 1 if the prompt was printed, 0 to fall back to in-process rendering.
+ */
+static int prompt_from_daemon(void)
+{
+	int wait_ms = deadline_ms > 0 ? (deadline_ms + 1) / 2 : DAEMON_REPLY_WAIT_MS;
+	struct timeval timeout = {wait_ms / 1000, (wait_ms % 1000) * 1000};
+	struct strbuf sock = STRBUF_INIT;
+	struct strbuf request = STRBUF_INIT;
+	struct strbuf reply = STRBUF_INIT;
+	int fd, printed = 0;
+
+	if (locate_daemon_socket(&sock) < 0) {
+		goto cleanup;
+	}
+
+	fd = unix_stream_connect(sock.buf, 0);
+	if (fd < 0) {
+		goto cleanup;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	add_prompt_options(&request);
+	if (write_in_full(fd, request.buf, request.len) >= 0 && strbuf_read(&reply, fd, 256) > 0) {
+		fwrite(reply.buf, 1, reply.len, stdout);
+		printed = 1;
+	}
+	close(fd);
+
+cleanup:
+	strbuf_release(&sock);
+	strbuf_release(&request);
+	strbuf_release(&reply);
+	return printed;
+}
+
+/*
+ * Stale-while-revalidate (--stale-while-revalidate): print the prompt stored by
+ * the previous call right away, then recompute it in a detached background
+ * process for the next call.
+ *
+ * The last prompt is stored per worktree in <gitdir>/prompt-last as the options
+ * line (see add_prompt_options()) followed by the rendered prompt, so a call
+ * with other options never shows it. A refresh holds prompt-last.lock while it
+ * renders and renames it into place when done; while the lock exists no other
+ * refresh is started, so quickly repeated prompts never pile up workers. Until
+ * the prompt is written, the lock holds the worker's pid, so a refresh is never
+ * mistaken for a killed one however long it renders.
+ */
+#define PROMPT_REFRESH_STALE_SEC 60 /* Lock without a pid: older ones were left behind */
+
+static struct lock_file last_prompt_lock = LOCK_INIT;
+
+static void last_prompt_path(struct strbuf *path)
+{
+	strbuf_addf(path, "%s/prompt-last", repo_get_git_dir(the_repository));
+}
+
+/*
+ * Take the lock of path for a background worker and record its pid in it, so
+ * background_lock_held() can tell a slow worker from a killed one.
+ *
+ * Returns 0 on success, -1 if the lock is taken.
+ */
+static int hold_background_lock(struct lock_file *lock, const char *path)
+{
+	struct strbuf owner = STRBUF_INIT;
+
+	if (hold_lock_file_for_update(lock, path, 0) < 0) {
+		return -1;
+	}
+	strbuf_addf(&owner, "%d\n", (int)getpid());
+	write_in_full(get_lock_file_fd(lock), owner.buf, owner.len);
+	strbuf_release(&owner);
+	return 0;
+}
+
+/*
+ * Return 1 if a background worker holds the lock of path: path.lock exists and
+ * its pid is alive or, while no pid is recorded (just created, or already
+ * rewritten with the result), it is younger than PROMPT_REFRESH_STALE_SEC.
+ * A stale lock is removed.
+ */
+static int background_lock_held(const char *path)
+{
+	struct strbuf lock_path = STRBUF_INIT;
+	struct strbuf owner = STRBUF_INIT;
+	struct stat st;
+	int running = 0;
+
+	strbuf_addf(&lock_path, "%s%s", path, LOCK_SUFFIX);
+	if (!stat(lock_path.buf, &st)) {
+		char *end;
+		long pid;
+
+		strbuf_read_file(&owner, lock_path.buf, 0);
+		pid = strtol(owner.buf, &end, 10);
+		if (pid > 0 && *end == '\n') {
+			running = !kill((pid_t)pid, 0) || errno != ESRCH;
+		} else {
+			running = time(NULL) - st.st_mtime < PROMPT_REFRESH_STALE_SEC;
+		}
+		if (!running) {
+			unlink(lock_path.buf);
+		}
+	}
+	strbuf_release(&lock_path);
+	strbuf_release(&owner);
+	return running;
+}
+
+/* Return 1 if a refresh is running (see background_lock_held()) */
+static int last_prompt_refresh_running(void)
+{
+	struct strbuf path = STRBUF_INIT;
+	int running;
+
+	last_prompt_path(&path);
+	running = background_lock_held(path.buf);
+	strbuf_release(&path);
+	return running;
+}
+
+/*
+ * Print the stored prompt if it was rendered with the current options.
+ * Performance: O(1) - one small file read
+ * Safe for large repo mode: Yes (no index or worktree operations)
+ *
+ * Returns 1 if a prompt was printed, 0 otherwise.
+ */
+static int print_last_prompt(void)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct strbuf options = STRBUF_INIT;
+	struct strbuf buf = STRBUF_INIT;
+	int printed = 0;
+
+	last_prompt_path(&path);
+	add_prompt_options(&options);
+	if (strbuf_read_file(&buf, path.buf, 0) >= 0 && starts_with(buf.buf, options.buf)) {
+		fwrite(buf.buf + options.len, 1, buf.len - options.len, stdout);
+		printed = 1;
+	}
+
+	strbuf_release(&path);
+	strbuf_release(&options);
+	strbuf_release(&buf);
+	return printed;
+}
+
+/*
+ * Detach a forked background process from the caller: a new session, and stdio
+ * on /dev/null so the shell (or git, for hooks) does not wait for it by reading
+ * the inherited stdout to EOF.
+ */
+static void detach_from_caller(void)
+{
+	int null_fd;
+
+	setsid();
+	null_fd = open("/dev/null", O_RDWR);
+	if (null_fd >= 0) {
+		dup2(null_fd, 0);
+		dup2(null_fd, 1);
+		dup2(null_fd, 2);
+		if (null_fd > 2) {
+			close(null_fd);
+		}
+	}
+}
+
+/*
+ * Fork the background refresh once the stale prompt is printed.
+ *
+ * Returns 1 in the detached child, which holds the refresh lock and should go on
+ * to render and store the prompt; 0 in the parent (or if no refresh is needed
+ * because one is already running), which is done.
+ */
+static int start_prompt_refresh(void)
+{
+	struct strbuf path = STRBUF_INIT;
+	pid_t pid;
+
+	if (last_prompt_refresh_running()) {
+		return 0;
+	}
+
+	fflush(stdout);
+	pid = fork();
+	if (pid) {
+		return 0; /* Parent, or fork failed: the stale prompt is all we show */
+	}
+
+	detach_from_caller();
+
+	last_prompt_path(&path);
+	if (hold_background_lock(&last_prompt_lock, path.buf) < 0) {
+		exit(0); /* Another refresh won the race */
+	}
+	strbuf_release(&path);
+	return 1;
+}
+
+/*
+ * Store a freshly rendered prompt for the next stale-while-revalidate call.
+ * Skipped if another process holds the lock (its result is just as fresh).
+ */
+static void store_last_prompt(const struct strbuf *prompt)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct strbuf options = STRBUF_INIT;
+	int fd;
+
+	last_prompt_path(&path);
+	if (!is_lock_file_locked(&last_prompt_lock) &&
+	    hold_lock_file_for_update(&last_prompt_lock, path.buf, 0) < 0) {
+		goto cleanup;
+	}
+
+	add_prompt_options(&options);
+	fd = get_lock_file_fd(&last_prompt_lock);
+	/* A refresh replaces its pid (see hold_background_lock()) with the prompt */
+	if (lseek(fd, 0, SEEK_SET) < 0 || ftruncate(fd, 0) < 0 ||
+	    write_in_full(fd, options.buf, options.len) < 0 ||
+	    write_in_full(fd, prompt->buf, prompt->len) < 0) {
+		rollback_lock_file(&last_prompt_lock);
+	} else {
+		commit_lock_file(&last_prompt_lock);
+	}
+
+cleanup:
+	strbuf_release(&path);
+	strbuf_release(&options);
+}
+
+/*
+ * Whole-prompt cache (--prompt-cache=<seconds>): reuse the rendered prompt while
+ * nothing it depends on has changed, without loading config or the index.
+ *
+ * Stored per worktree in <gitdir>/prompt-result as the options line (see
+ * add_prompt_options()), a line with the creation time and HEAD's OID, one
+ * "<stat signature> <path>" line per dependency, an empty line and the prompt.
+ * Dependencies are the index, HEAD, the operation state files, the worktree
+ * root, config, packed-refs/reftable and the loose refs of the branch, its
+ * upstream, the remote's main branch and the stash. Editing a file in a
+ * subdirectory changes none of them, so an entry also expires after the given
+ * number of seconds.
+ */
+static struct lock_file prompt_cache_lock = LOCK_INIT;
+
+static void prompt_cache_path(struct strbuf *path)
+{
+	strbuf_addf(path, "%s/prompt-result", repo_get_git_dir(the_repository));
+}
+
+/*
+ * Collect the files whose stat data validates a cached prompt.
+ * Needs config loaded (branch and remote lookup), so it runs after rendering.
+ */
+static void collect_prompt_deps(struct string_list *deps)
+{
+	const char *gitdir = repo_get_git_dir(the_repository);
+	const char *commondir = repo_get_common_dir(the_repository);
+	const char *state_files[] = {"rebase-merge",	 "rebase-apply", "MERGE_HEAD",
+				     "CHERRY_PICK_HEAD", "REVERT_HEAD",	 NULL};
+	const char *main_names[] = {"HEAD", "main", "master", NULL};
+	struct branch *branch = branch_get(NULL);
+	const char *remote = NULL;
+
+	string_list_append_nodup(deps, xstrfmt("%s/index", gitdir));
+	string_list_append_nodup(deps, xstrfmt("%s/HEAD", gitdir));
+	for (int i = 0; state_files[i]; i++) {
+		string_list_append_nodup(deps, xstrfmt("%s/%s", gitdir, state_files[i]));
+	}
+	string_list_append(deps, ".");
+	string_list_append_nodup(deps, xstrfmt("%s/config", commondir));
+	string_list_append_nodup(deps, xstrfmt("%s/packed-refs", commondir));
+	string_list_append_nodup(deps, xstrfmt("%s/reftable/tables.list", commondir));
+	string_list_append_nodup(deps, xstrfmt("%s/refs/tags", commondir));
+	string_list_append_nodup(deps, xstrfmt("%s/refs/stash", commondir));
+
+	if (branch) {
+		const char *upstream = branch_get_upstream(branch, NULL);
+
+		string_list_append_nodup(deps, xstrfmt("%s/%s", commondir, branch->refname));
+		if (upstream) {
+			string_list_append_nodup(deps, xstrfmt("%s/%s", commondir, upstream));
+		}
+		remote = remote_for_branch(branch, NULL);
+	}
+	if (!remote) {
+		remote = "origin";
+	}
+	for (int i = 0; main_names[i]; i++) {
+		string_list_append_nodup(
+			deps, xstrfmt("%s/refs/remotes/%s/%s", commondir, remote, main_names[i]));
+	}
+}
+
+/*
+ * Print the cached prompt if it is younger than the TTL, was rendered with the
+ * current options and HEAD and every dependency are unchanged.
+ * Performance: O(d) - one small file read, one ref lookup and d stat() calls
+ * Safe for large repo mode: Yes (no index or worktree operations)
+ *
+ * Returns 1 if a prompt was printed, 0 otherwise.
+ */
+static int print_cached_prompt(void)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct strbuf buf = STRBUF_INIT;
+	struct strbuf options = STRBUF_INIT;
+	struct object_id head_oid, cached_oid;
+	const char *p, *eol, *reason = NULL;
+	char *end;
+	time_t created;
+	int changed;
+
+	prompt_cache_path(&path);
+	if (strbuf_read_file(&buf, path.buf, 0) < 0) {
+		reason = "no cache";
+		goto cleanup;
+	}
+
+	add_prompt_options(&options);
+	if (!starts_with(buf.buf, options.buf)) {
+		reason = "other options";
+		goto cleanup;
+	}
+	p = buf.buf + options.len;
+
+	created = strtoumax(p, &end, 10);
+	if (*end != ' ' || get_oid_hex(end + 1, &cached_oid) ||
+	    !(eol = strchr(end + 1, '\n'))) {
+		reason = "corrupt";
+		goto cleanup;
+	}
+	if (time(NULL) - created >= prompt_cache_ttl) {
+		reason = "expired";
+		goto cleanup;
+	}
+	if (!refs_resolve_ref_unsafe(get_main_ref_store(the_repository), "HEAD",
+				     RESOLVE_REF_READING, &head_oid, NULL) ||
+	    !oideq(&head_oid, &cached_oid)) {
+		reason = "HEAD moved";
+		goto cleanup;
+	}
+
+	/* The dependencies end with an empty line, followed by the prompt */
+	changed = check_dependency_lines(eol + 1, buf.buf + buf.len, "", &p, "Prompt cache");
+	if (changed > 0) {
+		reason = "dependency changed";
+		goto cleanup;
+	}
+	if (changed < 0 || *p != '\n') {
+		reason = "corrupt";
+		goto cleanup;
+	}
+
+	fwrite(p + 1, 1, buf.buf + buf.len - (p + 1), stdout);
+
+cleanup:
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] Prompt cache: %s\n", reason ? reason : "hit");
+	}
+	strbuf_release(&path);
+	strbuf_release(&buf);
+	strbuf_release(&options);
+	return !reason;
+}
+
+/*
+ * Store a freshly rendered prompt with the current HEAD and dependency stats.
+ * Skipped if another process holds the lock (its result is just as fresh).
+ */
+static void store_cached_prompt(const struct strbuf *prompt)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct strbuf buf = STRBUF_INIT;
+	struct string_list deps = STRING_LIST_INIT_DUP;
+	struct string_list_item *item;
+	struct object_id head_oid;
+	int fd;
+
+	if (!refs_resolve_ref_unsafe(get_main_ref_store(the_repository), "HEAD",
+				     RESOLVE_REF_READING, &head_oid, NULL)) {
+		goto cleanup; /* Unborn branch */
+	}
+
+	prompt_cache_path(&path);
+	fd = hold_lock_file_for_update(&prompt_cache_lock, path.buf, 0);
+	if (fd < 0) {
+		goto cleanup;
+	}
+
+	add_prompt_options(&buf);
+	strbuf_addf(&buf, "%" PRIuMAX " %s\n", (uintmax_t)time(NULL), oid_to_hex(&head_oid));
+	collect_prompt_deps(&deps);
+	for_each_string_list_item(item, &deps) {
+		add_dependency_line(&buf, "", item->string);
+	}
+	strbuf_addch(&buf, '\n');
+	strbuf_addbuf(&buf, prompt);
+
+	if (write_in_full(fd, buf.buf, buf.len) < 0) {
+		rollback_lock_file(&prompt_cache_lock);
+	} else {
+		commit_lock_file(&prompt_cache_lock);
+	}
+
+cleanup:
+	strbuf_release(&path);
+	strbuf_release(&buf);
+	string_list_clear(&deps, 0);
+}
+
+/*
+ * Single-flight results (--single-flight): when many shells redraw at once
+ * (every tmux pane after a fetch), only the first process renders the prompt
+ * and the others wait for it and print its result.
+ *
+ * <gitdir>/prompt-flight is one shared, mapped struct prompt_flight (per
+ * worktree, as the prompt includes the worktree status; the divergence in
+ * <common-dir>/prompt-cache is shared by all worktrees). The owner word claims
+ * the computation: a compare-and-swap from 0 (or a dead or stale owner) to
+ * "pid << 32 | claim time in ms". Only the owner publishes, under a seqlock:
+ * seq is odd while the result is written, so readers copy it without any lock
+ * and retry if seq changed meanwhile.
+ *
+ * A result is keyed by the options line, HEAD and the stat signatures of the
+ * prompt's dependencies (see collect_prompt_deps()), and reused for
+ * FLIGHT_REUSE_MS: a redraw storm, not a cache across edits.
+ */
+#define FLIGHT_MAGIC 0x47504646 /* "GPFF" */
+#define FLIGHT_KEY_MAX 2048
+#define FLIGHT_PROMPT_MAX 1024
+#define FLIGHT_REUSE_MS 1000	 /* Age up to which a published result is reused */
+#define FLIGHT_WAIT_MS 1000	 /* Longest wait for the owner, at most half of --deadline-ms */
+#define FLIGHT_CLAIM_MAX_MS 10000 /* Claims older than this are taken over */
+#define FLIGHT_POLL_MS 5
+
+struct prompt_flight {
+	uint32_t magic;
+	uint32_t seq;	      /* Seqlock, odd while the result below is written */
+	uint64_t owner;	      /* pid << 32 | claim time (ms, truncated), 0 if unclaimed */
+	uint64_t published_ms; /* Result */
+	uint32_t key_len;
+	uint32_t prompt_len;
+	char key[FLIGHT_KEY_MAX];
+	char prompt[FLIGHT_PROMPT_MAX];
+};
+
+static struct prompt_flight *prompt_flight;
+static uint64_t flight_claim; /* Our owner word while we hold the claim */
+
+static uint64_t flight_now_ms(void)
+{
+	return getnanotime() / 1000000;
+}
+
+/*
+ * Map <gitdir>/prompt-flight, creating it (all zero is the empty state).
+ * Returns NULL if the file cannot be used; the prompt is then rendered alone.
+ */
+static struct prompt_flight *prompt_flight_open(void)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct prompt_flight *flight = NULL;
+	struct stat st;
+	uint32_t magic = 0;
+	void *map;
+	int fd;
+
+	strbuf_addf(&path, "%s/prompt-flight", repo_get_git_dir(the_repository));
+	fd = open(path.buf, O_RDWR | O_CREAT, 0666);
+	if (fd < 0) {
+		goto cleanup;
+	}
+	if (fstat(fd, &st) || (st.st_size < sizeof(*flight) && ftruncate(fd, sizeof(*flight)))) {
+		close(fd);
+		goto cleanup;
+	}
+	map = mmap(NULL, sizeof(*flight), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		goto cleanup;
+	}
+
+	flight = map;
+	if (!__atomic_compare_exchange_n(&flight->magic, &magic, FLIGHT_MAGIC, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+	    magic != FLIGHT_MAGIC) {
+		munmap(map, sizeof(*flight));
+		flight = NULL;
+	}
+
+cleanup:
+	strbuf_release(&path);
+	return flight;
+}
+
+/*
+ * Build the key of the current state. Needs config (see collect_prompt_deps()).
+ * Returns -1 if HEAD is unborn or the key does not fit.
+ */
+static int prompt_flight_key(struct strbuf *key)
+{
+	struct string_list deps = STRING_LIST_INIT_DUP;
+	struct string_list_item *item;
+	struct object_id head_oid;
+
+	if (!refs_resolve_ref_unsafe(get_main_ref_store(the_repository), "HEAD",
+				     RESOLVE_REF_READING, &head_oid, NULL)) {
+		return -1;
+	}
+
+	add_prompt_options(key);
+	strbuf_addstr(key, oid_to_hex(&head_oid));
+	collect_prompt_deps(&deps);
+	for_each_string_list_item(item, &deps) {
+		strbuf_addch(key, ' ');
+		add_stat_signature(key, item->string);
+	}
+	string_list_clear(&deps, 0);
+	return key->len <= FLIGHT_KEY_MAX ? 0 : -1;
+}
+
+/*
+ * Copy the published result into prompt if it matches key and is fresh.
+ * Lock-free: retries while the owner is writing.
+ * Returns 1 on a match, 0 otherwise.
+ */
+static int prompt_flight_read(struct prompt_flight *flight, const struct strbuf *key,
+			      struct strbuf *prompt)
+{
+	for (int tries = 0; tries < 100; tries++) {
+		uint32_t seq = __atomic_load_n(&flight->seq, __ATOMIC_ACQUIRE);
+		uint64_t published_ms;
+		int match;
+
+		if (seq & 1) {
+			sleep_millisec(1);
+			continue;
+		}
+		published_ms = flight->published_ms;
+		match = flight->key_len == key->len && flight->prompt_len <= FLIGHT_PROMPT_MAX &&
+			!memcmp(flight->key, key->buf, key->len);
+		if (match) {
+			strbuf_reset(prompt);
+			strbuf_add(prompt, flight->prompt, flight->prompt_len);
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&flight->seq, __ATOMIC_RELAXED) != seq) {
+			continue; /* Torn copy */
+		}
+		return match && flight_now_ms() - published_ms < FLIGHT_REUSE_MS;
+	}
+	return 0;
+}
+
+/*
+ * Check whether the owner word belongs to a live process with a recent claim.
+ */
+static int flight_owner_active(uint64_t owner)
+{
+	pid_t pid = owner >> 32;
+	uint32_t age_ms = (uint32_t)flight_now_ms() - (uint32_t)owner;
+
+	if (!owner || age_ms > FLIGHT_CLAIM_MAX_MS) {
+		return 0;
+	}
+	return !kill(pid, 0) || errno != ESRCH;
+}
+
+/*
+ * Join the flight for key: reuse a published result, wait for the current
+ * owner, or claim the computation.
+ * Performance: O(1) without contention; waiters poll every FLIGHT_POLL_MS
+ * Safe for large repo mode: Yes (no index or worktree operations)
+ *
+ * Returns 1 if prompt was filled from another process, 0 if we claimed the
+ * computation (publish with prompt_flight_publish()) and -1 if we render
+ * without publishing (the owner took too long).
+ */
+static int prompt_flight_join(struct prompt_flight *flight, const struct strbuf *key,
+			      struct strbuf *prompt)
+{
+	uint64_t wait_ms = FLIGHT_WAIT_MS, start = flight_now_ms();
+	const char *outcome;
+	int ret;
+
+	if (deadline_ms > 0 && deadline_ms / 2 < wait_ms) {
+		wait_ms = deadline_ms / 2;
+	}
 
-			fill_directory(&dir, the_repository->index, &pathspec);
+	for (;;) {
+		uint64_t owner = __atomic_load_n(&flight->owner, __ATOMIC_ACQUIRE);
+		uint64_t now = flight_now_ms();
 
-			if (debug_mode && dir.nr > 0) {
-				fprintf(stderr, "[DEBUG] Found %d untracked entries, first: %s\n",
-					dir.nr, dir.entries[0]->name);
+		if (prompt_flight_read(flight, key, prompt)) {
+			outcome = now == start ? "published result" : "waited for owner";
+			ret = 1;
+			break;
+		}
+		if (!flight_owner_active(owner)) {
+			uint64_t claim = ((uint64_t)getpid() << 32) | (uint32_t)now;
+
+			if (__atomic_compare_exchange_n(&flight->owner, &owner, claim, 0,
+							__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				flight_claim = claim;
+				outcome = "claimed";
+				ret = 0;
+				break;
 			}
+			continue; /* Another process claimed it first */
+		}
+		if (now - start >= wait_ms) {
+			outcome = "owner too slow";
+			ret = -1;
+			break;
+		}
+		sleep_millisec(FLIGHT_POLL_MS);
+	}
 
-			if (dir.nr > 0) {
-				/* Untracked files only (cyan - informational) */
-				*color = COLOR_UNTRACKED;
-				if (debug_mode) {
-					fprintf(stderr, "[DEBUG] Color: CYAN (untracked files)\n");
-				}
-			} else {
-				/* Clean working tree (green - ideal) */
-				*color = COLOR_CLEAN;
-				if (debug_mode) {
-					fprintf(stderr, "[DEBUG] Color: GREEN (clean)\n");
-				}
-			}
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] Single flight: %s after %" PRIuMAX "ms\n", outcome,
+			(uintmax_t)(flight_now_ms() - start));
+	}
+	return ret;
+}
 
-			dir_clear(&dir);
-			DEBUG_TIMER_END(status_untracked, "Status: untracked check");
-		}
+/*
+ * Publish prompt for key (unless it is partial or too long) and release the
+ * claim, waking the waiters.
+ */
+static void prompt_flight_publish(struct prompt_flight *flight, const struct strbuf *key,
+				  const struct strbuf *prompt, int complete)
+{
+	uint64_t claim = flight_claim;
+
+	/* A stale claim may have been taken over; the new owner publishes */
+	if (__atomic_load_n(&flight->owner, __ATOMIC_ACQUIRE) != claim) {
+		return;
 	}
 
-	return detached;
+	if (complete && prompt->len <= FLIGHT_PROMPT_MAX) {
+		/* Only the owner writes, so an odd seq is left over from a crashed owner */
+		uint32_t seq = __atomic_load_n(&flight->seq, __ATOMIC_RELAXED) | 1;
+
+		__atomic_store_n(&flight->seq, seq, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memcpy(flight->key, key->buf, key->len);
+		memcpy(flight->prompt, prompt->buf, prompt->len);
+		flight->key_len = key->len;
+		flight->prompt_len = prompt->len;
+		flight->published_ms = flight_now_ms();
+		__atomic_store_n(&flight->seq, seq + 1, __ATOMIC_RELEASE);
+	}
+
+	__atomic_compare_exchange_n(&flight->owner, &claim, 0, 0, __ATOMIC_ACQ_REL,
+				    __ATOMIC_RELAXED);
+	flight_claim = 0;
 }
 
 /*
- * Cache format: <head_oid>,<remote_oid>,<tracking_oid>=<main_ahead>,<main_behind>,<upstream_ahead>,<upstream_behind>
- * Empty string represents missing ref (e.g., no tracking branch)
+ * Config snapshot (--config-snapshot): instead of parsing every config file
+ * (system, global, includes, repository) on each prompt, keep the keys the
+ * prompt may use in <gitdir>/prompt-config and load only that file while the
+ * files it came from are unchanged.
+ *
+ * The snapshot is itself a config file with a comment header: the branch HEAD
+ * was on (includeIf.onbranch depends on it) and whether it was taken with
+ * --local, then one "source" line with the stat signature (see
+ * add_stat_signature()) of every file any key came from, so edits to included
+ * files are noticed too, plus the usual global config paths even if they do not
+ * exist yet. With --local the repository's config is the only source, as for
+ * load_config(). It is installed as the repository's config set, so
+ * git_default_config() and later lookups (remotes, repo settings) only ever see
+ * the kept keys.
+ */
+#define CONFIG_SNAPSHOT_HEADER "# git-prompt config snapshot v3\n"
+
+/*
+ * Sections left out of the snapshot: ones no prompt code path reads, and include
+ * directives, whose files are already expanded into the snapshot. Everything
+ * else is kept, since status checks reach config through git itself (e.g.
+ * filter.<driver>.clean when a touched file is hashed). Of the branch.* keys
+ * only the current branch's are kept.
  */
-struct divergence_data {
-	int cached; /* 1 if data is from cache or valid, 0 if cache miss */
-	int main_ahead;
-	int main_behind;
-	int upstream_ahead;
-	int upstream_behind;
-};
+static const char *const config_snapshot_skipped[] = {
+	"include.", "includeif.", "advice.", "alias.", "color.", "credential.", "difftool.",
+	"format.", "gc.", "gpg.", "gui.", "help.", "http.", "log.", "maintenance.",
+	"mergetool.", "pager.", "pull.", "push.", "rebase.", "sendemail.", "user.", NULL};
+
+static struct config_set config_snapshot_set;
+
+static void config_snapshot_path(struct strbuf *path)
+{
+	strbuf_addf(path, "%s/prompt-config", repo_get_git_dir(the_repository));
+}
 
 /*
- * Build cache key string from OIDs.
- * Format: <head_oid>,<remote_oid>,<tracking_oid>
- * Empty strings for missing refs.
+ * Config that does not come from files (git -c, GIT_CONFIG_*) or from other
+ * files than usual cannot be captured by mtimes: always parse it in full.
  */
-static void build_cache_key(struct strbuf *key, const struct object_id *head_oid,
-			    const struct object_id *remote_oid,
-			    const struct object_id *tracking_oid, int has_remote, int has_tracking)
+static int config_from_environment(void)
 {
-	strbuf_addstr(key, oid_to_hex(head_oid));
-	strbuf_addch(key, ',');
-	if (has_remote) {
-		strbuf_addstr(key, oid_to_hex(remote_oid));
-	}
-	strbuf_addch(key, ',');
-	if (has_tracking) {
-		strbuf_addstr(key, oid_to_hex(tracking_oid));
-	}
+	return getenv("GIT_CONFIG_PARAMETERS") || getenv("GIT_CONFIG_COUNT") ||
+	       getenv("GIT_CONFIG_GLOBAL") || getenv("GIT_CONFIG_SYSTEM") ||
+	       getenv("GIT_CONFIG_NOSYSTEM") || getenv("GIT_CONFIG");
+}
+
+/* Append the branch HEAD is on ("-" when detached) and the --local flag */
+static void add_config_snapshot_head(struct strbuf *sb)
+{
+	const char *head = refs_resolve_ref_unsafe(get_main_ref_store(the_repository), "HEAD", 0,
+						   NULL, NULL);
+
+	strbuf_addf(sb, "# head %s\n", head && starts_with(head, "refs/heads/") ? head : "-");
+	strbuf_addf(sb, "# local %d\n", local_mode);
 }
 
 /*
- * Try to read cached divergence data from .git/prompt-cache
- * Performance: O(1) - single file read and parse
- * Safe for large repo mode: Yes (simple file I/O)
+ * Load the snapshot if it is still valid.
+ * Performance: O(s) - one small file read and parse, one stat() per source file
+ * Safe for large repo mode: Yes (no index or worktree operations)
  *
- * Returns cache data with cached=0 if cache miss, cached=1 if cache hit
+ * Returns 1 if config was loaded from the snapshot, 0 if it must be parsed in full.
  */
-static struct divergence_data read_divergence_cache(const struct strbuf *cache_key)
+static int load_config_snapshot(void)
 {
-	struct divergence_data data = {0, -1, -1, -1, -1};
-	struct strbuf cache_path = STRBUF_INIT;
-	struct strbuf line = STRBUF_INIT;
-	FILE *fp;
-	int ma, mb, ua, ub;
-
-	strbuf_addf(&cache_path, "%s/prompt-cache", repo_get_git_dir(the_repository));
-	fp = fopen(cache_path.buf, "r");
-	if (!fp) {
+	struct strbuf path = STRBUF_INIT;
+	struct strbuf buf = STRBUF_INIT;
+	struct strbuf expect = STRBUF_INIT;
+	const char *body, *reason = NULL;
+	int changed;
+
+	config_snapshot_path(&path);
+	if (strbuf_read_file(&buf, path.buf, 0) < 0) {
+		reason = "no snapshot";
 		goto cleanup;
 	}
 
-	/* Read the single line */
-	if (strbuf_getline(&line, fp) == EOF) {
+	strbuf_addstr(&expect, CONFIG_SNAPSHOT_HEADER);
+	add_config_snapshot_head(&expect);
+	if (!starts_with(buf.buf, expect.buf)) {
+		reason = "other format, branch or --local";
 		goto cleanup;
 	}
 
-	/* Check if cache key matches (substring match before '=') */
-	if (!starts_with(line.buf, cache_key->buf) || line.buf[cache_key->len] != '=') {
+	changed = check_dependency_lines(buf.buf + expect.len, buf.buf + buf.len, "# source ",
+					 &body, "Config snapshot");
+	if (changed) {
+		reason = changed > 0 ? "source changed" : "corrupt";
 		goto cleanup;
 	}
 
-	/* Parse values after '=' */
-	if (sscanf(line.buf + cache_key->len + 1, "%d,%d,%d,%d", &ma, &mb, &ua, &ub) != 4) {
+	DEBUG_TIMER_START(config);
+	git_configset_init(&config_snapshot_set);
+	if (git_configset_add_file(&config_snapshot_set, path.buf) < 0) {
+		git_configset_clear(&config_snapshot_set);
+		reason = "unreadable";
 		goto cleanup;
 	}
+	the_repository->config = &config_snapshot_set;
+	repo_config(the_repository, git_default_config, NULL);
+	DEBUG_TIMER_END(config, "Config load (snapshot)");
+	STATS_TIMER_END(config, STATS_CONFIG);
 
-	/* Cache hit! */
-	data.cached = 1;
-	data.main_ahead = ma;
-	data.main_behind = mb;
-	data.upstream_ahead = ua;
-	data.upstream_behind = ub;
-
+cleanup:
 	if (debug_mode) {
-		fprintf(stderr, "[DEBUG] Cache: HIT (main=%d↑%d↓, upstream=%d↑%d↓)\n", ma, mb, ua,
-			ub);
+		fprintf(stderr, "[DEBUG] Config snapshot: %s\n", reason ? reason : "hit");
 	}
+	strbuf_release(&path);
+	strbuf_release(&buf);
+	strbuf_release(&expect);
+	return !reason;
+}
 
-cleanup:
-	if (!data.cached && debug_mode) {
-		fprintf(stderr, "[DEBUG] Cache: MISS (computing divergence)\n");
-	}
+struct config_snapshot_data {
+	struct strbuf *out;
+	struct string_list *sources;
+	struct strbuf section;	    /* Header of the last section written */
+	const char *branch_section; /* "branch.<current>." or NULL when detached */
+};
 
-	if (fp) {
-		fclose(fp);
+static void add_quoted_config_string(struct strbuf *sb, const char *s, size_t len)
+{
+	strbuf_addch(sb, '"');
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] == '\n') {
+			strbuf_addstr(sb, "\\n");
+		} else if (s[i] == '\t') {
+			strbuf_addstr(sb, "\\t");
+		} else {
+			if (s[i] == '"' || s[i] == '\\') {
+				strbuf_addch(sb, '\\');
+			}
+			strbuf_addch(sb, s[i]);
+		}
 	}
-	strbuf_release(&cache_path);
-	strbuf_release(&line);
-	return data;
+	strbuf_addch(sb, '"');
 }
 
 /*
- * Write divergence data to cache atomically
- * Only writes if traversal cost >= 10 (i.e., BFS visited >= 10 commits)
- *
- * Performance: O(1) - single file write (atomic via temp file + rename)
- * Safe for large repo mode: Yes (simple file I/O)
+ * Config callback: note the source file of every key and write kept keys back
+ * out in config syntax ("section.sub.name" as [section "sub"] name = "value").
  */
-static void write_divergence_cache(const struct strbuf *cache_key,
-				   const struct divergence_data *data, int total_cost)
+static int collect_config_snapshot(const char *var, const char *value,
+				   const struct config_context *ctx, void *cb)
 {
-	struct strbuf cache_path = STRBUF_INIT;
-	struct strbuf temp_path = STRBUF_INIT;
-	FILE *fp;
+	struct config_snapshot_data *data = cb;
+	const char *dot = strchr(var, '.'), *last = strrchr(var, '.');
+	struct strbuf header = STRBUF_INIT;
+	int keep = 1;
 
-	/*
-	 * Only cache if BFS was expensive (visited >= 10 commits total).
-	 * This avoids writing cache for trivial cases while capturing expensive traversals.
-	 */
-	if (total_cost < 10) {
-		if (debug_mode) {
-			fprintf(stderr,
-				"[DEBUG] Cache: SKIP_WRITE (total_cost=%d commits visited)\n",
-				total_cost);
-		}
-		return;
+	if (ctx->kvi && ctx->kvi->filename) {
+		string_list_insert(data->sources, ctx->kvi->filename);
 	}
 
-	/* Atomic write: temp file + rename */
-	strbuf_addf(&cache_path, "%s/prompt-cache", repo_get_git_dir(the_repository));
-	strbuf_addf(&temp_path, "%s.tmp", cache_path.buf);
+	for (int i = 0; config_snapshot_skipped[i]; i++) {
+		keep &= !starts_with(var, config_snapshot_skipped[i]);
+	}
+	if (starts_with(var, "branch.")) {
+		keep = data->branch_section && starts_with(var, data->branch_section);
+	}
+	if (!keep || !dot) {
+		return 0;
+	}
 
-	fp = fopen(temp_path.buf, "w");
-	if (!fp) {
-		goto cleanup;
+	strbuf_addch(&header, '[');
+	strbuf_add(&header, var, dot - var);
+	if (last > dot) {
+		strbuf_addch(&header, ' ');
+		add_quoted_config_string(&header, dot + 1, last - dot - 1);
+	}
+	strbuf_addstr(&header, "]\n");
+	if (strcmp(header.buf, data->section.buf)) {
+		strbuf_addbuf(data->out, &header);
+		strbuf_swap(&header, &data->section);
 	}
+	strbuf_release(&header);
 
-	/* Format: <cache_key>=<ma>,<mb>,<ua>,<ub> */
-	fprintf(fp, "%s=%d,%d,%d,%d\n", cache_key->buf, data->main_ahead, data->main_behind,
-		data->upstream_ahead, data->upstream_behind);
+	strbuf_addf(data->out, "\t%s", last + 1);
+	if (value) {
+		strbuf_addstr(data->out, " = ");
+		add_quoted_config_string(data->out, value, strlen(value));
+	}
+	strbuf_addch(data->out, '\n');
+	return 0;
+}
 
-	fclose(fp);
+/*
+ * Write a snapshot of the config loaded by load_config() (with --local, of the
+ * repository's config only).
+ * Skipped if another process holds the lock (its snapshot is just as fresh).
+ */
+static void store_config_snapshot(void)
+{
+	struct strbuf path = STRBUF_INIT;
+	struct strbuf buf = STRBUF_INIT;
+	struct strbuf body = STRBUF_INIT;
+	struct string_list sources = STRING_LIST_INIT_DUP;
+	struct config_snapshot_data data = {&body, &sources, STRBUF_INIT, NULL};
+	struct lock_file lock = LOCK_INIT;
+	struct string_list_item *item;
+	const char *home = getenv("HOME");
+	char *branch_section = NULL, *candidates[3];
+	const char *head;
+	int fd;
+
+	head = refs_resolve_ref_unsafe(get_main_ref_store(the_repository), "HEAD", 0, NULL, NULL);
+	if (head && skip_prefix(head, "refs/heads/", &head)) {
+		data.branch_section = branch_section = xstrfmt("branch.%s.", head);
+	}
 
-	/* Atomic rename */
-	if (rename(temp_path.buf, cache_path.buf) == 0) {
-		if (debug_mode) {
-			fprintf(stderr, "[DEBUG] Cache: WRITE (total_cost=%d commits visited)\n",
-				total_cost);
+	/* Files that may appear later count too; a missing file has the signature "-" */
+	candidates[0] = xstrfmt("%s/config", repo_get_common_dir(the_repository));
+	candidates[1] = home && !local_mode ? xstrfmt("%s/.gitconfig", home) : NULL;
+	candidates[2] = local_mode ? NULL : xdg_config_home("config");
+	if (local_mode) {
+		git_config_from_file(collect_config_snapshot, candidates[0], &data);
+	} else {
+		repo_config(the_repository, collect_config_snapshot, &data);
+	}
+	for (int i = 0; i < ARRAY_SIZE(candidates); i++) {
+		if (candidates[i]) {
+			string_list_insert(&sources, candidates[i]);
+			free(candidates[i]);
 		}
 	}
 
+	config_snapshot_path(&path);
+	fd = hold_lock_file_for_update(&lock, path.buf, 0);
+	if (fd < 0) {
+		goto cleanup;
+	}
+
+	strbuf_addstr(&buf, CONFIG_SNAPSHOT_HEADER);
+	add_config_snapshot_head(&buf);
+	for_each_string_list_item(item, &sources) {
+		add_dependency_line(&buf, "# source ", item->string);
+	}
+	strbuf_addbuf(&buf, &body);
+
+	if (write_in_full(fd, buf.buf, buf.len) < 0) {
+		rollback_lock_file(&lock);
+	} else {
+		commit_lock_file(&lock);
+	}
+
 cleanup:
-	strbuf_release(&cache_path);
-	strbuf_release(&temp_path);
+	strbuf_release(&path);
+	strbuf_release(&buf);
+	strbuf_release(&body);
+	strbuf_release(&data.section);
+	string_list_clear(&sources, 0);
+	free(branch_section);
 }
 
 /*
- * Section 2: Collect tracking indicators using BFS.
- * Uses bidirectional BFS to determine ahead/behind/diverged status.
- *
- * Two-phase approach:
- * Phase 1: Check divergence from origin/master (main codebase)
- * Phase 2: Check divergence from upstream tracking branch (what you pushed)
- *
- * Performance: O(commits) where commits ≤ 2 * max_traversal (default 2000)
- *              Fast path: cache hit is O(1) (file read + parse)
- *              Slow path: BFS traversal limited by max_traversal
- * Safe for large repo mode: Yes (graph operations, independent of worktree/index)
+ * Load config and repository settings the way every prompt needs them.
+ * Performance: O(config) - the full parse, or just the snapshot with --config-snapshot
  */
-static void get_tracking_indicators(struct strbuf *indicators, int detached,
-				    const struct strbuf *branch, const struct prompt_context *ctx)
+static void prepare_prompt_state(void)
 {
-	/* Fast exit: detached HEAD has no tracking */
-	if (detached) {
-		return;
+	/* With --config-snapshot, parse all config files only when one changed */
+	if (config_snapshot && !daemon_mode && !config_from_environment()) {
+		if (!load_config_snapshot()) {
+			load_config();
+			store_config_snapshot();
+		}
+	} else {
+		load_config();
 	}
 
-	/*
-	 * Phase 1: Check divergence from default remote's default branch
-	 * Skip if we're on the main branch itself.
-	 */
-	DEBUG_TIMER_START(divergence);
+	/* Read sparse indexes as they are: sparse directories are never expanded */
+	prepare_repo_settings(the_repository);
+	the_repository->settings.command_requires_full_index = 0;
 
-	const char *main_branch = NULL;
-	char *main_branch_allocated = NULL; /* Track if main_branch was allocated */
-	int main_from_symref = 0; /* 1 if main_branch from origin/HEAD symref, 0 if from fallback */
+	/* Commit messages are never needed; parse only headers */
+	save_commit_buffer = 0;
+}
 
-	/* Determine the default remote name (e.g., "origin", "upstream", etc.) */
-	const char *remote_name = NULL;
-	struct branch *current_branch = branch_get(NULL);
-	if (current_branch) {
-		/* Get the remote for this branch (handles branch.<name>.remote config) */
-		remote_name = remote_for_branch(current_branch, NULL);
-	}
+/*
+ * Multi-repository scan (--scan=<dir>, --repos-from=<file>) for status bars and
+ * dashboards: one line per repository, "<path>\t<prompt>" or a JSON object
+ * with --json, printed in completion order as each repository finishes.
+ *
+ * libgit keeps one repository per process (the_repository, the object and ref
+ * caches), so repositories are rendered by a pool of forked workers rather
+ * than threads. Each worker renders one repository with the usual sections
+ * and exits; a free slot immediately takes the next repository from the
+ * queue, so slow repositories never hold up the rest of the list. A worker
+ * gets --scan-budget-ms as its --deadline-ms (unless one was given) and is
+ * killed if it is still running SCAN_KILL_GRACE_MS later, e.g. blocked on NFS.
+ */
+#define SCAN_MAX_DEPTH 6	     /* Directory levels below --scan searched for repositories */
+#define SCAN_MAX_JOBS 32	     /* Workers running at once */
+#define SCAN_BUDGET_MS_DEFAULT 1000  /* Per-repository time budget */
+#define SCAN_KILL_GRACE_MS 500	     /* Past the budget before a worker is killed */
+#define SCAN_EXIT_NOT_REPO 2	     /* Worker exit code for paths outside any repository */
+
+static const char *scan_dir;	   /* --scan */
+static const char *repos_from;	   /* --repos-from, "-" for stdin */
+static int scan_json = 0;	   /* --json */
+static int scan_budget_ms = SCAN_BUDGET_MS_DEFAULT;
+
+struct scan_worker {
+	const char *path;
+	pid_t pid;
+	int fd;		  /* Read end of the worker's output pipe */
+	uint64_t start;	  /* getnanotime() at fork */
+	struct strbuf out;
+};
 
-	/* Fallback to "origin" if no remote is configured */
-	if (!remote_name) {
-		remote_name = "origin";
+/*
+ * Add every worktree (a directory containing .git) below path, without
+ * descending into repositories found or into hidden directories.
+ */
+static void find_repositories(struct strbuf *path, int depth, struct string_list *repos)
+{
+	size_t len = path->len;
+	struct dirent *de;
+	DIR *dir;
+
+	strbuf_addstr(path, "/.git");
+	if (file_exists(path->buf)) {
+		strbuf_setlen(path, len);
+		string_list_append(repos, path->buf);
+		return;
 	}
+	strbuf_setlen(path, len);
 
-	if (debug_mode) {
-		fprintf(stderr, "[DEBUG] Using remote: %s\n", remote_name);
+	if (depth >= SCAN_MAX_DEPTH || !(dir = opendir(path->buf))) {
+		return;
 	}
+	while ((de = readdir(dir))) {
+		struct stat st;
 
-	/* Try to detect remote's default branch via <remote>/HEAD symbolic ref */
-	char remote_head_ref[256];
-	snprintf(remote_head_ref, sizeof(remote_head_ref), "refs/remotes/%s/HEAD", remote_name);
-
-	struct object_id oid_temp;
-	int ref_flags = 0;
-	const char *resolved_ref = refs_resolve_ref_unsafe(
-		ctx->refs, remote_head_ref, RESOLVE_REF_READING, &oid_temp, &ref_flags);
-	if (debug_mode) {
-		fprintf(stderr, "[DEBUG] resolved_ref = %s\n",
-			resolved_ref ? resolved_ref : "(null)");
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+		strbuf_addf(path, "/%s", de->d_name);
+		if (!lstat(path->buf, &st) && S_ISDIR(st.st_mode)) {
+			find_repositories(path, depth + 1, repos);
+		}
+		strbuf_setlen(path, len);
 	}
+	closedir(dir);
+}
 
-	if (resolved_ref && skip_prefix(resolved_ref, "refs/remotes/", &main_branch)) {
-		/* Successfully resolved <remote>/HEAD to something like "origin/main" */
-		if (debug_mode) {
-			fprintf(stderr, "[DEBUG] After skip_prefix: main_branch = %s\n",
-				main_branch ? main_branch : "(null)");
-		}
+/*
+ * Read one repository path per line (blank lines and "#" comments skipped).
+ * Returns 0 on success, -1 if the file cannot be opened.
+ */
+static int read_repository_list(const char *file, struct string_list *repos)
+{
+	struct strbuf line = STRBUF_INIT;
+	FILE *fp = strcmp(file, "-") ? fopen(file, "r") : stdin;
 
-		/* Copy the string since resolved_ref may be invalidated by later git calls */
-		if (main_branch) {
-			main_branch_allocated = strdup(main_branch);
-			main_branch = main_branch_allocated;
-			main_from_symref = 1; /* Came from origin/HEAD symref */
-		}
-	} else {
-		/* No <remote>/HEAD configured - try common fallbacks (main, master) */
-		if (debug_mode) {
-			fprintf(stderr, "[DEBUG] No refs/remotes/%s/HEAD - trying fallbacks\n",
-				remote_name);
+	if (!fp) {
+		return error_errno("could not open '%s'", file);
+	}
+	while (strbuf_getline(&line, fp) != EOF) {
+		strbuf_trim(&line);
+		if (line.len && line.buf[0] != '#') {
+			string_list_append(repos, line.buf);
 		}
+	}
+	if (fp != stdin) {
+		fclose(fp);
+	}
+	strbuf_release(&line);
+	return 0;
+}
 
-		/* Try <remote>/main first */
-		struct strbuf fallback = STRBUF_INIT;
-		strbuf_addf(&fallback, "%s/main", remote_name);
-		struct strbuf fallback_ref = STRBUF_INIT;
-		strbuf_addf(&fallback_ref, "refs/remotes/%s", fallback.buf);
+/*
+ * Worker: render the prompt of one repository into fd and exit.
+ */
+static void NORETURN scan_worker_main(const char *path, int fd)
+{
+	struct strbuf prompt = STRBUF_INIT;
+	int nongit_ok = 0;
 
-		if (refs_ref_exists(ctx->refs, fallback_ref.buf)) {
-			main_branch_allocated = strbuf_detach(&fallback, NULL);
-			main_branch = main_branch_allocated;
-			if (debug_mode) {
-				fprintf(stderr, "[DEBUG] Using fallback: %s\n", main_branch);
-			}
-		} else {
-			/* Try <remote>/master */
-			strbuf_reset(&fallback);
-			strbuf_addf(&fallback, "%s/master", remote_name);
-			strbuf_reset(&fallback_ref);
-			strbuf_addf(&fallback_ref, "refs/remotes/%s", fallback.buf);
-
-			if (refs_ref_exists(ctx->refs, fallback_ref.buf)) {
-				main_branch_allocated = strbuf_detach(&fallback, NULL);
-				main_branch = main_branch_allocated;
-				if (debug_mode) {
-					fprintf(stderr, "[DEBUG] Using fallback: %s\n", main_branch);
-				}
-			} else if (debug_mode) {
-				fprintf(stderr, "[DEBUG] No fallback refs found - skipping divergence\n");
-			}
-		}
+	/* The repository is found from the path, not from the caller's environment */
+	unsetenv(GIT_DIR_ENVIRONMENT);
+	unsetenv(GIT_WORK_TREE_ENVIRONMENT);
+	if (chdir(path)) {
+		exit(SCAN_EXIT_NOT_REPO);
+	}
 
-		strbuf_release(&fallback);
-		strbuf_release(&fallback_ref);
+	initialize_repository(the_repository);
+	setup_git_directory_gently(&nongit_ok);
+	if (nongit_ok || !the_repository->gitdir) {
+		exit(SCAN_EXIT_NOT_REPO);
 	}
 
-	if (debug_mode) {
-		fprintf(stderr, "[DEBUG] main_branch = %s\n", main_branch ? main_branch : "(null)");
+	if (!deadline_ms) {
+		deadline_ms = scan_budget_ms;
 	}
+	deadline_start();
 
-	struct object_id main_oid;
-	int has_main_oid = 0;
+	prepare_prompt_state();
+	render_prompt(&prompt);
+	strbuf_rtrim(&prompt);
+	exit(write_in_full(fd, prompt.buf, prompt.len) < 0);
+}
 
-	if (main_branch && !repo_get_oid(the_repository, main_branch, &main_oid)) {
-		has_main_oid = 1;
+static int start_scan_worker(struct scan_worker *worker, const char *path)
+{
+	int fds[2];
+
+	if (pipe(fds) < 0) {
+		return error_errno("pipe failed");
 	}
 
-	/*
-	 * Phase 2: Check divergence from upstream tracking branch
-	 * Skip if upstream is the same as main_branch (avoid redundant indicators)
-	 */
-	struct object_id upstream_oid;
-	int has_upstream = 0;
-	int upstream_is_main = 0;
+	fflush(stdout); /* Or the worker would flush the parent's pending lines again */
+	worker->pid = fork();
+	if (worker->pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return error_errno("fork failed");
+	}
+	if (!worker->pid) {
+		close(fds[0]);
+		scan_worker_main(path, fds[1]);
+	}
 
-	/* Use branch API to get upstream tracking branch (reuse current_branch from Phase 1) */
-	const char *upstream = NULL;
-	if (current_branch) {
-		upstream = branch_get_upstream(current_branch, NULL);
+	close(fds[1]);
+	worker->path = path;
+	worker->fd = fds[0];
+	worker->start = getnanotime();
+	strbuf_init(&worker->out, 0);
+	return 0;
+}
+
+/*
+ * Print the line of one repository: its prompt, or its status in parentheses.
+ */
+static void print_scan_line(const char *path, const char *status, const char *prompt,
+			    long elapsed_ms)
+{
+	if (scan_json) {
+		struct json_writer jw = JSON_WRITER_INIT;
+
+		jw_object_begin(&jw, 0);
+		jw_object_string(&jw, "path", path);
+		jw_object_string(&jw, "status", status);
+		jw_object_string(&jw, "prompt", prompt);
+		jw_object_intmax(&jw, "ms", elapsed_ms);
+		jw_end(&jw);
+		printf("%s\n", jw.json.buf);
+		jw_release(&jw);
+	} else if (!strcmp(status, "ok")) {
+		printf("%s\t%s\n", path, prompt);
+	} else {
+		printf("%s\t(%s)\n", path, status);
 	}
+	fflush(stdout);
 
 	if (debug_mode) {
-		fprintf(stderr, "[DEBUG] upstream = %s, has_upstream = %d\n",
-			upstream ? upstream : "(null)", has_upstream);
+		fprintf(stderr, "[DEBUG] Scan: %s %s in %ldms\n", path, status, elapsed_ms);
 	}
+}
 
-	if (upstream && !repo_get_oid(the_repository, upstream, &upstream_oid)) {
-		has_upstream = 1;
+/*
+ * Reap a worker (killing it first on timeout) and print its line.
+ */
+static void finish_scan_worker(struct scan_worker *worker, int timed_out)
+{
+	long elapsed_ms = (getnanotime() - worker->start) / 1000000;
+	const char *status = "ok";
+	int wstatus = 0;
+
+	close(worker->fd);
+	if (timed_out) {
+		kill(worker->pid, SIGKILL);
+		status = "timeout";
+	}
+	if (waitpid(worker->pid, &wstatus, 0) < 0 ||
+	    (!timed_out && (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus)))) {
+		status = WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == SCAN_EXIT_NOT_REPO
+				 ? "not a repository"
+				 : "error";
+	}
+	if (strcmp(status, "ok")) {
+		strbuf_reset(&worker->out);
+	}
 
-		if (debug_mode) {
-			fprintf(stderr, "[DEBUG] Successfully got upstream OID\n");
-		}
+	print_scan_line(worker->path, status, worker->out.buf, elapsed_ms);
+	strbuf_release(&worker->out);
+}
 
-		/* Check if upstream is the same as main_branch */
-		if (debug_mode) {
-			fprintf(stderr, "[DEBUG] About to compare: main_branch=%s\n",
-				main_branch ? main_branch : "(null)");
-		}
+/*
+ * Run the scan and print one line per repository.
+ * Performance: O(repos / jobs) wall time, each repository bounded by the budget
+ *
+ * Returns 0 on success, -1 if the repository list cannot be read or a worker
+ * could not be started (that repository's line says "error").
+ */
+static int run_scan(void)
+{
+	struct string_list repos = STRING_LIST_INIT_DUP;
+	struct scan_worker workers[SCAN_MAX_JOBS];
+	struct pollfd pfd[SCAN_MAX_JOBS];
+	uint64_t kill_after = (uint64_t)(scan_budget_ms + SCAN_KILL_GRACE_MS) * 1000000;
+	int nr_jobs = online_cpus() * 2, active = 0, failed = 0;
+	size_t next = 0;
+
+	if (repos_from && read_repository_list(repos_from, &repos) < 0) {
+		string_list_clear(&repos, 0);
+		return -1;
+	}
+	if (scan_dir) {
+		struct strbuf path = STRBUF_INIT;
 
-		if (has_main_oid && oideq(&upstream_oid, &main_oid)) {
-			upstream_is_main = 1;
-			if (debug_mode) {
-				fprintf(stderr, "[DEBUG] upstream_is_main = 1 (upstream matches "
-						"main_branch)\n");
-			}
-		}
-		if (debug_mode && !upstream_is_main) {
-			fprintf(stderr, "[DEBUG] upstream_is_main = 0\n");
-		}
+		strbuf_addstr(&path, scan_dir);
+		strbuf_strip_suffix(&path, "/");
+		find_repositories(&path, 0, &repos);
+		strbuf_release(&path);
+	}
+	if (nr_jobs > SCAN_MAX_JOBS) {
+		nr_jobs = SCAN_MAX_JOBS;
+	}
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] Scan: %" PRIuMAX " repositories, %d jobs\n",
+			(uintmax_t)repos.nr, nr_jobs);
 	}
 
-	/*
-	 * Build cache key once - used for both read and write
-	 */
-	struct strbuf cache_key = STRBUF_INIT;
-	build_cache_key(&cache_key, &ctx->oid, has_main_oid ? &main_oid : NULL,
-			has_upstream ? &upstream_oid : NULL, has_main_oid, has_upstream);
-
-	/*
-	 * Try cache first - check if we have cached divergence data
-	 */
-	struct divergence_data data = read_divergence_cache(&cache_key);
+	while (next < repos.nr || active) {
+		uint64_t now;
+		int timeout = -1;
 
-	if (!data.cached) {
-		/* Cache miss - compute with BFS */
-		int main_cost = 0, upstream_cost = 0;
+		while (active < nr_jobs && next < repos.nr) {
+			const char *path = repos.items[next].string;
 
-		if (has_main_oid) {
-			if (debug_mode) {
-				fprintf(stderr, "[DEBUG] BFS: HEAD = %s\n", oid_to_hex(&ctx->oid));
-				fprintf(stderr, "[DEBUG] BFS: %s = %s\n", main_branch,
-					oid_to_hex(&main_oid));
-			}
-			/* Use bidirectional BFS to find divergence */
-			struct bfs_divergence_result main_result =
-				bfs_find_divergence(&ctx->oid, &main_oid, max_traversal);
-			data.main_ahead = main_result.ahead;
-			data.main_behind = main_result.behind;
-			main_cost = main_result.commits_visited;
-			if (debug_mode) {
-				fprintf(stderr,
-					"[DEBUG] main divergence: ahead=%d, behind=%d, cost=%d\n",
-					data.main_ahead, data.main_behind, main_cost);
+			if (start_scan_worker(&workers[active], path) < 0) {
+				if (active) {
+					break; /* Stays queued until a running worker finishes */
+				}
+				/* No slot will free up: report it rather than drop it */
+				print_scan_line(path, "error", "", 0);
+				failed = 1;
+				next++;
+				continue;
 			}
+			next++;
+			active++;
 		}
-
-		/* Only check upstream divergence if it's different from main */
-		if (has_upstream && !upstream_is_main) {
-			if (debug_mode) {
-				fprintf(stderr, "[DEBUG] BFS: upstream = %s = %s\n", upstream,
-					oid_to_hex(&upstream_oid));
-			}
-			/* Use bidirectional BFS to find divergence */
-			struct bfs_divergence_result upstream_result =
-				bfs_find_divergence(&ctx->oid, &upstream_oid, max_traversal);
-			data.upstream_ahead = upstream_result.ahead;
-			data.upstream_behind = upstream_result.behind;
-			upstream_cost = upstream_result.commits_visited;
-			if (debug_mode) {
-				fprintf(stderr,
-					"[DEBUG] upstream divergence: ahead=%d, behind=%d, "
-					"cost=%d\n",
-					data.upstream_ahead, data.upstream_behind, upstream_cost);
-			}
+		if (!active) {
+			break; /* Every remaining repository failed to start */
 		}
 
-		/* Write to cache */
-		write_divergence_cache(&cache_key, &data, main_cost + upstream_cost);
-	}
-
-	strbuf_release(&cache_key);
-
-	DEBUG_TIMER_END(divergence, "Divergence check");
-
-	/*
-	 * Display strategy: Show two separate indicators
-	 * 1. Relationship to origin/master (main codebase)
-	 * 2. Relationship to upstream tracking branch
-	 */
+		now = getnanotime();
+		for (int i = 0; i < active; i++) {
+			uint64_t end = workers[i].start + kill_after;
+			int left = end > now ? (end - now) / 1000000 + 1 : 0;
 
-	/* Show main divergence when main_branch exists */
-	/* Skip if we already showed it as upstream indicator AND would be duplicate */
-	if (main_branch && (!has_upstream || !upstream_is_main)) {
-		if (data.main_ahead >= 0 && data.main_behind >= 0) {
-			/* Both values known - found merge-base, can show accurate divergence */
-			if (data.main_ahead > 0 && data.main_behind > 0) {
-				/* Diverged: both ahead and behind - never use parentheses */
-				strbuf_color_addf(indicators, COLOR_DIVERGED, "↑%d↓%d",
-						  data.main_ahead, data.main_behind);
-			} else if (data.main_ahead > 0) {
-				/* Ahead of main - never use parentheses */
-				strbuf_color_addf(indicators, COLOR_AHEAD, "↑%d", data.main_ahead);
-			} else if (data.main_behind > 0) {
-				/* Behind main - never use parentheses */
-				strbuf_color_addf(indicators, COLOR_BEHIND, "↓%d", data.main_behind);
+			pfd[i].fd = workers[i].fd;
+			pfd[i].events = POLLIN;
+			if (timeout < 0 || left < timeout) {
+				timeout = left;
 			}
-			/* If both are 0, we're in sync - don't show anything */
-		} else {
-			/* Both searches exhausted - too far apart */
-			strbuf_color_addf(indicators, COLOR_DIVERGED, "↕");
 		}
-	}
+		if (poll(pfd, active, timeout) < 0 && errno != EINTR) {
+			die_errno("poll failed");
+		}
 
-	/* Show upstream == main divergence with appropriate formatting */
-	if (has_upstream && upstream_is_main) {
-		/*
-		 * Use parentheses if main came from fallback (not from origin/HEAD symref).
-		 * When origin/HEAD symref exists and points to same as upstream, treat as
-		 * canonical main branch (no parentheses). Otherwise use parentheses to
-		 * indicate upstream tracking relationship.
-		 */
-		int use_parens = !main_from_symref;
+		now = getnanotime();
+		for (int i = active - 1; i >= 0; i--) {
+			struct scan_worker *worker = &workers[i];
+			int done = 0, timed_out = 0;
 
-		if (data.main_ahead >= 0 && data.main_behind >= 0) {
-			if (data.main_ahead > 0 && data.main_behind > 0) {
-				if (use_parens) {
-					strbuf_color_addf(indicators, COLOR_DIVERGED, "(↑%d↓%d)",
-							  data.main_ahead, data.main_behind);
-				} else {
-					strbuf_color_addf(indicators, COLOR_DIVERGED, "↑%d↓%d",
-							  data.main_ahead, data.main_behind);
-				}
-			} else if (data.main_ahead > 0) {
-				if (use_parens) {
-					strbuf_color_addf(indicators, COLOR_AHEAD, "(↑%d)", data.main_ahead);
-				} else {
-					strbuf_color_addf(indicators, COLOR_AHEAD, "↑%d", data.main_ahead);
-				}
-			} else if (data.main_behind > 0) {
-				if (use_parens) {
-					strbuf_color_addf(indicators, COLOR_BEHIND, "(↓%d)", data.main_behind);
-				} else {
-					strbuf_color_addf(indicators, COLOR_BEHIND, "↓%d", data.main_behind);
-				}
+			if (pfd[i].revents) {
+				done = strbuf_read_once(&worker->out, worker->fd, 0) <= 0;
 			}
-		} else {
-			if (use_parens) {
-				strbuf_color_addf(indicators, COLOR_DIVERGED, "(↕)");
-			} else {
-				strbuf_color_addf(indicators, COLOR_DIVERGED, "↕");
+			if (!done && now >= worker->start + kill_after) {
+				done = timed_out = 1;
 			}
-		}
-	}
-
-	/* Show upstream tracking divergence */
-	/* Skip if upstream == main_branch (we already showed main divergence above) */
-	if (has_upstream && !upstream_is_main) {
-		if (data.upstream_ahead >= 0 && data.upstream_behind >= 0) {
-			/* Both values known - found merge-base, can show accurate divergence */
-			if (data.upstream_ahead > 0 && data.upstream_behind > 0) {
-				/* Diverged from upstream - both ahead and behind */
-				strbuf_color_addf(indicators, COLOR_DIVERGED, "(↑%d↓%d)",
-						  data.upstream_ahead, data.upstream_behind);
-			} else if (data.upstream_ahead > 0) {
-				/* Ahead of upstream - need to push */
-				strbuf_color_addf(indicators, COLOR_AHEAD, "(↑%d)",
-						  data.upstream_ahead);
-			} else if (data.upstream_behind > 0) {
-				/* Behind upstream - need to pull */
-				strbuf_color_addf(indicators, COLOR_BEHIND, "(↓%d)",
-						  data.upstream_behind);
+			if (done) {
+				finish_scan_worker(worker, timed_out);
+				workers[i] = workers[--active];
+				pfd[i] = pfd[active];
 			}
-			/* If both are 0, we're in sync - don't show anything */
-		} else {
-			/* Both searches exhausted - too far apart */
-			strbuf_color_addf(indicators, COLOR_DIVERGED, "(↕)");
 		}
 	}
 
-	/* Clean up allocated main_branch string */
-	free(main_branch_allocated);
+	string_list_clear(&repos, 0);
+	return failed ? -1 : 0;
 }
 
 /*
- * Section 3: Collect miscellaneous indicators.
- * Includes: detached HEAD, git state (merge/rebase/etc), stash.
+ * Cache warm-up (--warm) for the reference-transaction and post-checkout hooks:
+ * right after a fetch, commit or checkout, compute the divergence of the new
+ * ref state in the background so the next prompt is a cache hit instead of
+ * paying for the walk while the user waits.
  *
- * Takes git_state computed earlier to avoid redundant checks.
+ * The hook returns at once; a detached worker holding <commondir>/prompt-warm.lock
+ * runs the tracking section, which stores its result via write_divergence_cache().
+ * While one worker runs, later hook calls start none but create prompt-warm.rerun
+ * instead, and the worker warms again until no such marker is left: a `git pull`
+ * (a fetch, then a merge) ends up warm for the final refs, not the intermediate
+ * ones. The lock records the worker's pid, and a lock left behind by a killed
+ * worker is removed, as for --stale-while-revalidate. Only options that are part
+ * of the cache key matter (--max-traversal, --exact-counts, --local), so the hook
+ * should pass the same ones as the prompt.
+ */
+static struct lock_file warm_lock = LOCK_INIT;
+
+/*
+ * Fill the divergence cache for the current HEAD, main and upstream.
+ * Performance: same as get_tracking_indicators() on a cache miss
+ * Safe for large repo mode: Yes (graph operations only)
+ */
+static void warm_divergence_cache(void)
+{
+	struct strbuf indicators = STRBUF_INIT;
+	struct ref_snapshot snapshot;
+	struct prompt_context ctx = {0};
+
+	ctx.refs = get_main_ref_store(the_repository);
+	ref_snapshot_load(&snapshot, ctx.refs);
+	if (snapshot.head.exists && snapshot.remote_name) {
+		oidcpy(&ctx.oid, &snapshot.head.oid);
+		ctx.snapshot = &snapshot;
+		get_tracking_indicators(&indicators, 0, &ctx);
+	}
+
+	if (debug_mode) {
+		fprintf(stderr, "[DEBUG] Warm: %s\n",
+			ctx.snapshot ? "divergence computed" : "no branch, nothing to warm");
+	}
+	ref_snapshot_release(&snapshot);
+	strbuf_release(&indicators);
+}
+
+/*
+ * Hook entry point. args are the hook's arguments: the transaction state for
+ * reference-transaction, "<old> <new> <flag>" for post-checkout.
  *
- * Performance: O(1) - checks simple flags and ref existence
- * Safe for large repo mode: Yes (no index or worktree operations)
+ * Returns 0 (a failing warm-up must never fail the git command).
  */
-static void get_misc_indicators(struct strbuf *indicators, int detached,
-				const struct prompt_context *ctx, const struct git_state *state)
+static int run_warm(int argc, const char **argv)
 {
-	/* Detached HEAD indicator (emoji, color has no effect) */
-	if (detached) {
-		strbuf_addstr(indicators, "⚡");
+	struct strbuf path = STRBUF_INIT;
+	struct strbuf rerun = STRBUF_INIT;
+	char buf[4096];
+	int nongit_ok = 0, prepared = 0;
+
+	/* Refs are still locked at "prepared"; nothing changed on "aborted" */
+	if (argc > 0 && (!strcmp(argv[0], "prepared") || !strcmp(argv[0], "aborted"))) {
+		return 0;
 	}
 
-	/* Display git state if present (merge, rebase, cherry-pick, etc.) */
-	if (state->has_state) {
-		strbuf_color_addf(indicators, state->state_color, "[%s]", state->state_name);
+	/* reference-transaction sends the updated refs on stdin; they are re-read anyway */
+	if (!isatty(0)) {
+		while (xread(0, buf, sizeof(buf)) > 0) {
+			; /* Drain stdin */
+		}
 	}
 
-	/* Check for stashed changes (emoji, color has no effect) */
-	if (refs_ref_exists(ctx->refs, "refs/stash")) {
-		strbuf_addstr(indicators, "💾");
+	initialize_repository(the_repository);
+	setup_git_directory_gently(&nongit_ok);
+	if (nongit_ok || !the_repository->gitdir) {
+		return 0;
+	}
+
+	/* With --debug, warm in the foreground to show what happens */
+	if (!debug_mode) {
+		fflush(stdout);
+		if (fork()) {
+			return 0; /* The hook (or a failed fork) returns right away */
+		}
+		detach_from_caller();
+	}
+
+	strbuf_addf(&path, "%s/prompt-warm", repo_get_common_dir(the_repository));
+	strbuf_addf(&rerun, "%s.rerun", path.buf);
+	for (;;) {
+		if (background_lock_held(path.buf) ||
+		    hold_background_lock(&warm_lock, path.buf) < 0) {
+			/* The running worker warms again for the refs as they are now */
+			int fd = open(rerun.buf, O_WRONLY | O_CREAT, 0666);
+			if (fd >= 0) {
+				close(fd);
+			}
+			if (debug_mode) {
+				fprintf(stderr, "[DEBUG] Warm: another warm-up is running, "
+						"asked it to rerun\n");
+			}
+			break;
+		}
+
+		if (!prepared) {
+			prepare_prompt_state();
+			prepared = 1;
+		}
+		do {
+			unlink(rerun.buf);
+			warm_divergence_cache();
+		} while (file_exists(rerun.buf));
+		rollback_lock_file(&warm_lock);
+
+		/* A hook call between the last check and the unlock found the lock held */
+		if (!file_exists(rerun.buf)) {
+			break;
+		}
 	}
+
+	strbuf_release(&path);
+	strbuf_release(&rerun);
+	return 0;
 }
 
 int main(int argc, const char **argv)
 {
-	struct timeval tv_start_total, tv_end_total;
+	uint64_t start_total;
+	const char *source = "rendered"; /* For --stats */
 	int no_color = 0;
 	int nongit_ok = 0;
+	int refreshing = 0; /* Background refresh for --stale-while-revalidate */
+	struct strbuf flight_key = STRBUF_INIT;
+	int flight = -1; /* prompt_flight_join() result, 0 if we publish */
 	const struct option options[] = {
 		OPT_BOOL(0, "no-color", &no_color, "disable colored output"),
 		OPT_BOOL(0, "debug", &debug_mode, "show timing information"),
@@ -1483,13 +7181,42 @@ int main(int argc, const char **argv)
 			0, "max-traversal", &max_traversal,
 			"maximum commits to traverse in divergence calculation (default: 1000)"),
 		OPT_BOOL(0, "local", &local_mode, "skip reading global git config"),
+		OPT_BOOL(0, "daemon", &daemon_mode,
+			 "keep repository state loaded and serve prompts over a unix socket"),
+		OPT_BOOL(0, "resume-search", &resume_search,
+			 "continue a too-far divergence search on the next prompt"),
+		OPT_BOOL(0, "exact-counts", &exact_counts,
+			 "count ahead/behind commits exactly instead of merge-base distances"),
+		OPT_INTEGER(0, "deadline-ms", &deadline_ms,
+			    "give up on slow sections after this many milliseconds (0: no limit)"),
+		OPT_STRING(0, "stats", &stats_format, "format",
+			   "print per-phase timings and counters to stderr (json)"),
+		OPT_BOOL(0, "submodules", &check_submodules,
+			 "check submodules for new commits and changes (time-budgeted)"),
+		OPT_INTEGER(0, "latency-target", &latency_target_ms,
+			    "enter large repo mode when status is expected to take longer "
+			    "(milliseconds, measured per repository)"),
+		OPT_BOOL(0, "stale-while-revalidate", &stale_while_revalidate,
+			 "print the last prompt at once and refresh it in the background"),
+		OPT_INTEGER(0, "prompt-cache", &prompt_cache_ttl,
+			    "reuse the last prompt for up to this many seconds while unchanged"),
+		OPT_BOOL(0, "write-index", &write_index,
+			 "write refreshed stat data and cache-tree back to the index"),
+		OPT_BOOL(0, "config-snapshot", &config_snapshot,
+			 "load only the config keys the prompt uses while config is unchanged"),
+		OPT_STRING(0, "scan", &scan_dir, "dir",
+			   "print the prompt of every repository below <dir>, one per line"),
+		OPT_STRING(0, "repos-from", &repos_from, "file",
+			   "print the prompt of every repository listed in <file> (- for stdin)"),
+		OPT_BOOL(0, "json", &scan_json, "print scan results as JSON lines"),
+		OPT_BOOL(0, "single-flight", &single_flight,
+			 "let concurrent prompts share one rendering"),
+		OPT_BOOL(0, "warm", &warm_mode,
+			 "fill the divergence cache in the background (for git hooks)"),
+		OPT_INTEGER(0, "scan-budget-ms", &scan_budget_ms,
+			    "time budget per repository in scan mode (default: 1000)"),
 		OPT_END()};
-	struct strbuf branch = STRBUF_INIT;
-	struct strbuf indicators = STRBUF_INIT;
-	const char *branch_color = COLOR_CLEAN;
-	int detached = 0;
-	struct prompt_context ctx;
-	const char *prefix;
+	struct strbuf prompt = STRBUF_INIT;
 
 	/* Handle --help before parse_options to avoid triggering man page */
 	if (argc == 2 && (!strcmp(argv[1], "--help") || !strcmp(argv[1], "-h"))) {
@@ -1497,116 +7224,116 @@ int main(int argc, const char **argv)
 		return 0;
 	}
 
-	/* Initialize repository - required for libgit.a functions */
-	initialize_repository(the_repository);
-
-	/* Setup git repository */
-	prefix = setup_git_directory_gently(&nongit_ok);
-
-	/* Return silently if not in a git repository */
-	if (nongit_ok) {
-		return 0;
-	}
-
-	/* Load git config (needed for core.excludesfile and other settings) */
-	/* Skip global config if --local flag is set (useful for tests) */
-	if (!local_mode) {
-		DEBUG_TIMER_START(config);
-		repo_config(the_repository, git_default_config, NULL);
-		DEBUG_TIMER_END(config, "Config load");
-	}
+	/* Keep the original command line so the daemon can restart itself */
+	strvec_pushv(&daemon_args, argv);
 
-	argc = parse_options(argc, argv, prefix, options, prompt_usage, 0);
+	/* Options are parsed before repository setup so the daemon client can skip it */
+	argc = parse_options(argc, argv, NULL, options, prompt_usage, 0);
 
 	/* Apply the no-color flag */
 	if (no_color) {
 		use_color = 0;
 	}
 
+	if (stats_format) {
+		if (strcmp(stats_format, "json")) {
+			die("unknown --stats format '%s' (supported: json)", stats_format);
+		}
+		stats_json = 1;
+	}
+
 	/* Start timing after options are parsed */
-	if (debug_mode) {
-		gettimeofday(&tv_start_total, NULL);
+	start_total = getnanotime();
+	deadline_start();
+
+	/* Hooks pass their own arguments */
+	if (warm_mode) {
+		return run_warm(argc, argv);
 	}
 
 	if (argc > 0) {
 		usage_with_options(prompt_usage, options);
 	}
 
-	/* Check if we're in a git repository - exit silently if not */
-	if (!the_repository || !the_repository->gitdir) {
+	/* Scan mode renders other repositories, never the current one */
+	if (scan_dir || repos_from) {
+		return run_scan() < 0 ? 1 : 0;
+	}
+
+	/* Ask a running daemon first (debug and stats output need the in-process path) */
+	if (!daemon_mode && !debug_mode && !stats_json && prompt_from_daemon()) {
 		return 0;
 	}
 
-	/* Check if HEAD exists */
-	if (repo_get_oid(the_repository, "HEAD", &ctx.oid)) {
+	/* Initialize repository - required for libgit.a functions */
+	initialize_repository(the_repository);
+
+	/* Setup git repository */
+	setup_git_directory_gently(&nongit_ok);
+
+	/* Return silently if not in a git repository */
+	if (nongit_ok) {
 		return 0;
 	}
 
-	/* Initialize shared context */
-	ctx.large_repo = is_large_repo();
-	ctx.refs = get_main_ref_store(the_repository);
-	ctx.index_loaded = 0;
+	/* Check if we're in a git repository - exit silently if not */
+	if (!the_repository || !the_repository->gitdir) {
+		return 0;
+	}
 
-	/*
-	 * Load the index once at the start for all operations.
-	 * This avoids multiple expensive index reads throughout the function.
-	 *
-	 * For large repos: normally skip index loading for performance, BUT
-	 * if a git operation is in progress (merge/rebase/etc), we NEED to
-	 * load the index to detect conflicts. Checking for state files is O(1),
-	 * and conflicts are critical information that must always be accurate.
-	 */
-	if (!ctx.large_repo) {
-		DEBUG_TIMER_START(index);
-		if (repo_read_index(the_repository) >= 0) {
-			ctx.index_loaded = 1;
-		}
-		DEBUG_TIMER_END(index, "Index load");
-	} else if (has_git_state_files()) {
-		/* Large repo with git operation in progress - load index for conflict detection */
-		DEBUG_TIMER_START(index);
-		if (repo_read_index(the_repository) >= 0) {
-			ctx.index_loaded = 1;
-			if (debug_mode) {
-				fprintf(stderr, "[DEBUG] Large repo: loaded index for conflict "
-						"detection (git operation in progress)\n");
-			}
+	/* Show the last prompt right away and refresh it in the background */
+	if (stale_while_revalidate && !daemon_mode && !debug_mode && print_last_prompt()) {
+		if (!start_prompt_refresh()) {
+			source = "last-prompt";
+			goto done;
 		}
-		DEBUG_TIMER_END(index, "Index load");
+		refreshing = 1;
 	}
 
-	/*
-	 * Get git state first (merge, rebase, cherry-pick, etc.).
-	 * This is needed by branch color determination to detect conflicts.
-	 * We compute it once and reuse it for both color and display.
-	 */
-	struct git_state state = get_git_state(ctx.index_loaded);
-
-	/* Section 1: Get branch name and color */
-	detached = get_branch_name_and_color(&branch, &branch_color, &ctx, &state);
+	/* A cached prompt needs neither config nor the index */
+	if (prompt_cache_ttl > 0 && !daemon_mode && !refreshing && print_cached_prompt()) {
+		source = "prompt-cache";
+		goto done;
+	}
 
-	/* Section 3: Get misc indicators (detached, git state, stash) */
-	get_misc_indicators(&indicators, detached, &ctx, &state);
+	prepare_prompt_state();
 
-	/* Section 2: Get tracking indicators (upstream, divergence from main) */
-	get_tracking_indicators(&indicators, detached, &branch, &ctx);
+	if (daemon_mode) {
+		return run_daemon() < 0 ? 1 : 0;
+	}
 
-	/* Output the prompt */
-	color_printf(branch_color, "[%s]", branch.buf);
+	/* Share one rendering between processes redrawing at the same time */
+	if (single_flight && !refreshing && !prompt_flight_key(&flight_key) &&
+	    (prompt_flight = prompt_flight_open())) {
+		flight = prompt_flight_join(prompt_flight, &flight_key, &prompt);
+		if (flight > 0) {
+			fwrite(prompt.buf, 1, prompt.len, stdout);
+			source = "single-flight";
+			goto done;
+		}
+	}
 
-	if (indicators.len) {
-		printf(" %s", indicators.buf);
+	render_prompt(&prompt);
+	if (!flight) {
+		prompt_flight_publish(prompt_flight, &flight_key, &prompt, !deadline_hits);
+	}
+	if (!refreshing) {
+		fwrite(prompt.buf, 1, prompt.len, stdout);
+	}
+	if (stale_while_revalidate && !debug_mode) {
+		store_last_prompt(&prompt);
+	}
+	if (prompt_cache_ttl > 0 && !daemon_mode && !deadline_hits) {
+		store_cached_prompt(&prompt);
 	}
-	printf(" ");
 
-	strbuf_release(&branch);
-	strbuf_release(&indicators);
+done:
+	strbuf_release(&prompt);
+	strbuf_release(&flight_key);
 
+	stats_report(source, start_total);
 	if (debug_mode) {
-		gettimeofday(&tv_end_total, NULL);
-		long usec = (tv_end_total.tv_sec - tv_start_total.tv_sec) * 1000000 +
-			    (tv_end_total.tv_usec - tv_start_total.tv_usec);
-		fprintf(stderr, "[DEBUG] Total: %.3fms\n", usec / 1000.0);
+		fprintf(stderr, "[DEBUG] Total: %.3fms\n", (getnanotime() - start_total) / 1e6);
 	}
 	return 0;
 }
@@ -0,0 +1,427 @@
+#!/usr/bin/python3
+"""
+Git Prompt Benchmark
+
+Generates synthetic repositories that stress one part of git-prompt each, runs
+the binary cold and warm with --stats=json, and reports p50/p99 of the total
+time and of every phase. Results are written as JSON so runs on two commits can
+be compared; with --baseline the run fails when a timing regressed.
+
+Generated repositories are kept in --work-dir and reused while the generator
+version and --scale match, since the large index takes minutes to build.
+"""
+
+import argparse
+import glob
+import json
+import math
+import os
+import shutil
+import subprocess
+import sys
+import time
+from pathlib import Path
+
+
+class Colors:
+    """ANSI color codes for terminal output"""
+    GREEN = '\033[92m'
+    RED = '\033[91m'
+    YELLOW = '\033[93m'
+    BLUE = '\033[94m'
+    RESET = '\033[0m'
+    BOLD = '\033[1m'
+
+
+# Bump when a generator changes, so repositories from an older version are rebuilt
+GENERATOR_VERSION = 2
+GENERATOR_MARKER = 'bench-generator'
+
+# git-prompt's default --max-traversal; the far divergence scenario goes past it
+MAX_TRAVERSAL_DEFAULT = 1000
+
+GIT_ENV = {
+    'GIT_AUTHOR_NAME': 'Bench User',
+    'GIT_AUTHOR_EMAIL': 'bench@example.com',
+    'GIT_COMMITTER_NAME': 'Bench User',
+    'GIT_COMMITTER_EMAIL': 'bench@example.com',
+    'GIT_AUTHOR_DATE': '2020-01-01T00:00:00Z',
+    'GIT_COMMITTER_DATE': '2020-01-01T00:00:00Z',
+}
+
+
+def git(args, cwd, stdin=None):
+    """Run a git command, raising with its stderr on failure"""
+    env = os.environ.copy()
+    env.update(GIT_ENV)
+    result = subprocess.run(['git'] + args, cwd=cwd, input=stdin, capture_output=True, env=env)
+    if result.returncode != 0:
+        raise RuntimeError(f"git {' '.join(args)} failed: {result.stderr.decode().strip()}")
+    return result.stdout.decode()
+
+
+class FastImport:
+    """Builds history through one git fast-import stream instead of thousands of commits"""
+
+    def __init__(self):
+        self.chunks = []
+        self.mark = 0
+        self.when = 1577836800  # 2020-01-01, one second per commit keeps dates ordered
+
+    def _next_mark(self):
+        self.mark += 1
+        return self.mark
+
+    def _data(self, text):
+        raw = text.encode()
+        self.chunks.append(b'data %d\n' % len(raw) + raw + b'\n')
+
+    def blob(self, text):
+        mark = self._next_mark()
+        self.chunks.append(b'blob\nmark :%d\n' % mark)
+        self._data(text)
+        return mark
+
+    def commit(self, ref, parents=(), files=(), message=None):
+        """files is a list of (path, blob mark); returns the commit's mark"""
+        mark = self._next_mark()
+        self.when += 1
+        self.chunks.append(b'commit %s\nmark :%d\n' % (ref.encode(), mark))
+        self.chunks.append(b'committer Bench User <bench@example.com> %d +0000\n' % self.when)
+        self._data(message or f'commit {mark}')
+        for i, parent in enumerate(parents):
+            self.chunks.append(b'%s :%d\n' % (b'from' if i == 0 else b'merge', parent))
+        for path, blob in files:
+            self.chunks.append(b'M 100644 :%d %s\n' % (blob, path.encode()))
+        return mark
+
+    def reset(self, ref, mark):
+        self.chunks.append(b'reset %s\nfrom :%d\n\n' % (ref.encode(), mark))
+
+    def run(self, cwd):
+        git(['fast-import', '--quiet'], cwd, stdin=b''.join(self.chunks))
+
+
+def scaled(count, scale, minimum=1):
+    return max(minimum, int(count * scale))
+
+
+def init_repo(path):
+    git(['init', '--quiet', '--initial-branch=main', str(path)], cwd=path.parent)
+
+
+def set_upstream(path):
+    """Make refs/remotes/origin/main the upstream of main, as a clone would"""
+    git(['config', 'remote.origin.url', 'https://example.com/bench.git'], path)
+    git(['config', 'remote.origin.fetch', '+refs/heads/*:refs/remotes/origin/*'], path)
+    git(['config', 'branch.main.remote', 'origin'], path)
+    git(['config', 'branch.main.merge', 'refs/heads/main'], path)
+
+
+def checkout(path):
+    git(['reset', '--quiet', '--hard'], path)
+
+
+def tree_files(stream, count, per_dir=1000):
+    """count tracked files spread over directories of per_dir files, sharing one blob"""
+    blob = stream.blob('bench\n')
+    return [(f'd{i // per_dir:04d}/f{i:07d}', blob) for i in range(count)]
+
+
+def gen_linear(path, scale):
+    """Long linear history; main is 5 ahead of and 3 behind origin/main"""
+    stream = FastImport()
+    files = tree_files(stream, 1000)
+    tip = stream.commit('refs/heads/main', files=files)
+    for i in range(scaled(10000, scale, 10)):
+        tip = stream.commit('refs/heads/main', [tip], [('file.txt', stream.blob(f'{i}\n'))])
+    base = tip
+    for i in range(3):
+        tip = stream.commit('refs/remotes/origin/main', [tip], [('remote.txt', stream.blob(f'{i}\n'))])
+    tip = base
+    for i in range(5):
+        tip = stream.commit('refs/heads/main', [tip], [('local.txt', stream.blob(f'{i}\n'))])
+    stream.reset('refs/heads/main', tip)
+    init_repo(path)
+    stream.run(path)
+    set_upstream(path)
+    checkout(path)
+
+
+def gen_merge_heavy(path, scale):
+    """Mainline where every commit is a merge of a side branch; origin/main is 50 merges back"""
+    stream = FastImport()
+    files = tree_files(stream, 1000)
+    main = stream.commit('refs/heads/main', files=files)
+    merges = scaled(5000, scale, 60)
+    for i in range(merges):
+        side = stream.commit('refs/heads/side', [main], [('side.txt', stream.blob(f'{i}\n'))])
+        main = stream.commit('refs/heads/main', [main, side], [('main.txt', stream.blob(f'{i}\n'))])
+        if i == merges - 51:
+            stream.reset('refs/remotes/origin/main', main)
+    init_repo(path)
+    stream.run(path)
+    set_upstream(path)
+    checkout(path)
+
+
+def gen_far_divergence(path, scale):
+    """main and origin/main each 2.5x --max-traversal past their merge base"""
+    stream = FastImport()
+    files = tree_files(stream, 1000)
+    base = stream.commit('refs/heads/main', files=files)
+    for i in range(100):
+        base = stream.commit('refs/heads/main', [base], [('file.txt', stream.blob(f'{i}\n'))])
+    for ref in ('refs/remotes/origin/main', 'refs/heads/main'):
+        tip = base
+        for i in range(MAX_TRAVERSAL_DEFAULT * 5 // 2):
+            tip = stream.commit(ref, [tip], [(f'{ref.split("/")[2]}.txt', stream.blob(f'{i}\n'))])
+        stream.reset(ref, tip)
+    init_repo(path)
+    stream.run(path)
+    set_upstream(path)
+    checkout(path)
+
+
+def gen_large_index(path, scale):
+    """One commit with 1M tracked files (scaled), checked out and clean"""
+    stream = FastImport()
+    tip = stream.commit('refs/heads/main', files=tree_files(stream, scaled(1000000, scale, 1000)))
+    stream.reset('refs/remotes/origin/main', tip)
+    init_repo(path)
+    stream.run(path)
+    set_upstream(path)
+    checkout(path)
+
+
+def gen_sparse_checkout(path, scale):
+    """Clone of a 100k-file tree (scaled) with a sparse index and a cone of 2 directories"""
+    origin = path.parent / f'{path.name}-origin.git'
+    shutil.rmtree(origin, ignore_errors=True)
+    git(['init', '--quiet', '--bare', '--initial-branch=main', str(origin)], cwd=path.parent)
+    stream = FastImport()
+    tip = stream.commit('refs/heads/main', files=tree_files(stream, scaled(100000, scale, 5000)))
+    for i in range(100):
+        tip = stream.commit('refs/heads/main', [tip], [('d0000/file.txt', stream.blob(f'{i}\n'))])
+    stream.run(origin)
+    git(['clone', '--quiet', '--sparse', str(origin), str(path)], cwd=path.parent)
+    git(['sparse-checkout', 'set', '--cone', '--sparse-index', 'd0000', 'd0001'], path)
+
+
+def gen_untracked(path, scale):
+    """Small tracked tree next to 200 untracked directories of 100 files (scaled)"""
+    stream = FastImport()
+    tip = stream.commit('refs/heads/main', files=tree_files(stream, 1000))
+    stream.reset('refs/remotes/origin/main', tip)
+    init_repo(path)
+    stream.run(path)
+    set_upstream(path)
+    checkout(path)
+    for d in range(scaled(200, scale)):
+        directory = path / 'build' / f'out{d:04d}'
+        directory.mkdir(parents=True)
+        for f in range(100):
+            (directory / f'obj{f:03d}.o').write_bytes(b'')
+
+
+SCENARIOS = {
+    'linear': gen_linear,
+    'merge-heavy': gen_merge_heavy,
+    'far-divergence': gen_far_divergence,
+    'large-index': gen_large_index,
+    'sparse-checkout': gen_sparse_checkout,
+    'untracked': gen_untracked,
+}
+
+
+def prepare_repo(work_dir, name, scale):
+    """Generate the scenario's repository unless an up-to-date one is already there"""
+    path = work_dir / name
+    marker = path / '.git' / GENERATOR_MARKER
+    stamp = f'{GENERATOR_VERSION} {scale}\n'
+    if marker.exists() and marker.read_text() == stamp:
+        return path
+
+    print(f"  Generating {name}...", end='', flush=True)
+    start = time.monotonic()
+    shutil.rmtree(path, ignore_errors=True)
+    path.mkdir(parents=True)
+    SCENARIOS[name](path, scale)
+    marker.write_text(stamp)
+    print(f" {time.monotonic() - start:.1f}s")
+    return path
+
+
+def clear_prompt_caches(path):
+    """Remove everything git-prompt persists (prompt-cache, prompt-tags, ...) for a cold run"""
+    for cache in glob.glob(str(path / '.git' / 'prompt-*')):
+        os.unlink(cache)
+
+
+def drop_page_cache():
+    """Best effort: needs root, silently skipped otherwise"""
+    try:
+        subprocess.run(['sync'], check=False)
+        with open('/proc/sys/vm/drop_caches', 'w') as f:
+            f.write('3\n')
+    except OSError:
+        pass
+
+
+def run_prompt(git_prompt_path, cwd):
+    """Run git-prompt once and return its --stats=json record"""
+    result = subprocess.run(
+        [str(git_prompt_path), '--no-color', '--local', '--stats=json'],
+        cwd=cwd, capture_output=True, text=True)
+    if result.returncode != 0:
+        raise RuntimeError(f"git-prompt exited with {result.returncode}: {result.stderr.strip()}")
+    for line in reversed(result.stderr.splitlines()):
+        if line.startswith('{'):
+            return json.loads(line)
+    raise RuntimeError(f"no --stats=json record in stderr: {result.stderr.strip()}")
+
+
+def percentile(values, pct):
+    """Nearest-rank percentile"""
+    ordered = sorted(values)
+    return ordered[max(0, math.ceil(pct / 100 * len(ordered)) - 1)]
+
+
+def summarize(records):
+    """p50/p99 of total_ms and of every phase, plus how each prompt was produced"""
+    def dist(values):
+        return {'p50': percentile(values, 50), 'p99': percentile(values, 99)}
+
+    phases = {}
+    for phase in records[0]['phases_ms']:
+        phases[phase] = dist([r['phases_ms'][phase] for r in records])
+    sources = {}
+    for r in records:
+        sources[r['source']] = sources.get(r['source'], 0) + 1
+    return {
+        'runs': len(records),
+        'total_ms': dist([r['total_ms'] for r in records]),
+        'phases_ms': phases,
+        'commits_visited_p50': percentile([r['counters']['commits_visited'] for r in records], 50),
+        'large_repo': records[0]['large_repo'],
+        'sources': sources,
+    }
+
+
+def bench_scenario(git_prompt_path, path, runs, drop_caches):
+    cold = []
+    for _ in range(runs):
+        clear_prompt_caches(path)
+        if drop_caches:
+            drop_page_cache()
+        cold.append(run_prompt(git_prompt_path, path))
+
+    run_prompt(git_prompt_path, path)  # Prime the caches once before the warm runs
+    warm = [run_prompt(git_prompt_path, path) for _ in range(runs)]
+    return {'cold': summarize(cold), 'warm': summarize(warm)}
+
+
+def compare(results, baseline, max_regression, min_delta_ms):
+    """List the timings that got slower than the baseline by more than the allowed margin"""
+    regressions = []
+    for name, scenario in results['scenarios'].items():
+        for mode in ('cold', 'warm'):
+            base = baseline.get('scenarios', {}).get(name, {}).get(mode)
+            if not base:
+                continue
+            current = scenario[mode]
+            pairs = [('total_ms', current['total_ms'], base['total_ms'])]
+            for phase, dist in current['phases_ms'].items():
+                if phase in base['phases_ms']:
+                    pairs.append((phase, dist, base['phases_ms'][phase]))
+            for metric, now, then in pairs:
+                for pct in ('p50', 'p99'):
+                    delta = now[pct] - then[pct]
+                    if delta > min_delta_ms and now[pct] > then[pct] * (1 + max_regression / 100):
+                        regressions.append(
+                            f"{name} {mode} {metric} {pct}: {then[pct]:.3f}ms -> {now[pct]:.3f}ms")
+    return regressions
+
+
+def print_table(results):
+    print(f"\n{Colors.BOLD}{'scenario':<18} {'mode':<5} {'p50 ms':>9} {'p99 ms':>9}  slowest phase (p50){Colors.RESET}")
+    for name, scenario in results['scenarios'].items():
+        for mode in ('cold', 'warm'):
+            summary = scenario[mode]
+            phase, dist = max(summary['phases_ms'].items(), key=lambda item: item[1]['p50'])
+            print(f"{name:<18} {mode:<5} {summary['total_ms']['p50']:>9.3f} "
+                  f"{summary['total_ms']['p99']:>9.3f}  {phase} {dist['p50']:.3f}ms")
+
+
+def main():
+    """Main entry point"""
+    script_dir = Path(__file__).parent
+
+    parser = argparse.ArgumentParser(description='Benchmark git-prompt on synthetic repositories')
+    parser.add_argument('--binary', default=str(script_dir / '../target/git-prompt'), help='git-prompt binary to benchmark')
+    parser.add_argument('--runs', type=int, default=20, help='Cold and warm runs per scenario')
+    parser.add_argument('--scale', type=float, default=1.0, help='Size multiplier for the generated repositories (1.0 = 1M-entry index)')
+    parser.add_argument('--scenario', action='append', choices=sorted(SCENARIOS), help='Only run this scenario (repeatable)')
+    parser.add_argument('--work-dir', default=str(script_dir / 'bench-repos'), help='Where generated repositories are kept between runs')
+    parser.add_argument('--output', default=str(script_dir / 'bench-results.json'), help='Results file')
+    parser.add_argument('--baseline', help='Results file of an earlier run to compare against')
+    parser.add_argument('--max-regression', type=float, default=20.0, help='Allowed slowdown against the baseline, in percent')
+    parser.add_argument('--min-delta-ms', type=float, default=0.5, help='Ignore slowdowns smaller than this, to keep timer noise out')
+    parser.add_argument('--drop-caches', action='store_true', help='Drop the page cache before each cold run (needs root)')
+
+    args = parser.parse_args()
+
+    git_prompt_path = Path(args.binary).resolve()
+    if not git_prompt_path.exists():
+        print(f"{Colors.RED}git-prompt not found: {git_prompt_path}{Colors.RESET}")
+        print(f"Did you run 'make' in the parent directory?")
+        return 1
+
+    baseline = None
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+    work_dir = Path(args.work_dir).resolve()
+    work_dir.mkdir(parents=True, exist_ok=True)
+    names = args.scenario or list(SCENARIOS)
+
+    results = {
+        'version': 1,
+        'binary': str(git_prompt_path),
+        'commit': git(['rev-parse', 'HEAD'], script_dir).strip(),
+        'date': time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime()),
+        'runs': args.runs,
+        'scale': args.scale,
+        'scenarios': {},
+    }
+
+    print(f"{Colors.BLUE}Benchmarking {git_prompt_path} ({args.runs} runs, scale {args.scale}){Colors.RESET}")
+    for name in names:
+        path = prepare_repo(work_dir, name, args.scale)
+        print(f"  Running {name}...", flush=True)
+        results['scenarios'][name] = bench_scenario(git_prompt_path, path, args.runs, args.drop_caches)
+
+    with open(args.output, 'w') as f:
+        json.dump(results, f, indent=2)
+        f.write('\n')
+
+    print_table(results)
+    print(f"\nResults written to {args.output}")
+
+    if baseline is None:
+        return 0
+
+    regressions = compare(results, baseline, args.max_regression, args.min_delta_ms)
+    if regressions:
+        print(f"\n{Colors.RED}{len(regressions)} regression(s) against {args.baseline} "
+              f"(>{args.max_regression:g}% and >{args.min_delta_ms:g}ms):{Colors.RESET}")
+        for regression in regressions:
+            print(f"  {regression}")
+        return 1
+    print(f"{Colors.GREEN}No regressions against {args.baseline}{Colors.RESET}")
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
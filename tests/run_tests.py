@@ -6,6 +6,7 @@ Runs declarative tests from test_cases.yaml in sequence, building up git state
 progressively in a temporary directory.
 """
 
+import json
 import os
 import re
 import shutil
@@ -28,8 +29,8 @@ class Colors:
     BOLD = '\033[1m'
 
 
-def run_command(cmd, cwd, verbose=False):
-    """Run a shell command and return output"""
+def run_command(cmd, cwd, verbose=False, stdin=None):
+    """Run a shell command (with stdin as its input, if given) and return output"""
     if verbose:
         print(f"    $ {cmd}")
 
@@ -48,6 +49,7 @@ def run_command(cmd, cwd, verbose=False):
         cmd,
         shell=True,
         cwd=cwd,
+        input=stdin,
         capture_output=True,
         text=True,
         env=env
@@ -61,18 +63,52 @@ def run_command(cmd, cwd, verbose=False):
     return result.returncode, result.stdout, result.stderr
 
 
-def get_git_prompt_output(git_prompt_path, cwd, with_color=False, large_repo_size=None, max_traversal=None):
-    """Get output from git-prompt"""
+def get_git_prompt_output(git_prompt_path, cwd, with_color=False, large_repo_size=None, max_traversal=None, args='', stdin=None):
+    """Get stdout and stderr of git-prompt (args: extra per-test flags, appended last; stdin: its input)"""
     color_flag = "" if with_color else "--no-color"
     size_flag = f"--large-repo-size={large_repo_size}" if large_repo_size is not None else ""
     traversal_flag = f"--max-traversal={max_traversal}" if max_traversal is not None else "--max-traversal=10"
     local_flag = "--local"  # Always use --local in tests to avoid global config interference
     returncode, stdout, stderr = run_command(
-        f"{git_prompt_path} {color_flag} {size_flag} {traversal_flag} {local_flag}".strip(),
+        f"{git_prompt_path} {color_flag} {size_flag} {traversal_flag} {local_flag} {args}".strip(),
         cwd=cwd,
-        verbose=False
+        verbose=False,
+        stdin=stdin
     )
-    return stdout.rstrip()
+    return stdout.rstrip(), stderr
+
+
+# Fields of the --stats=json record, checked for tests that pass --stats=json ('' is the top level)
+STATS_JSON_FIELDS = {
+    '': ['version', 'source', 'total_ms', 'large_repo', 'phases_ms', 'walks', 'counters'],
+    'phases_ms': ['config', 'index_load', 'refresh', 'staged', 'untracked', 'submodules', 'divergence'],
+    'counters': ['commits_visited', 'commits_from_graph', 'commits_inflated', 'cache_hits',
+                 'cache_misses', 'cache_writes', 'index_entries', 'lstat_calls', 'queue_max'],
+}
+
+
+def check_stats_json(stderr, large_repo=None):
+    """
+    Parse the --stats=json record (the last JSON line on stderr) and return a
+    list of problems: missing fields, or large_repo not as expected (if given).
+    """
+    lines = [line for line in stderr.splitlines() if line.startswith('{')]
+    if not lines:
+        return ['no --stats=json record on stderr']
+    try:
+        record = json.loads(lines[-1])
+    except json.JSONDecodeError as e:
+        return [f'--stats=json record is not valid JSON: {e}']
+
+    problems = []
+    for section, fields in STATS_JSON_FIELDS.items():
+        values = record.get(section, {}) if section else record
+        for field in fields:
+            if field not in values:
+                problems.append(f"missing field {section + '.' if section else ''}{field}")
+    if large_repo is not None and record.get('large_repo') != large_repo:
+        problems.append(f"large_repo is {record.get('large_repo')}, expected {large_repo}")
+    return problems
 
 
 def match_output(actual, expected):
@@ -834,6 +870,9 @@ def run_test_suite(test_file, git_prompt_path, verbose=False, replace_expected=F
     binary_paths = [path for _, path in test_binaries]
     binary_names = [name for name, _ in test_binaries]
 
+    # Steps can run the reference binary as $GIT_PROMPT (e.g. to prime its caches)
+    os.environ['GIT_PROMPT'] = str(binary_paths[0])
+
     # Load test cases
     with open(test_file, 'r') as f:
         data = yaml.safe_load(f)
@@ -913,6 +952,10 @@ def run_test_suite(test_file, git_prompt_path, verbose=False, replace_expected=F
 
             # Get max_traversal from test (for tests that override it)
             max_traversal = test.get('max_traversal', None)
+            # Extra flags for tests of optional output modes (e.g. --exact-counts)
+            extra_args = test.get('args', '')
+            # Input for flags that read stdin (e.g. --repos-from=-)
+            stdin_text = test.get('stdin', None)
 
             # Run tests in both small and large repo modes
             # Use test-specific size if provided, otherwise use defaults
@@ -934,10 +977,14 @@ def run_test_suite(test_file, git_prompt_path, verbose=False, replace_expected=F
             for mode_name, large_repo_size, mode_expected in test_modes:
                 # Run all binaries and collect outputs
                 binary_outputs = []
-                for binary_path in binary_paths:
-                    colored = get_git_prompt_output(str(binary_path), test_dir, with_color=True, large_repo_size=large_repo_size, max_traversal=max_traversal)
+                stats_problems = []
+                for idx, binary_path in enumerate(binary_paths):
+                    colored, stderr = get_git_prompt_output(str(binary_path), test_dir, with_color=True, large_repo_size=large_repo_size, max_traversal=max_traversal, args=extra_args, stdin=stdin_text)
                     actual = ansi_to_markers(colored)
                     binary_outputs.append((colored, actual))
+                    if '--stats=json' in extra_args:
+                        expect_large = {'small': False, 'large': True}.get(mode_name)
+                        stats_problems += [f"{binary_names[idx]}: {problem}" for problem in check_stats_json(stderr, expect_large)]
 
                 # Use first binary (unpatched/baseline) as the reference
                 colored_output, actual = binary_outputs[0]
@@ -950,8 +997,8 @@ def run_test_suite(test_file, git_prompt_path, verbose=False, replace_expected=F
                         if output != actual:
                             diverged_binaries.append((idx, binary_names[idx], output))
 
-                # Compare baseline output against expected
-                test_passed = match_output(actual, mode_expected)
+                # Compare baseline output against expected (and the stats record, if requested)
+                test_passed = match_output(actual, mode_expected) and not stats_problems
                 binaries_agree = all_match
 
                 if not (test_passed and binaries_agree):
@@ -966,6 +1013,7 @@ def run_test_suite(test_file, git_prompt_path, verbose=False, replace_expected=F
                     'passed': test_passed,
                     'binaries_agree': binaries_agree,
                     'diverged_binaries': diverged_binaries,
+                    'stats_problems': stats_problems,
                 })
 
             # Print result summary
@@ -989,6 +1037,8 @@ def run_test_suite(test_file, git_prompt_path, verbose=False, replace_expected=F
                     if not mode_result['passed']:
                         print(f"    [{mode_result['mode']}] {binary_names[0]} output:   {Colors.YELLOW}{repr(mode_result['actual'])}{Colors.RESET}")
                         print(f"    [{mode_result['mode']}] Expected:                 {Colors.YELLOW}{repr(mode_result['expected'])}{Colors.RESET}")
+                        for problem in mode_result['stats_problems']:
+                            print(f"    [{mode_result['mode']}] Stats: {Colors.RED}{problem}{Colors.RESET}")
                     if not mode_result['binaries_agree']:
                         for idx, name_str, output in mode_result['diverged_binaries']:
                             print(f"    [{mode_result['mode']}] {name_str} diverged: {Colors.RED}{repr(output)}{Colors.RESET}")